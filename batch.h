@@ -0,0 +1,241 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "bstream.h"
+#include "huffman.h"
+
+// Many small messages compressed in one call, each into its own output in
+// one arena. A Batch keeps its scratch memory from call to call.
+//
+// Arena layout:
+//   the shared code table, if any: number of symbols - 1, then
+//   (symbol, length) pairs as in Huffman blocks
+//   for each message: raw size << 2 | kind as a varint (7 bits per byte,
+//   least significant first, high bit set on all bytes but the last),
+//   then the payload of that kind
+//   BitReader::kPadding zero bytes
+class Batch {
+  public:
+    enum Kind : uint8_t {
+        // A Huffman block with its own table
+        kOwnTable = 0,
+        kStored = 1,
+        // Only the codes, with the shared table
+        kSharedTable = 2,
+    };
+    static constexpr size_t kMaxMessage = 1 << 20;
+    static constexpr double kSharedSlack = 1.125;
+
+    // Compress `count` messages into `arena`. Output i is at
+    // [offsets[i], offsets[i + 1]), the shared table before offsets[0].
+    // With share_table, messages that the batch's table codes about as
+    // well as their own would are coded with it. Return false if a
+    // message is larger than kMaxMessage.
+    bool Compress(const char *const *inputs, const size_t *sizes,
+                  size_t count, bool share_table, std::vector<char> &arena,
+                  std::vector<size_t> &offsets);
+
+    // Use the table at the start of an arena for the next messages,
+    // return false unless it is a complete code
+    bool SetTable(const char *data, size_t n);
+    // Replace `out` with the bytes of one output, `in` must be followed by
+    // BitReader::kPadding readable bytes
+    DecodeStatus Decompress(const char *in, size_t n, std::vector<char> &out);
+
+  private:
+    static void PutVarint(std::vector<char> &out, uint64_t value);
+
+    // Histogram of the current message, zeroed again symbol by symbol
+    size_t freq[256] = {0};
+    uint8_t symbols[256];
+    uint8_t lens[256];
+    uint8_t shared_lens[256];
+    uint32_t shared_codes[256];
+    bool has_table = false;
+    DecodeTable table;
+    // Symbols decoded with the table since SetTable
+    size_t shared_decoded = 0;
+};
+
+bool Batch::Compress(const char *const *inputs, const size_t *sizes,
+                     size_t count, bool share_table, std::vector<char> &arena,
+                     std::vector<size_t> &offsets) {
+    arena.clear();
+    offsets.clear();
+    for (size_t m = 0; m < count; m++)
+        if (sizes[m] > kMaxMessage)
+            return false;
+
+    // One table for the whole batch, from its scaled down histogram so
+    // that codes stay short
+    memset(shared_lens, 0, sizeof(shared_lens));
+    bool shared = false;
+    if (share_table) {
+        size_t total[256] = {0};
+        for (size_t m = 0; m < count; m++)
+            for (size_t i = 0; i < sizes[m]; i++)
+                total[static_cast<unsigned char>(inputs[m][i])]++;
+        size_t largest = 1, present = 0;
+        for (int i = 0; i < 256; i++) {
+            largest = std::max(largest, total[i]);
+            present += total[i] != 0;
+        }
+        for (int i = 0; i < 256; i++)
+            if (total[i] != 0)
+                total[i] = 1 + total[i] * 4095 / largest;
+        // A single symbol would get an empty code
+        if (present > 1) {
+            shared = true;
+            Huffman::BuildLengths(total, shared_lens);
+            Huffman::AssignCodes(shared_lens, 256, shared_codes);
+            arena.push_back(static_cast<char>(present - 1));
+            for (int i = 0; i < 256; i++) {
+                if (shared_lens[i] == 0)
+                    continue;
+                arena.push_back(static_cast<char>(i));
+                arena.push_back(static_cast<char>(shared_lens[i]));
+            }
+        }
+    }
+
+    for (size_t m = 0; m < count; m++) {
+        const char *in = inputs[m];
+        size_t n = sizes[m];
+        offsets.push_back(arena.size());
+        for (size_t i = 0; i < n; i++)
+            freq[static_cast<unsigned char>(in[i])]++;
+        size_t distinct = 0;
+        for (int c = 0; c < 256; c++)
+            if (freq[c] != 0)
+                symbols[distinct++] = c;
+
+        // The shared table is good enough if it costs little more than the
+        // entropy of the message plus the table it would need, which is
+        // less than its own Huffman code would
+        Kind kind = n == 0 ? kStored : kOwnTable;
+        if (shared && n > 0) {
+            double shared_bits = 0, own_bits = 8 + 16.0 * distinct;
+            for (size_t s = 0; s < distinct; s++) {
+                size_t f = freq[symbols[s]];
+                if (shared_lens[symbols[s]] == 0)
+                    shared_bits = INFINITY;
+                shared_bits += f * double(shared_lens[symbols[s]]);
+                own_bits -= f * std::log2(double(f) / n);
+            }
+            if (shared_bits <= own_bits * kSharedSlack)
+                kind = kSharedTable;
+        }
+
+        size_t start = arena.size();
+        PutVarint(arena, uint64_t(n) << 2 | kind);
+        size_t payload = arena.size();
+        if (kind == kSharedTable) {
+            BitWriter bw(arena);
+            for (size_t i = 0; i < n; i++) {
+                unsigned char c = in[i];
+                bw.PutBits(shared_codes[c], shared_lens[c]);
+            }
+            bw.Close();
+        } else if (kind == kOwnTable) {
+            Huffman::BuildLengths(freq, lens);
+            Huffman::EncodeBlock(in, n, freq, lens, arena);
+            // Incompressible messages are stored, the varint keeps its size
+            if (arena.size() - payload >= n) {
+                arena.resize(start);
+                PutVarint(arena, uint64_t(n) << 2 | kStored);
+                kind = kStored;
+            }
+        }
+        if (kind == kStored)
+            arena.insert(arena.end(), in, in + n);
+
+        for (size_t s = 0; s < distinct; s++)
+            freq[symbols[s]] = 0;
+    }
+    offsets.push_back(arena.size());
+    arena.resize(arena.size() + BitReader::kPadding, 0);
+    return true;
+}
+
+bool Batch::SetTable(const char *data, size_t n) {
+    has_table = false;
+    if (n < 1)
+        return false;
+    size_t present = static_cast<unsigned char>(data[0]) + 1;
+    if (n != 1 + 2 * present)
+        return false;
+    memset(shared_lens, 0, sizeof(shared_lens));
+    for (size_t i = 0; i < present; i++) {
+        unsigned char c = data[1 + 2 * i];
+        if (shared_lens[c] != 0)
+            return false;
+        shared_lens[c] = data[2 + 2 * i];
+    }
+    has_table = table.Build(shared_lens);
+    shared_decoded = 0;
+    return has_table;
+}
+
+DecodeStatus Batch::Decompress(const char *in, size_t n,
+                               std::vector<char> &out) {
+    // Varint of at most 4 bytes, as messages are at most kMaxMessage
+    uint64_t value = 0;
+    size_t pos = 0;
+    for (int shift = 0; ; shift += 7) {
+        if (pos == n)
+            return kDecodeTruncated;
+        if (shift > 21)
+            return kDecodeCorrupt;
+        unsigned char byte = in[pos++];
+        value |= uint64_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+    size_t raw = value >> 2;
+    if (raw > kMaxMessage)
+        return kDecodeCorrupt;
+    out.resize(raw);
+
+    switch (value & 3) {
+    case kOwnTable:
+        return Huffman::DecodeBlock(in + pos, n - pos, out.data(), raw);
+    case kStored:
+        if (n - pos != raw)
+            return n - pos < raw ? kDecodeTruncated : kDecodeCorrupt;
+        memcpy(out.data(), in + pos, raw);
+        return kDecodeOk;
+    case kSharedTable: {
+        if (!has_table)
+            return kDecodeCorrupt;
+        // The table serves every message of the batch, so its multi-symbol
+        // entries pay once the messages add up to kMultiMin symbols
+        size_t before = shared_decoded;
+        shared_decoded += raw;
+        if (before < DecodeTable::kMultiMin &&
+            shared_decoded >= DecodeTable::kMultiMin)
+            table.BuildMulti();
+        BitReader br(in + pos, n - pos);
+        table.DecodeMany(br, out.data(), raw);
+        return br.Overrun() ? kDecodeTruncated : kDecodeOk;
+    }
+    default:
+        return kDecodeCorrupt;
+    }
+}
+
+void Batch::PutVarint(std::vector<char> &out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+#endif  // BATCH_H_
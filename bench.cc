@@ -0,0 +1,895 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "batch.h"
+#include "daemon.h"
+#include "huffman.h"
+#include "inflate.h"
+#include "kernels.h"
+#include "pipeline.h"
+#include "tans.h"
+#include "token.h"
+
+// Benchmarks, run as: bench <section> [inputfile]
+// Without an input file, frederick_douglass.txt is repeated to kDefaultSize.
+
+static const size_t kDefaultSize = 32 << 20;
+
+static std::string ReadFile(const std::string &filename) {
+    std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    return ss.str();
+}
+
+static void WriteFile(const std::string &filename, const std::string &data) {
+    std::ofstream ofs(filename, std::ios::out |
+                                std::ios::trunc |
+                                std::ios::binary);
+    ofs.write(data.data(), data.size());
+}
+
+// Flush a file and evict it from the page cache, so that the next run
+// has to go to the device
+static void DropCache(const std::string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static size_t FileSize(const std::string &filename) {
+    std::ifstream ifs(filename, std::ios::in | std::ios::binary | std::ios::ate);
+    return ifs.tellg();
+}
+
+// Time `run` with a cold cache on `input` and print its throughput
+static void Measure(const std::string &name, const std::string &input,
+                    size_t bytes, const std::function<void()> &run) {
+    DropCache(input);
+    auto start = std::chrono::steady_clock::now();
+    run();
+    std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+    std::cout << std::left << std::setw(36) << name << std::right
+              << std::fixed << std::setprecision(3)
+              << std::setw(9) << elapsed.count() << " s"
+              << std::setw(10) << std::setprecision(1)
+              << bytes / elapsed.count() / (1 << 20) << " MiB/s" << std::endl;
+}
+
+// Read, code and write one block after the other on the calling thread
+static void Blocking(const std::string &input, const std::string &output,
+                     bool compress) {
+    int in = open(input.c_str(), O_RDONLY);
+    int out = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    PipelineBlock b;
+    size_t got;
+    off_t offset = 0;
+    if (compress) {
+        Pipeline::WriteAll(out, BlockCodec::kMagic, sizeof(BlockCodec::kMagic));
+        BlockTable table;
+        uint32_t crc = 0;
+        for (;;) {
+            b.raw.resize(BlockCodec::kDefaultBlockSize);
+            Pipeline::ReadAll(in, b.raw.data(), b.raw.size(), offset, got);
+            if (got == 0)
+                break;
+            offset += got;
+            b.raw.resize(got);
+            crc = Kernels::Crc32c(b.raw.data(), b.raw.size(), crc);
+            b.coded.clear();
+            BlockCodec::Encode(b.raw.data(), b.raw.size(), b.coded, &table);
+            table.distance = 1;
+            Pipeline::WriteAll(out, b.coded.data(), b.coded.size());
+        }
+        b.coded.clear();
+        BlockCodec::EncodeEnd(crc, b.coded);
+        Pipeline::WriteAll(out, b.coded.data(), b.coded.size());
+    } else {
+        char header[BlockCodec::kHeaderSize];
+        offset = sizeof(BlockCodec::kMagic);
+        TableHistory history;
+        uint32_t crc = 0;
+        for (;;) {
+            Pipeline::ReadAll(in, header, 1, offset, got);
+            if (got != 1 || static_cast<uint8_t>(header[0]) == kBlockEnd)
+                break;
+            Pipeline::ReadAll(in, header + 1, sizeof(header) - 1, offset + 1, got);
+            offset += sizeof(header);
+            size_t coded = BlockCodec::GetU32(header + 5);
+            b.coded.resize(coded + BitReader::kPadding);
+            b.raw.resize(BlockCodec::GetU32(header + 1));
+            Pipeline::ReadAll(in, b.coded.data(), coded, offset, got);
+            offset += got;
+            if (header[0] == kBlockChecksum) {
+                if (BlockCodec::GetU32(b.coded.data()) != crc)
+                    std::cerr << "checksum mismatch" << std::endl;
+                continue;
+            }
+            BlockCodec::Decode(header[0], b.coded.data(), coded,
+                               b.raw.data(), b.raw.size(), history);
+            crc = Kernels::Crc32c(b.raw.data(), b.raw.size(), crc);
+            Pipeline::WriteAll(out, b.raw.data(), b.raw.size());
+        }
+    }
+    close(in);
+    close(out);
+}
+
+static void RunPipeline(const std::string &input, const std::string &output,
+                        bool compress, unsigned int workers) {
+    int in = open(input.c_str(), O_RDONLY);
+    int out = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (compress)
+        Pipeline::Compress(in, out, workers);
+    else
+        Pipeline::Decompress(in, out, workers);
+    close(in);
+    close(out);
+}
+
+// Blocking I/O against the reader/worker/writer pipeline
+static void BenchPipeline(const std::string &input) {
+    size_t bytes = FileSize(input);
+    unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+    std::cout << "Input " << bytes << " bytes, " << cores << " cores,"
+              << " cold page cache" << std::endl;
+
+    std::cout << "-- compress" << std::endl;
+    Measure("legacy Huffman::Compress", input, bytes, [&]() {
+        std::ifstream ifs(input, std::ios::in | std::ios::binary);
+        std::ofstream ofs("bench_legacy.zap", std::ios::out |
+                                              std::ios::trunc |
+                                              std::ios::binary);
+        Huffman::Compress(ifs, ofs);
+    });
+    Measure("blocking, 1 thread", input, bytes, [&]() {
+        Blocking(input, "bench_output.zap", true);
+    });
+    Measure("pipeline, 1 worker", input, bytes, [&]() {
+        RunPipeline(input, "bench_output.zap", true, 1);
+    });
+    std::string name = "pipeline, " + std::to_string(cores) + " workers";
+    if (cores > 1) {
+        Measure(name, input, bytes, [&]() {
+            RunPipeline(input, "bench_output.zap", true, cores);
+        });
+    }
+
+    std::cout << "-- decompress" << std::endl;
+    Measure("blocking, 1 thread", "bench_output.zap", bytes, [&]() {
+        Blocking("bench_output.zap", "bench_output.unzap", false);
+    });
+    Measure("pipeline, 1 worker", "bench_output.zap", bytes, [&]() {
+        RunPipeline("bench_output.zap", "bench_output.unzap", false, 1);
+    });
+    if (cores > 1) {
+        Measure(name, "bench_output.zap", bytes, [&]() {
+            RunPipeline("bench_output.zap", "bench_output.unzap", false, cores);
+        });
+    }
+
+    std::remove("bench_legacy.zap");
+    std::remove("bench_output.zap");
+    std::remove("bench_output.unzap");
+}
+
+// Blocks with a table of their own each, against blocks reusing the
+// table of the block before as is or changed
+static void BenchTables(const std::string &input) {
+    std::string text = ReadFile(input);
+    text.resize(std::min<size_t>(text.size(), 8 << 20));
+    std::cout << "Input " << text.size() << " bytes" << std::endl;
+    for (size_t block_size : {1024, 4096, 16384, 131072}) {
+        std::cout << "-- blocks of " << block_size << " bytes" << std::endl;
+        for (bool reuse : {false, true}) {
+            std::vector<char> zapped;
+            BlockTable table;
+            auto start = std::chrono::steady_clock::now();
+            zapped.insert(zapped.end(), BlockCodec::kMagic,
+                          BlockCodec::kMagic + sizeof(BlockCodec::kMagic));
+            for (size_t pos = 0; pos < text.size(); pos += block_size) {
+                size_t n = std::min(block_size, text.size() - pos);
+                BlockCodec::Encode(&text[pos], n, zapped,
+                                   reuse ? &table : nullptr);
+                table.distance = 1;
+            }
+            BlockCodec::EncodeEnd(Kernels::Crc32c(text.data(), text.size()),
+                                  zapped);
+            std::chrono::duration<double> encoding =
+                    std::chrono::steady_clock::now() - start;
+
+            size_t n = zapped.size();
+            zapped.resize(n + BitReader::kPadding, 0);
+            std::vector<char> output;
+            output.reserve(text.size());
+            start = std::chrono::steady_clock::now();
+            BlockCodec::DecodeStream(zapped.data(), n, output);
+            std::chrono::duration<double> decoding =
+                    std::chrono::steady_clock::now() - start;
+            std::cout << std::left << std::setw(16)
+                      << (reuse ? "reused tables" : "own tables") << std::right
+                      << std::fixed << std::setprecision(4)
+                      << std::setw(8) << double(n) / text.size() << " ratio"
+                      << std::setprecision(1)
+                      << std::setw(9) << text.size() / encoding.count() / (1 << 20)
+                      << " MiB/s in"
+                      << std::setw(9) << text.size() / decoding.count() / (1 << 20)
+                      << " MiB/s out" << std::endl;
+        }
+    }
+}
+
+// Canonical Huffman decoding one symbol per lookup against several
+static void BenchMulti(const std::string &input) {
+    std::string text = ReadFile(input);
+    text.resize(std::min<size_t>(text.size(), 8 << 20));
+    std::mt19937 gen(3);
+    // 200 symbols, close to 8 bits a code
+    std::string uniform(text.size(), '\0');
+    for (auto &c : uniform)
+        c = static_cast<char>(gen() % 200);
+
+    for (auto &dataset : {std::make_pair("text", &text),
+                          std::make_pair("near-uniform", &uniform)}) {
+        const std::string &data = *dataset.second;
+        size_t freq[256] = {0};
+        for (char c : data)
+            freq[static_cast<unsigned char>(c)]++;
+        uint8_t lens[256];
+        Huffman::BuildLengths(freq, lens);
+        double bits = 0;
+        for (int i = 0; i < 256; i++)
+            bits += double(freq[i]) * lens[i];
+        std::vector<char> coded;
+        Huffman::EncodeCodes(data.data(), data.size(), lens, coded);
+        coded.resize(coded.size() + BitReader::kPadding, 0);
+        std::cout << "-- " << dataset.first << ", " << std::fixed
+                  << std::setprecision(2) << bits / data.size()
+                  << " bits per symbol" << std::endl;
+
+        std::string output(data.size(), '\0');
+        for (bool multi : {false, true}) {
+            DecodeTable table;
+            table.Build(lens);
+            auto start = std::chrono::steady_clock::now();
+            bool built = multi && table.BuildMulti();
+            std::chrono::duration<double> building =
+                    std::chrono::steady_clock::now() - start;
+            BitReader br(coded.data(), coded.size() - BitReader::kPadding);
+            start = std::chrono::steady_clock::now();
+            if (multi) {
+                table.DecodeMany(br, &output[0], output.size());
+            } else {
+                for (size_t i = 0; i < output.size(); i++)
+                    output[i] = table.Decode(br);
+            }
+            std::chrono::duration<double> elapsed =
+                    std::chrono::steady_clock::now() - start;
+            std::cout << std::left << std::setw(20)
+                      << (multi ? "several per lookup" : "one per lookup")
+                      << std::right << std::setprecision(1) << std::setw(9)
+                      << data.size() / elapsed.count() / (1 << 20) << " MiB/s"
+                      << std::setw(9) << building.count() * 1e6 << " us to build"
+                      << (multi && !built ? ", codes too long to build" : "")
+                      << (output == data ? "" : "  wrong output") << std::endl;
+        }
+    }
+}
+
+// Single-stream files decoded sequentially and speculatively in parallel,
+// the input must be ASCII as for Huffman::Compress
+static void BenchLegacy(const std::string &input) {
+    size_t bytes = FileSize(input);
+    {
+        std::ifstream ifs(input, std::ios::in | std::ios::binary);
+        std::ofstream ofs("bench_legacy.zap", std::ios::out |
+                                              std::ios::trunc |
+                                              std::ios::binary);
+        Huffman::Compress(ifs, ofs);
+    }
+    std::cout << "Input " << bytes << " bytes, zapped "
+              << FileSize("bench_legacy.zap") << " bytes" << std::endl;
+
+    auto run = [&](unsigned int threads) {
+        std::ifstream ifs("bench_legacy.zap", std::ios::in | std::ios::binary);
+        std::ofstream ofs("bench_legacy.unzap", std::ios::out |
+                                                std::ios::trunc |
+                                                std::ios::binary);
+        if (threads == 0)
+            Huffman::Decompress(ifs, ofs);
+        else
+            Huffman::DecompressParallel(ifs, ofs, threads);
+    };
+    Measure("Huffman::Decompress", "bench_legacy.zap", bytes, [&]() {
+        run(0);
+    });
+    std::string expected = ReadFile("bench_legacy.unzap");
+    unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned int threads : {1u, 2u, 4u, cores}) {
+        std::string name = "speculative, " + std::to_string(threads) + " threads";
+        Measure(name, "bench_legacy.zap", bytes, [&]() {
+            run(threads);
+        });
+        if (ReadFile("bench_legacy.unzap") != expected)
+            std::cout << "  output differs from Huffman::Decompress" << std::endl;
+    }
+    // Pulled through a small buffer, without writing it anywhere
+    for (size_t avail : {64, 4096, 65536}) {
+        std::string name = "Inflater, " + std::to_string(avail) + " byte output";
+        size_t total = 0;
+        Measure(name, "bench_legacy.zap", bytes, [&]() {
+            std::ifstream ifs("bench_legacy.zap", std::ios::in | std::ios::binary);
+            Inflater inflater;
+            std::vector<char> in(65536), out(avail);
+            InflateStatus status = kInflateNeedInput;
+            size_t start = 0, end = 0;
+            while (status == kInflateNeedInput || status == kInflateNeedOutput) {
+                if (start == end && status == kInflateNeedInput) {
+                    ifs.read(in.data(), in.size());
+                    start = 0;
+                    end = ifs.gcount();
+                    if (end == 0)
+                        break;
+                }
+                size_t in_used, out_used;
+                status = inflater.Inflate(in.data() + start, end - start,
+                                          in_used, out.data(), out.size(),
+                                          out_used);
+                start += in_used;
+                total += out_used;
+            }
+        });
+        if (total != expected.size())
+            std::cout << "  output size differs from Huffman::Decompress" << std::endl;
+    }
+    std::remove("bench_legacy.zap");
+    std::remove("bench_legacy.unzap");
+}
+
+using BlockEncoder = std::function<void(const char *, size_t,
+                                        std::vector<char> &)>;
+using BlockDecoder = std::function<DecodeStatus(const char *, size_t,
+                                                char *, size_t)>;
+
+// Code `data` block by block in memory and print ratio and throughput
+static void MeasureCoder(const std::string &name, const std::string &data,
+                         const BlockEncoder &encode,
+                         const BlockDecoder &decode,
+                         size_t block_size = BlockCodec::kDefaultBlockSize) {
+    size_t blocks = (data.size() + block_size - 1) / block_size;
+    std::vector<std::vector<char>> coded(blocks);
+
+    auto start = std::chrono::steady_clock::now();
+    size_t coded_size = 0;
+    for (size_t i = 0; i < blocks; i++) {
+        size_t n = std::min(block_size, data.size() - i * block_size);
+        encode(&data[i * block_size], n, coded[i]);
+        coded_size += coded[i].size();
+        coded[i].resize(coded[i].size() + BitReader::kPadding, 0);
+    }
+    std::chrono::duration<double> encode_time =
+            std::chrono::steady_clock::now() - start;
+
+    std::string output(data.size(), '\0');
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < blocks; i++) {
+        size_t n = std::min(block_size, data.size() - i * block_size);
+        decode(coded[i].data(), coded[i].size() - BitReader::kPadding,
+               &output[i * block_size], n);
+    }
+    std::chrono::duration<double> decode_time =
+            std::chrono::steady_clock::now() - start;
+    if (output != data)
+        std::cout << name << ": round trip mismatch" << std::endl;
+
+    double mib = data.size() / double(1 << 20);
+    std::cout << std::left << std::setw(12) << name << std::right
+              << std::fixed << std::setprecision(3)
+              << std::setw(8) << double(coded_size) / data.size() << " ratio"
+              << std::setprecision(1)
+              << std::setw(9) << mib / encode_time.count() << " MiB/s enc"
+              << std::setw(9) << mib / decode_time.count() << " MiB/s dec"
+              << std::endl;
+}
+
+// Huffman against tANS and the per-block choice between them
+static void BenchTans(const std::string &input) {
+    std::string text = ReadFile(input);
+    std::mt19937 gen(1);
+    // A status code column, mostly 200s
+    std::string skewed(text.size(), '\0');
+    for (auto &c : skewed) {
+        unsigned int r = gen() % 1000;
+        c = r < 950 ? '2' : r < 985 ? '3' : r < 997 ? '4' : '5';
+    }
+    std::string uniform(text.size(), '\0');
+    for (auto &c : uniform)
+        c = static_cast<char>(gen());
+
+    BlockEncoder huffman_encode = [](const char *in, size_t n,
+                                     std::vector<char> &out) {
+        Huffman::EncodeBlock(in, n, out);
+    };
+    BlockEncoder tans_encode = [](const char *in, size_t n,
+                                  std::vector<char> &out) {
+        Tans::EncodeBlock(in, n, out);
+    };
+    // Frames, with the type byte in front of the payload
+    BlockEncoder auto_encode = [](const char *in, size_t n,
+                                  std::vector<char> &out) {
+        BlockCodec::Encode(in, n, out);
+    };
+    BlockDecoder auto_decode = [](const char *in, size_t n,
+                                  char *out, size_t raw) {
+        return BlockCodec::Decode(in[0], in + BlockCodec::kHeaderSize,
+                                  n - BlockCodec::kHeaderSize, out, raw);
+    };
+
+    for (auto &dataset : {std::make_pair("text", &text),
+                          std::make_pair("skewed", &skewed),
+                          std::make_pair("uniform", &uniform)}) {
+        std::cout << "-- " << dataset.first << ", "
+                  << dataset.second->size() << " bytes" << std::endl;
+        MeasureCoder("huffman", *dataset.second, huffman_encode,
+                     Huffman::DecodeBlock);
+        MeasureCoder("tans", *dataset.second, tans_encode, Tans::DecodeBlock);
+        MeasureCoder("auto", *dataset.second, auto_encode, auto_decode);
+    }
+}
+
+// 16-bit token streams coded as tokens, against their bytes coded as bytes
+static void BenchTokens(const std::string &input) {
+    const size_t count = 4 << 20;
+    std::mt19937 gen(11);
+    // Token ids of a 50000 word vocabulary, Zipf distributed
+    std::vector<double> weights(50000);
+    for (size_t i = 0; i < weights.size(); i++)
+        weights[i] = 1.0 / (i + 1);
+    std::discrete_distribution<int> zipf(weights.begin(), weights.end());
+    std::vector<uint16_t> ids(count);
+    for (auto &id : ids)
+        id = zipf(gen);
+    // Milliseconds between samples of a 1 s timer with jitter, and a few
+    // late ones
+    std::normal_distribution<> jitter(0, 15);
+    std::vector<uint16_t> deltas(count);
+    for (auto &d : deltas)
+        d = gen() % 100 == 0 ? 1000 + gen() % 4000
+                             : 1000 + std::lround(jitter(gen));
+
+    TokenCoder<uint16_t, 65536> tokens;
+    std::vector<uint16_t> symbols;
+    BlockEncoder token_encode = [&](const char *in, size_t n,
+                                    std::vector<char> &out) {
+        symbols.resize(n / 2);
+        memcpy(symbols.data(), in, n);
+        tokens.Encode(symbols.data(), symbols.size(), out);
+    };
+    BlockDecoder token_decode = [&](const char *in, size_t n,
+                                    char *out, size_t raw) {
+        symbols.resize(raw / 2);
+        DecodeStatus status = tokens.Decode(in, n, symbols.data(),
+                                            symbols.size());
+        memcpy(out, symbols.data(), raw);
+        return status;
+    };
+    BlockEncoder byte_encode = [](const char *in, size_t n,
+                                  std::vector<char> &out) {
+        Huffman::EncodeBlock(in, n, out);
+    };
+
+    for (auto &dataset : {std::make_pair("token ids", &ids),
+                          std::make_pair("timestamp deltas", &deltas)}) {
+        const std::vector<uint16_t> &stream = *dataset.second;
+        std::string data(reinterpret_cast<const char *>(stream.data()),
+                         2 * stream.size());
+        std::cout << "-- " << dataset.first << ", " << stream.size()
+                  << " 16-bit symbols" << std::endl;
+        // Large blocks, so that tables of thousands of tokens pay off
+        MeasureCoder("bytes", data, byte_encode, Huffman::DecodeBlock,
+                     BlockCodec::kMaxBlockSize);
+        MeasureCoder("tokens", data, token_encode, token_decode,
+                     BlockCodec::kMaxBlockSize);
+    }
+}
+
+// Print throughput and latency percentiles of `latencies` requests taken
+// within `seconds`
+static void ReportLatency(const std::string &name, std::vector<double> &latencies,
+                          double seconds) {
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+        return latencies[std::min(latencies.size() - 1,
+                                  size_t(p * latencies.size()))] * 1e6;
+    };
+    std::cout << std::left << std::setw(28) << name << std::right
+              << std::fixed << std::setprecision(0)
+              << std::setw(10) << latencies.size() / seconds << " req/s"
+              << std::setprecision(1)
+              << std::setw(9) << percentile(0.5) << " us p50"
+              << std::setw(9) << percentile(0.99) << " us p99" << std::endl;
+}
+
+// Messages of 100 B to 2 KiB, one call each against batches
+static void BenchBatch(const std::string &input) {
+    const size_t kMessages = 20000;
+    const size_t kBatch = 256;
+    std::string text = ReadFile(input);
+    std::mt19937 gen(4);
+    std::vector<std::string> messages;
+    for (size_t i = 0; i < kMessages; i++) {
+        size_t size = 100 + gen() % 1949;
+        messages.push_back(text.substr(gen() % (text.size() - size), size));
+    }
+    std::vector<const char *> inputs;
+    std::vector<size_t> sizes;
+    size_t total = 0;
+    for (auto &message : messages) {
+        inputs.push_back(message.data());
+        sizes.push_back(message.size());
+        total += message.size();
+    }
+    std::cout << kMessages << " messages, " << total << " bytes, batches of "
+              << kBatch << std::endl;
+
+    auto report = [&](const std::string &name, size_t coded,
+                      const std::function<void()> &run) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+        std::cout << std::left << std::setw(28) << name << std::right
+                  << std::fixed << std::setprecision(0)
+                  << std::setw(10) << kMessages / elapsed.count() << " msg/s"
+                  << std::setprecision(3)
+                  << std::setw(8) << double(coded) / total << " ratio" << std::endl;
+    };
+
+    size_t coded = 0;
+    std::vector<char> out;
+    auto per_message = [&](bool framed) {
+        coded = 0;
+        for (auto &message : messages) {
+            out.clear();
+            if (framed)
+                BlockCodec::EncodeStream(message.data(), message.size(), out);
+            else
+                Huffman::EncodeBlock(message.data(), message.size(), out);
+            coded += out.size();
+        }
+    };
+    per_message(true);
+    report("EncodeStream per message", coded, [&]() { per_message(true); });
+    per_message(false);
+    report("EncodeBlock per message", coded, [&]() { per_message(false); });
+
+    Batch batch;
+    std::vector<size_t> offsets;
+    auto batches = [&](bool share_table) {
+        coded = 0;
+        for (size_t i = 0; i < kMessages; i += kBatch) {
+            size_t count = std::min(kBatch, kMessages - i);
+            batch.Compress(&inputs[i], &sizes[i], count, share_table, out,
+                           offsets);
+            coded += offsets.back();
+        }
+    };
+    batches(false);
+    report("Batch, own tables", coded, [&]() { batches(false); });
+    batches(true);
+    report("Batch, shared table", coded, [&]() { batches(true); });
+}
+
+// The kernels against the plain loops they replace, then at every tier
+// the CPU has, MiB/s of input
+static void BenchKernels(const std::string &input) {
+    std::string text = ReadFile(input);
+    text.resize(std::min<size_t>(text.size(), 8 << 20));
+    size_t freq[256];
+    Kernels::Histogram(text.data(), text.size(), freq);
+    uint8_t lens[256];
+    Huffman::BuildLengths(freq, lens);
+    uint32_t codes[256];
+    Huffman::AssignCodes(lens, 256, codes);
+    DecodeTable table;
+    table.Build(lens);
+    table.BuildMulti();
+    std::vector<char> packed;
+    std::string output(text.size(), '\0');
+
+    auto report = [&](const std::string &name,
+                      const std::function<void()> &kernel) {
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < 5; r++)
+            kernel();
+        std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+        std::cout << std::left << std::setw(24) << name << std::right
+                  << std::fixed << std::setprecision(1) << std::setw(10)
+                  << 5 * text.size() / elapsed.count() / (1 << 20)
+                  << " MiB/s" << std::endl;
+    };
+    report("histogram, byte loop", [&]() {
+        std::fill(freq, freq + 256, 0);
+        for (unsigned char c : text)
+            freq[c]++;
+    });
+    report("packing, BitWriter", [&]() {
+        packed.clear();
+        BitWriter bw(packed);
+        for (unsigned char c : text)
+            bw.PutBits(codes[c], lens[c]);
+        bw.Close();
+    });
+    std::vector<char> expected = packed;
+    for (CpuTier tier : {kTierScalar, kTierSse42, kTierAvx2, kTierBmi2}) {
+        if (tier > Kernels::Detected())
+            break;
+        Kernels::Use(tier);
+        std::string name = std::string(", ") + Kernels::Name(tier);
+        report("histogram" + name, [&]() {
+            Kernels::Histogram(text.data(), text.size(), freq);
+        });
+        report("packing" + name, [&]() {
+            packed.clear();
+            Kernels::PackCodes(text.data(), text.size(), codes, lens, packed);
+        });
+        if (packed != expected)
+            std::cout << "wrong packing" << std::endl;
+        packed.resize(packed.size() + BitReader::kPadding, 0);
+        report("decoding" + name, [&]() {
+            BitReader br(packed.data(), packed.size() - BitReader::kPadding);
+            table.DecodeMany(br, &output[0], output.size());
+        });
+        if (output != text)
+            std::cout << "wrong output" << std::endl;
+        uint32_t crc = 0;
+        report("crc32c" + name, [&]() {
+            crc = Kernels::Crc32c(text.data(), text.size(), crc);
+        });
+    }
+    Kernels::Use(Kernels::Detected());
+}
+
+// In-place code lengths against the PQueue tree, alone and in the coding
+// of small blocks
+static void BenchLengths(const std::string &input) {
+    using Builder = void (*)(const size_t *, uint8_t *);
+    std::mt19937_64 gen(9);
+    std::cout << "-- code lengths, ns per build" << std::endl;
+    for (int symbols : {2, 16, 64, 256}) {
+        std::vector<std::vector<size_t>> histograms(1000, std::vector<size_t>(256));
+        for (auto &freq : histograms)
+            for (int i = 0; i < symbols; i++)
+                freq[i * 256 / symbols] = 1 + gen() % 10000;
+        std::cout << std::setw(3) << symbols << " symbols";
+        for (auto builder : {std::make_pair("heap", Builder(Huffman::BuildLengthsHeap)),
+                             std::make_pair("in place", Builder(Huffman::BuildLengths))}) {
+            uint8_t lens[256];
+            auto start = std::chrono::steady_clock::now();
+            for (int r = 0; r < 20; r++)
+                for (auto &freq : histograms)
+                    builder.second(freq.data(), lens);
+            std::chrono::duration<double> elapsed =
+                    std::chrono::steady_clock::now() - start;
+            std::cout << std::fixed << std::setprecision(0) << std::setw(10)
+                      << elapsed.count() * 1e9 / (20 * histograms.size())
+                      << " " << builder.first;
+        }
+        std::cout << std::endl;
+    }
+
+    std::string text = ReadFile(input);
+    text.resize(std::min<size_t>(text.size(), 8 << 20));
+    std::cout << "-- Huffman blocks of the input, MiB/s" << std::endl;
+    for (size_t block_size : {256, 1024, 4096, 65536}) {
+        std::cout << std::setw(6) << block_size << " bytes";
+        for (auto builder : {std::make_pair("heap", Builder(Huffman::BuildLengthsHeap)),
+                             std::make_pair("in place", Builder(Huffman::BuildLengths))}) {
+            std::vector<char> out;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t pos = 0; pos + block_size <= text.size(); pos += block_size) {
+                size_t freq[256] = {0};
+                for (size_t i = pos; i < pos + block_size; i++)
+                    freq[static_cast<unsigned char>(text[i])]++;
+                uint8_t lens[256];
+                builder.second(freq, lens);
+                out.clear();
+                Huffman::EncodeBlock(&text[pos], block_size, freq, lens, out);
+            }
+            std::chrono::duration<double> elapsed =
+                    std::chrono::steady_clock::now() - start;
+            std::cout << std::fixed << std::setprecision(1) << std::setw(10)
+                      << text.size() / elapsed.count() / (1 << 20)
+                      << " " << builder.first;
+        }
+        std::cout << std::endl;
+    }
+}
+
+// Clients on localhost sending small compress requests to an in-process
+// zapd, one at a time or pipelined in batches
+static void BenchDaemon(const std::string &input) {
+    const size_t kMessageSize = 4096;
+    const size_t kRequests = 4000;
+    std::string text = ReadFile(input);
+    std::vector<std::string> messages;
+    for (size_t i = 0; i + kMessageSize <= text.size() && messages.size() < 1024;
+         i += kMessageSize)
+        messages.push_back(text.substr(i, kMessageSize));
+    unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+    std::cout << messages.size() << " messages of " << kMessageSize
+              << " bytes, " << cores << " workers" << std::endl;
+
+    // The same work without a daemon
+    std::vector<double> latencies;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<char> zapped;
+    for (size_t i = 0; i < kRequests; i++) {
+        auto request = std::chrono::steady_clock::now();
+        const std::string &message = messages[i % messages.size()];
+        zapped.clear();
+        BlockCodec::EncodeStream(message.data(), message.size(), zapped);
+        latencies.push_back(std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - request).count());
+    }
+    ReportLatency("in process, 1 thread", latencies,
+                  std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - start).count());
+
+    const char *socket = "bench_zapd.sock";
+    ZapServer server(socket, cores);
+    if (!server.Start()) {
+        std::cerr << "Error: cannot listen on " << socket << std::endl;
+        return;
+    }
+    for (size_t batch : {1, 32}) {
+        for (unsigned int clients : {1, 4, 16, 64}) {
+            std::mutex mutex;
+            latencies.clear();
+            std::vector<std::thread> threads;
+            start = std::chrono::steady_clock::now();
+            for (unsigned int c = 0; c < clients; c++) {
+                threads.emplace_back([&, c]() {
+                    ZapClient client;
+                    if (!client.Connect(socket))
+                        return;
+                    std::vector<double> mine;
+                    std::vector<std::string> inputs, outputs;
+                    std::vector<uint8_t> statuses;
+                    for (size_t i = c; i < kRequests / clients * clients;
+                         i += clients * batch) {
+                        inputs.clear();
+                        for (size_t j = 0; j < batch; j++)
+                            inputs.push_back(messages[(i + j) % messages.size()]);
+                        auto request = std::chrono::steady_clock::now();
+                        client.CallMany(kDaemonCompress, inputs, statuses, outputs);
+                        double elapsed = std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - request).count();
+                        // Every request of a batch waits for the whole batch
+                        mine.insert(mine.end(), batch, elapsed);
+                    }
+                    std::lock_guard<std::mutex> lock(mutex);
+                    latencies.insert(latencies.end(), mine.begin(), mine.end());
+                });
+            }
+            for (auto &thread : threads)
+                thread.join();
+            double seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count();
+            ReportLatency("zapd, batch " + std::to_string(batch) + ", " +
+                          std::to_string(clients) + " clients",
+                          latencies, seconds);
+        }
+    }
+    server.Stop();
+}
+
+// Backup-like data, snapshots of the input with a few edits each, with
+// and without dedup
+static void BenchDedup(const std::string &input) {
+    std::string text = ReadFile(input);
+    text.resize(std::min<size_t>(text.size(), 4 << 20));
+    std::mt19937 gen(5);
+    std::string snapshots, snapshot = text;
+    for (int s = 0; s < 8; s++) {
+        // Edits of a few bytes, some changing the size
+        for (int e = 0; e < 16; e++) {
+            size_t pos = gen() % snapshot.size();
+            if (gen() % 2)
+                snapshot.insert(pos, "edit " + std::to_string(gen() % 1000));
+            else
+                snapshot[pos] = static_cast<char>('A' + gen() % 26);
+        }
+        snapshots += snapshot;
+    }
+    WriteFile("bench_snapshots", snapshots);
+    std::cout << "8 snapshots, " << snapshots.size() << " bytes" << std::endl;
+
+    for (auto mode : {std::make_pair("no dedup", kDedupNone),
+                      std::make_pair("fixed blocks", kDedupFixed),
+                      std::make_pair("content-defined", kDedupContent)}) {
+        int in = open("bench_snapshots", O_RDONLY);
+        int out = open("bench_output.zap", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        DedupStats stats;
+        auto start = std::chrono::steady_clock::now();
+        Pipeline::Compress(in, out, std::max(1u, std::thread::hardware_concurrency()),
+                           BlockCodec::kDefaultBlockSize, mode.second, &stats);
+        std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+        close(in);
+        close(out);
+
+        uint64_t unique = stats.bytes - stats.duplicate_bytes;
+        std::cout << std::left << std::setw(16) << mode.first << std::right
+                  << std::fixed << std::setprecision(3)
+                  << std::setw(7) << double(FileSize("bench_output.zap")) /
+                                     snapshots.size() << " ratio"
+                  << std::setw(7) << (unique > 0 ? double(stats.bytes) / unique : 1)
+                  << " dedup" << std::setprecision(1)
+                  << std::setw(9) << stats.bytes / std::max(stats.hash_seconds, 1e-9) /
+                                     (1 << 20) << " MiB/s hash"
+                  << std::setw(8) << stats.index_bytes / 1024.0 << " KiB index"
+                  << std::setw(8) << snapshots.size() / elapsed.count() / (1 << 20)
+                  << " MiB/s" << std::endl;
+    }
+    std::remove("bench_snapshots");
+    std::remove("bench_output.zap");
+}
+
+int main(int argc, char* argv[]) {
+    std::map<std::string, std::function<void(const std::string &)>> sections{
+        {"batch", BenchBatch},
+        {"daemon", BenchDaemon},
+        {"dedup", BenchDedup},
+        {"kernels", BenchKernels},
+        {"legacy", BenchLegacy},
+        {"lengths", BenchLengths},
+        {"multi", BenchMulti},
+        {"pipeline", BenchPipeline},
+        {"tables", BenchTables},
+        {"tans", BenchTans},
+        {"tokens", BenchTokens},
+    };
+    if (argc < 2 || argc > 3 || sections.count(argv[1]) == 0) {
+        std::cerr << "Usage: " << argv[0] << " <section> [inputfile]" << std::endl;
+        std::cerr << "Sections:";
+        for (auto &section : sections)
+            std::cerr << ' ' << section.first;
+        std::cerr << std::endl;
+        exit(1);
+    }
+
+    std::string input = "bench_input";
+    if (argc == 3) {
+        input = argv[2];
+    } else {
+        std::string text = ReadFile("frederick_douglass.txt");
+        std::string data;
+        while (data.size() < kDefaultSize)
+            data += text;
+        data.resize(kDefaultSize);
+        WriteFile(input, data);
+    }
+    sections[argv[1]](input);
+    if (argc == 2)
+        std::remove(input.c_str());
+}
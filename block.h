@@ -0,0 +1,744 @@
+#ifndef BLOCK_H_
+#define BLOCK_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "huffman.h"
+#include "order1.h"
+#include "rle.h"
+#include "tans.h"
+
+// Framed zap format, made of independently coded blocks:
+//
+//   magic      4 bytes, kMagic
+//   block      type (1 byte), raw size and coded size (4 bytes each,
+//              most significant first), then the coded payload
+//   ...
+//   checksum   a kBlockChecksum block
+//   end        type kBlockEnd alone
+//
+// Blocks are independent but for kBlockHuffmanRepeat and kBlockHuffmanDelta,
+// which use the code table of an earlier block of the member. A block has
+// a table if it is a Huffman block of several symbols, or one of these two.
+//
+// Such streams, or members, may be concatenated, as by zap --append, and
+// decode to the concatenation of their contents. Members written before
+// the checksum was added start with kOldMagic and are rejected as
+// unsupported.
+//
+// A legacy single-stream file starts either with an internal node (bit 0)
+// or with a leaf followed by a 7-bit char (bits 10), so its first byte is
+// always below 0xC0 and can't be mistaken for the magic.
+enum BlockType : uint8_t {
+    kBlockHuffman = 0,
+    kBlockStored = 1,
+    kBlockTans = 2,
+    kBlockRle = 3,
+    kBlockOrder1 = 4,
+    // Same bytes as earlier in the member, at the 64-bit offset in the
+    // payload (most significant first)
+    kBlockRef = 5,
+    // Huffman codes with the table of the block `distance` blocks back
+    // (1 byte) as is, or after changes to its lengths: their number - 1
+    // (1 byte), then (symbol, length) pairs by increasing symbol
+    kBlockHuffmanRepeat = 6,
+    kBlockHuffmanDelta = 7,
+    // CRC32C of the bytes of the whole member, in 4 bytes (most significant
+    // first), with a raw size of 0. Every member ends with one
+    kBlockChecksum = 8,
+    kBlockEnd = 0xFF,
+};
+
+// Predicted outcome of coding one block, see BlockCodec::Estimate
+struct BlockEstimate {
+    BlockType type = kBlockHuffman;
+    // Predicted payload size for every block type
+    double bytes[kBlockOrder1 + 1] = {0};
+    size_t sampled = 0;
+    // Time the chosen coder takes on the block, when asked for
+    double seconds = 0;
+};
+
+// The code table an encoded block may reuse, and the one it leaves
+struct BlockTable {
+    // How many blocks before the next one it belongs to, 0 for none
+    size_t distance = 0;
+    // All 0 for a block without a table
+    uint8_t lens[256] = {0};
+};
+
+// Decoder side of table reuse: the tables of the last kDepth blocks of a
+// member, built once and shared by the blocks that use them again
+class TableHistory {
+  public:
+    static constexpr size_t kDepth = 32;
+
+    struct Table {
+        uint8_t lens[256];
+        DecodeTable decode;
+    };
+
+    // Forget every table, at the start of a member
+    void Reset();
+    // Find the table of the next block from the start of its payload and
+    // remember it. `table` is null if the block has none, else its codes
+    // start `used` bytes into the payload. New tables of blocks of `raw`
+    // bytes get multi-symbol entries if that pays.
+    DecodeStatus Next(uint8_t type, const char *in, size_t n, size_t raw,
+                      std::shared_ptr<const Table> &table, size_t &used);
+
+  private:
+    std::shared_ptr<const Table> tables[kDepth];
+    // Blocks of the member so far
+    size_t blocks = 0;
+};
+
+class BlockCodec {
+  public:
+    static constexpr char kMagic[4] = {'\xC5', 'Z', 'A', '2'};
+    static constexpr char kOldMagic[4] = {'\xC5', 'Z', 'A', 'P'};
+    static constexpr size_t kHeaderSize = 9;
+    static constexpr size_t kDefaultBlockSize = 1 << 17;
+    static constexpr size_t kMaxBlockSize = 1 << 20;
+
+    static bool HasMagic(const char *data, size_t n);
+    static bool HasOldMagic(const char *data, size_t n);
+
+    // Append the frame of one block, using the smallest representation.
+    // With `table`, a Huffman block may use the table it holds. On return
+    // it holds the block's own table, the caller sets its distance.
+    static void Encode(const char *in, size_t n, std::vector<char> &frame,
+                       BlockTable *table = nullptr);
+    // Predict the payload size of every block type from evenly spaced
+    // samples of kSampleSegment bytes, 1/kSampleFraction of the block but
+    // no more than the kSampleWhole bytes of blocks sampled whole, and
+    // return the smallest. The samples only depend on the size of the
+    // block, so the choice is the same on every run, and the cap bounds
+    // the time spent on large blocks.
+    // With `time_coder`, the chosen coder is also timed on the whole block:
+    // samples would leave out what coding a block costs whatever its size,
+    // such as building tables.
+    static constexpr size_t kSampleSegment = 256;
+    static constexpr size_t kSampleFraction = 32;
+    static constexpr size_t kSampleWhole = 4096;
+    // Fewest samples of a context to trust its order-1 statistics
+    static constexpr size_t kSampleContext = 8;
+    static BlockType Estimate(const char *in, size_t n, BlockEstimate &estimate,
+                              bool time_coder = false);
+
+    // Pick the entropy coder with the smallest estimated size, both are
+    // estimated from the same histogram
+    static BlockType Choose(const size_t freq[256], size_t n,
+                            uint8_t lens[256], uint16_t norm[256],
+                            size_t &table_log, double *bits = nullptr);
+
+    // Append the frame of a block repeating `n` bytes from `offset`
+    static constexpr size_t kRefSize = 8;
+    static void EncodeRef(uint64_t offset, size_t n, std::vector<char> &frame);
+    // Append the checksum and the end of a member, `crc` is Kernels::Crc32c
+    // of its bytes
+    static constexpr size_t kChecksumSize = 4;
+    static constexpr size_t kEndSize = kHeaderSize + kChecksumSize + 1;
+    static void EncodeEnd(uint32_t crc, std::vector<char> &out);
+
+    // Decode the payload of a block into its `raw` bytes, `in` must be
+    // followed by BitReader::kPadding readable bytes. References are left
+    // to the caller, which has the output, and so are blocks reusing a
+    // table unless `history` is given.
+    static DecodeStatus Decode(uint8_t type, const char *in, size_t n,
+                               char *out, size_t raw);
+    static DecodeStatus Decode(uint8_t type, const char *in, size_t n,
+                               char *out, size_t raw, TableHistory &history);
+
+    // A whole stream in memory: magic, blocks of `block_size` bytes, end
+    static void EncodeStream(const char *in, size_t n, std::vector<char> &out,
+                             size_t block_size = kDefaultBlockSize);
+    // Append the bytes of a stream, or of several concatenated ones, to
+    // `out`. `in` must be followed by BitReader::kPadding readable bytes.
+    // A stream that would append more than `max_out` bytes is corrupt.
+    static DecodeStatus DecodeStream(const char *in, size_t n,
+                                     std::vector<char> &out,
+                                     size_t max_out = SIZE_MAX);
+
+    static void PutU32(std::vector<char> &out, uint32_t value);
+    static uint32_t GetU32(const char *in);
+
+  private:
+    // Bits of a Huffman code for these frequencies, `table_bits` gets
+    // those of its table
+    static double HuffmanBits(const size_t freq[256], double &table_bits);
+    // Chao1: how many symbols samples missed, from the numbers of those
+    // they saw once and twice
+    static double Unseen(double once, double twice);
+    // Bits of a kBlockHuffmanRepeat block with the table `ref`, and of a
+    // kBlockHuffmanDelta block changing it into `lens`, infinite if the
+    // block can't be coded so
+    static double RepeatBits(const size_t freq[256], const uint8_t ref[256]);
+    static double DeltaBits(const size_t freq[256], const uint8_t lens[256],
+                            const uint8_t ref[256]);
+    static void EncodePayload(BlockType type, const char *in, size_t n,
+                              std::vector<char> &out);
+};
+
+bool BlockCodec::HasMagic(const char *data, size_t n) {
+    return n >= sizeof(kMagic) && memcmp(data, kMagic, sizeof(kMagic)) == 0;
+}
+
+bool BlockCodec::HasOldMagic(const char *data, size_t n) {
+    return n >= sizeof(kOldMagic) &&
+           memcmp(data, kOldMagic, sizeof(kOldMagic)) == 0;
+}
+
+void BlockCodec::Encode(const char *in, size_t n, std::vector<char> &frame,
+                        BlockTable *table) {
+    BlockEstimate estimate;
+    BlockType type = Estimate(in, n, estimate);
+
+    size_t start = frame.size();
+    frame.push_back(type);
+    PutU32(frame, n);
+    PutU32(frame, 0);
+    uint8_t lens[256] = {0};
+    if (type == kBlockHuffman || type == kBlockTans) {
+        // The samples only pick the strategy, the full histogram picks
+        // the entropy coder
+        size_t freq[256];
+        Kernels::Histogram(in, n, freq);
+        uint16_t norm[256];
+        size_t table_log;
+        double bits;
+        type = Choose(freq, n, lens, norm, table_log, &bits);
+
+        // Or keep the table of the earlier block, as is or changed
+        BlockTable *ref = table && table->distance >= 1 &&
+                          table->distance <= TableHistory::kDepth
+                          ? table : nullptr;
+        if (ref) {
+            double repeat = RepeatBits(freq, ref->lens);
+            double delta = DeltaBits(freq, lens, ref->lens);
+            if (repeat < bits && repeat <= delta)
+                type = kBlockHuffmanRepeat;
+            else if (delta < bits)
+                type = kBlockHuffmanDelta;
+        }
+
+        frame[start] = type;
+        if (type == kBlockTans) {
+            Tans::EncodeBlock(in, n, norm, table_log, frame);
+        } else if (type == kBlockHuffman) {
+            Huffman::EncodeBlock(in, n, freq, lens, frame);
+        } else {
+            frame.push_back(static_cast<char>(ref->distance));
+            if (type == kBlockHuffmanRepeat) {
+                memcpy(lens, ref->lens, sizeof(lens));
+            } else {
+                size_t count = frame.size();
+                frame.push_back(0);
+                size_t changes = 0;
+                for (int i = 0; i < 256; i++) {
+                    if (lens[i] == ref->lens[i])
+                        continue;
+                    frame.push_back(static_cast<char>(i));
+                    frame.push_back(static_cast<char>(lens[i]));
+                    changes++;
+                }
+                frame[count] = static_cast<char>(changes - 1);
+            }
+            Huffman::EncodeCodes(in, n, lens, frame);
+        }
+        // Only codes of several symbols are tables to reuse
+        if (type == kBlockTans ||
+            std::count(lens, lens + 256, 0) >= 255)
+            memset(lens, 0, sizeof(lens));
+    } else {
+        EncodePayload(type, in, n, frame);
+    }
+
+    // Incompressible data is stored as is
+    size_t coded = frame.size() - start - kHeaderSize;
+    if (coded >= n && type != kBlockStored) {
+        frame.resize(start + kHeaderSize);
+        frame.insert(frame.end(), in, in + n);
+        frame[start] = kBlockStored;
+        coded = n;
+        memset(lens, 0, sizeof(lens));
+    }
+    if (table)
+        memcpy(table->lens, lens, sizeof(lens));
+
+    // Patch the coded size now that it is known
+    std::vector<char> size;
+    PutU32(size, coded);
+    std::copy(size.begin(), size.end(), frame.begin() + start + 5);
+}
+
+void BlockCodec::EncodeRef(uint64_t offset, size_t n,
+                           std::vector<char> &frame) {
+    frame.push_back(kBlockRef);
+    PutU32(frame, n);
+    PutU32(frame, kRefSize);
+    PutU32(frame, offset >> 32);
+    PutU32(frame, offset);
+}
+
+void BlockCodec::EncodeEnd(uint32_t crc, std::vector<char> &out) {
+    out.push_back(kBlockChecksum);
+    PutU32(out, 0);
+    PutU32(out, kChecksumSize);
+    PutU32(out, crc);
+    out.push_back(static_cast<char>(kBlockEnd));
+}
+
+BlockType BlockCodec::Estimate(const char *in, size_t n,
+                               BlockEstimate &estimate, bool time_coder) {
+    size_t segment = n <= kSampleWhole ? n : kSampleSegment;
+    size_t segments = n <= kSampleWhole ? 1
+                    : std::max<size_t>(1, std::min(n / kSampleFraction,
+                                                   kSampleWhole) / segment);
+    size_t stride = n / segments;
+
+    // Histograms of the bytes, of the run-length transformed bytes, and
+    // the (previous, current) byte pairs of the samples
+    size_t freq[256] = {0}, rle_freq[256] = {0};
+    std::vector<uint16_t> pairs;
+    pairs.reserve(segments * segment);
+    std::vector<char> rle;
+    size_t sampled = 0;
+    for (size_t s = 0; s < segments; s++) {
+        const char *seg = in + s * stride;
+        size_t len = std::min(segment, n - s * stride);
+        for (size_t i = 0; i < len; i++) {
+            unsigned char c = seg[i];
+            freq[c]++;
+            if (i > 0)
+                pairs.push_back(static_cast<unsigned char>(seg[i - 1]) << 8 | c);
+        }
+        rle.clear();
+        Rle::Encode(seg, len, rle);
+        for (char c : rle)
+            rle_freq[static_cast<unsigned char>(c)]++;
+        sampled += len;
+    }
+    double scale = double(n) / sampled;
+
+    // Order 0: Huffman lengths, and the entropy that tANS gets close to.
+    // Corrected as for order 1 below, or samples of incompressible data
+    // look compressible: the symbols they missed are charged in the
+    // tables and through the Miller-Madow correction, both shrinking to
+    // nothing as the samples cover the block
+    double symbols = 0, entropy = 0, once = 0, twice = 0, code_bits = 0;
+    uint8_t lens[256];
+    Huffman::BuildLengths(freq, lens);
+    for (int i = 0; i < 256; i++) {
+        if (freq[i] == 0)
+            continue;
+        symbols++;
+        entropy -= freq[i] * std::log2(double(freq[i]) / sampled);
+        once += freq[i] == 1;
+        twice += freq[i] == 2;
+        code_bits += freq[i] * lens[i];
+    }
+    double missed = 1 - double(sampled) / n;
+    double present = std::min(256.0, symbols + missed * Unseen(once, twice));
+    double correction = present > 1 ? missed * (present - 1) /
+                                      (2 * std::log(2.0))
+                                    : 0;
+    estimate.bytes[kBlockStored] = n;
+    estimate.bytes[kBlockHuffman] = (8 + 16 * present +
+                                     (code_bits + correction) * scale) / 8;
+    estimate.bytes[kBlockTans] = (12 + present * (8 + Tans::kDefaultTableLog) +
+                                  (entropy + correction) * scale) / 8;
+    if (symbols <= 1)
+        estimate.bytes[kBlockTans] = estimate.bytes[kBlockHuffman];
+
+    // Run-length transformed, then Huffman coded. The table is the same
+    // whatever the share sampled, only the codes grow with the block
+    double rle_table;
+    double rle_bits = HuffmanBits(rle_freq, rle_table);
+    estimate.bytes[kBlockRle] = 4 + (rle_table + rle_bits * scale) / 8;
+
+    // Order 1: conditional entropy of every context, at least one bit per
+    // byte in contexts with several symbols. Samples only see part of the
+    // symbols of a context: Chao1 estimates how many the block has, and
+    // they are charged in the table and through the Miller-Madow correction
+    // Sorted one byte at a time, low then high, much faster than by
+    // comparisons
+    std::vector<uint16_t> sorted(pairs.size());
+    for (int shift : {0, 8}) {
+        size_t start[257] = {0};
+        for (uint16_t pair : pairs)
+            start[((pair >> shift) & 0xFF) + 1]++;
+        for (int b = 0; b < 256; b++)
+            start[b + 1] += start[b];
+        for (uint16_t pair : pairs)
+            sorted[start[(pair >> shift) & 0xFF]++] = pair;
+        pairs.swap(sorted);
+    }
+    double order0_symbols = present;
+    double order0_entropy = (entropy + correction) / sampled;
+    double order1_bits = 0, order1_header = 1;
+    for (size_t i = 0; i < pairs.size(); ) {
+        size_t ctx_end = i;
+        while (ctx_end < pairs.size() && (pairs[ctx_end] >> 8) == (pairs[i] >> 8))
+            ctx_end++;
+        double total = ctx_end - i, entropy = 0, distinct = 0;
+        double once = 0, twice = 0;
+        for (size_t j = i; j < ctx_end; ) {
+            size_t k = j;
+            while (k < ctx_end && pairs[k] == pairs[j])
+                k++;
+            entropy -= (k - j) / total * std::log2((k - j) / total);
+            distinct++;
+            once += k - j == 1;
+            twice += k - j == 2;
+            j = k;
+        }
+        double symbols = std::min(256.0, distinct + Unseen(once, twice));
+        if (total < kSampleContext || once > total / 2) {
+            // Too few samples to tell, or too few seen twice to trust
+            // Chao1, assume the context predicts nothing
+            symbols = order0_symbols;
+            entropy = order0_entropy;
+        } else if (symbols > 1) {
+            entropy += (symbols - 1) / (2 * total * std::log(2.0));
+            entropy = std::min(std::max(entropy, 1.0), std::log2(symbols));
+        }
+        order1_bits += entropy * total;
+        order1_header += 2 + 2 * symbols;
+        i = ctx_end;
+    }
+    estimate.bytes[kBlockOrder1] = order1_header + order1_bits * scale / 8;
+
+    BlockType best = kBlockStored;
+    for (BlockType type : {kBlockHuffman, kBlockTans, kBlockRle, kBlockOrder1})
+        if (estimate.bytes[type] < estimate.bytes[best])
+            best = type;
+    estimate.type = best;
+    estimate.sampled = sampled;
+
+    if (time_coder) {
+        auto coding = std::chrono::steady_clock::now();
+        std::vector<char> out;
+        EncodePayload(best, in, n, out);
+        std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - coding;
+        estimate.seconds = elapsed.count();
+    }
+    return best;
+}
+
+BlockType BlockCodec::Choose(const size_t freq[256], size_t n,
+                             uint8_t lens[256], uint16_t norm[256],
+                             size_t &table_log, double *bits) {
+    Huffman::BuildLengths(freq, lens);
+    size_t symbols = 0;
+    double huffman_bits = 0;
+    for (int i = 0; i < 256; i++) {
+        symbols += freq[i] != 0;
+        huffman_bits += freq[i] * lens[i];
+    }
+    huffman_bits += 8 * (1 + 2 * std::max<size_t>(symbols, 1));
+    if (bits)
+        *bits = huffman_bits;
+    // A single symbol costs nothing but its table entry
+    if (symbols <= 1)
+        return kBlockHuffman;
+
+    table_log = Tans::Normalize(freq, n, norm);
+    double tans_bits = Tans::EstimateBits(freq, norm, table_log);
+    if (tans_bits >= huffman_bits)
+        return kBlockHuffman;
+    if (bits)
+        *bits = tans_bits;
+    return kBlockTans;
+}
+
+DecodeStatus BlockCodec::Decode(uint8_t type, const char *in, size_t n,
+                                char *out, size_t raw) {
+    switch (type) {
+    case kBlockHuffman:
+        return Huffman::DecodeBlock(in, n, out, raw);
+    case kBlockTans:
+        return Tans::DecodeBlock(in, n, out, raw);
+    case kBlockRle:
+        return Rle::DecodeBlock(in, n, out, raw);
+    case kBlockOrder1:
+        return Order1::DecodeBlock(in, n, out, raw);
+    case kBlockStored:
+        if (n != raw)
+            return kDecodeCorrupt;
+        memcpy(out, in, n);
+        return kDecodeOk;
+    default:
+        return kDecodeCorrupt;
+    }
+}
+
+DecodeStatus BlockCodec::Decode(uint8_t type, const char *in, size_t n,
+                                char *out, size_t raw, TableHistory &history) {
+    std::shared_ptr<const TableHistory::Table> table;
+    size_t used;
+    DecodeStatus status = history.Next(type, in, n, raw, table, used);
+    if (status != kDecodeOk)
+        return status;
+    if (table)
+        return Huffman::DecodeCodes(in + used, n - used, table->decode,
+                                    out, raw);
+    return Decode(type, in, n, out, raw);
+}
+
+double BlockCodec::HuffmanBits(const size_t freq[256], double &table_bits) {
+    uint8_t lens[256];
+    Huffman::BuildLengths(freq, lens);
+    double bits = 0;
+    table_bits = 8;
+    for (int i = 0; i < 256; i++) {
+        if (freq[i] == 0)
+            continue;
+        table_bits += 16;
+        bits += freq[i] * lens[i];
+    }
+    return bits;
+}
+
+double BlockCodec::Unseen(double once, double twice) {
+    return twice > 0 ? once * once / (2 * twice) : once * (once - 1) / 2;
+}
+
+double BlockCodec::RepeatBits(const size_t freq[256], const uint8_t ref[256]) {
+    double bits = 8;
+    for (int i = 0; i < 256; i++) {
+        if (freq[i] != 0 && ref[i] == 0)
+            return INFINITY;
+        bits += freq[i] * double(ref[i]);
+    }
+    return bits;
+}
+
+double BlockCodec::DeltaBits(const size_t freq[256], const uint8_t lens[256],
+                             const uint8_t ref[256]) {
+    double bits = 16;
+    size_t changes = 0;
+    for (int i = 0; i < 256; i++) {
+        changes += lens[i] != ref[i];
+        bits += freq[i] * double(lens[i]);
+    }
+    // No change is a repeat, and a single symbol has no codes to send
+    if (changes == 0 || std::count(lens, lens + 256, 0) >= 255)
+        return INFINITY;
+    return bits + 16.0 * changes;
+}
+
+void BlockCodec::EncodePayload(BlockType type, const char *in, size_t n,
+                               std::vector<char> &out) {
+    switch (type) {
+    case kBlockHuffman:
+        Huffman::EncodeBlock(in, n, out);
+        break;
+    case kBlockTans:
+        Tans::EncodeBlock(in, n, out);
+        break;
+    case kBlockRle:
+        Rle::EncodeBlock(in, n, out);
+        break;
+    case kBlockOrder1:
+        Order1::EncodeBlock(in, n, out);
+        break;
+    default:
+        out.insert(out.end(), in, in + n);
+        break;
+    }
+}
+
+void BlockCodec::EncodeStream(const char *in, size_t n, std::vector<char> &out,
+                              size_t block_size) {
+    if (block_size == 0 || block_size > kMaxBlockSize)
+        block_size = kDefaultBlockSize;
+    out.insert(out.end(), kMagic, kMagic + sizeof(kMagic));
+    // Each block may reuse the table of the one before
+    BlockTable table;
+    for (size_t pos = 0; pos < n; pos += block_size) {
+        Encode(in + pos, std::min(block_size, n - pos), out, &table);
+        table.distance = 1;
+    }
+    EncodeEnd(Kernels::Crc32c(in, n), out);
+}
+
+DecodeStatus BlockCodec::DecodeStream(const char *in, size_t n,
+                                      std::vector<char> &out,
+                                      size_t max_out) {
+    if (n < sizeof(kMagic))
+        return kDecodeTruncated;
+    if (!HasMagic(in, n))
+        return HasOldMagic(in, n) ? kDecodeUnsupported : kDecodeCorrupt;
+    size_t pos = sizeof(kMagic);
+    size_t member = out.size();
+    // Small blocks may declare large raw sizes, check before allocating
+    size_t limit = max_out > SIZE_MAX - out.size() ? SIZE_MAX
+                                                   : out.size() + max_out;
+    TableHistory history;
+    // Whether the member's checksum was read and matched, only its end
+    // may follow
+    bool checked = false;
+    for (;;) {
+        if (pos == n)
+            return kDecodeTruncated;
+        uint8_t type = in[pos];
+        if (checked != (type == kBlockEnd))
+            return kDecodeCorrupt;
+        if (type == kBlockEnd) {
+            checked = false;
+            // Another member may follow the end of this one
+            if (++pos == n)
+                return kDecodeOk;
+            if (!HasMagic(in + pos, n - pos))
+                return n - pos < sizeof(kMagic) ? kDecodeTruncated
+                       : HasOldMagic(in + pos, n - pos) ? kDecodeUnsupported
+                                                        : kDecodeCorrupt;
+            pos += sizeof(kMagic);
+            member = out.size();
+            history.Reset();
+            continue;
+        }
+        if (n - pos < kHeaderSize)
+            return kDecodeTruncated;
+        size_t raw = GetU32(in + pos + 1);
+        size_t coded = GetU32(in + pos + 5);
+        pos += kHeaderSize;
+        if (raw > kMaxBlockSize)
+            return kDecodeCorrupt;
+        if (coded > n - pos)
+            return kDecodeTruncated;
+        if (type == kBlockChecksum) {
+            if (raw != 0 || coded != kChecksumSize ||
+                GetU32(in + pos) != Kernels::Crc32c(out.data() + member,
+                                                    out.size() - member))
+                return kDecodeCorrupt;
+            checked = true;
+            pos += coded;
+            continue;
+        }
+
+        size_t start = out.size();
+        if (raw > limit - start)
+            return kDecodeCorrupt;
+        out.resize(start + raw);
+        std::shared_ptr<const TableHistory::Table> table;
+        size_t used;
+        DecodeStatus status = history.Next(type, in + pos, coded, raw, table,
+                                           used);
+        if (status != kDecodeOk)
+            return status;
+        if (table) {
+            status = Huffman::DecodeCodes(in + pos + used, coded - used,
+                                          table->decode, out.data() + start,
+                                          raw);
+            if (status != kDecodeOk)
+                return status;
+        } else if (type == kBlockRef) {
+            if (coded != kRefSize)
+                return kDecodeCorrupt;
+            uint64_t offset = uint64_t(GetU32(in + pos)) << 32 |
+                              GetU32(in + pos + 4);
+            // Only what this member already decoded can be repeated
+            if (offset > start - member || raw > start - member - offset)
+                return kDecodeCorrupt;
+            memcpy(out.data() + start, out.data() + member + offset, raw);
+        } else {
+            status = Decode(type, in + pos, coded, out.data() + start, raw);
+            if (status != kDecodeOk)
+                return status;
+        }
+        pos += coded;
+    }
+}
+
+void TableHistory::Reset() {
+    for (auto &table : tables)
+        table.reset();
+    blocks = 0;
+}
+
+DecodeStatus TableHistory::Next(uint8_t type, const char *in, size_t n,
+                                size_t raw,
+                                std::shared_ptr<const Table> &table,
+                                size_t &used) {
+    std::shared_ptr<const Table> &slot = tables[blocks % kDepth];
+    table.reset();
+    used = 0;
+    if (type == kBlockHuffman) {
+        auto fresh = std::make_shared<Table>();
+        DecodeStatus status = Huffman::ReadTable(in, n, fresh->lens, used);
+        if (status != kDecodeOk)
+            return status;
+        // A single symbol has no table to reuse, its block decodes alone
+        if (used > 3) {
+            if (!fresh->decode.Build(fresh->lens))
+                return kDecodeCorrupt;
+            if (raw >= DecodeTable::kMultiMin)
+                fresh->decode.BuildMulti();
+            table = fresh;
+        }
+    } else if (type == kBlockHuffmanRepeat || type == kBlockHuffmanDelta) {
+        if (n < 1)
+            return kDecodeTruncated;
+        size_t distance = static_cast<unsigned char>(in[0]);
+        if (distance < 1 || distance > std::min(blocks, kDepth))
+            return kDecodeCorrupt;
+        const std::shared_ptr<const Table> &ref =
+                tables[(blocks - distance) % kDepth];
+        used = 1;
+        if (type == kBlockHuffmanRepeat) {
+            if (!ref)
+                return kDecodeCorrupt;
+            table = ref;
+        } else {
+            if (n < 2)
+                return kDecodeTruncated;
+            size_t changes = static_cast<unsigned char>(in[1]) + 1;
+            if (n < 2 + 2 * changes)
+                return kDecodeTruncated;
+            auto changed = std::make_shared<Table>();
+            if (ref)
+                memcpy(changed->lens, ref->lens, sizeof(changed->lens));
+            else
+                memset(changed->lens, 0, sizeof(changed->lens));
+            for (size_t i = 0; i < changes; i++) {
+                unsigned char c = in[2 + 2 * i];
+                if (i > 0 && c <= static_cast<unsigned char>(in[2 * i]))
+                    return kDecodeCorrupt;
+                changed->lens[c] = in[3 + 2 * i];
+            }
+            if (!changed->decode.Build(changed->lens))
+                return kDecodeCorrupt;
+            if (raw >= DecodeTable::kMultiMin)
+                changed->decode.BuildMulti();
+            used = 2 + 2 * changes;
+            table = changed;
+        }
+    }
+    slot = table;
+    blocks++;
+    return kDecodeOk;
+}
+
+void BlockCodec::PutU32(std::vector<char> &out, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(static_cast<char>(value >> shift));
+}
+
+uint32_t BlockCodec::GetU32(const char *in) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++)
+        value = (value << 8) | static_cast<unsigned char>(in[i]);
+    return value;
+}
+
+#endif  // BLOCK_H_
@@ -1,20 +1,25 @@
 #ifndef BSTREAM_H_
 #define BSTREAM_H_
 
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <stdexcept>
+#include <vector>
 
 class BinaryInputStream {
 public:
-    explicit BinaryInputStream(std::ifstream &ifs);
+    explicit BinaryInputStream(std::istream &ifs);
 
     bool GetBit();
     char GetChar();
     int GetInt();
 
 private:
-    std::ifstream &ifs;
+    std::istream &ifs;
     char buffer = 0;
     size_t avail = 0;
 
@@ -22,7 +27,7 @@ private:
     void RefillBuffer();
 };
 
-BinaryInputStream::BinaryInputStream(std::ifstream &ifs) : ifs(ifs) { }
+BinaryInputStream::BinaryInputStream(std::istream &ifs) : ifs(ifs) { }
 
 void BinaryInputStream::RefillBuffer() {
     // Read the next byte from the input stream
@@ -70,7 +75,7 @@ int BinaryInputStream::GetInt() {
 
 class BinaryOutputStream {
   public:
-    explicit BinaryOutputStream(std::ofstream &ofs);
+    explicit BinaryOutputStream(std::ostream &ofs);
     ~BinaryOutputStream();
 
     void Close();
@@ -80,7 +85,7 @@ class BinaryOutputStream {
     void PutInt(int word);
 
   private:
-    std::ofstream &ofs;
+    std::ostream &ofs;
     char buffer = 0;
     size_t count = 0;
 
@@ -88,7 +93,7 @@ class BinaryOutputStream {
     void FlushBuffer();
 };
 
-BinaryOutputStream::BinaryOutputStream(std::ofstream &ofs) : ofs(ofs) { }
+BinaryOutputStream::BinaryOutputStream(std::ostream &ofs) : ofs(ofs) { }
 
 BinaryOutputStream::~BinaryOutputStream() {
     Close();
@@ -149,4 +154,108 @@ void BinaryOutputStream::PutInt(int word) {
     }
 }
 
+// In-memory bit writer, appends bits MSB first to a byte vector
+class BitWriter {
+  public:
+    explicit BitWriter(std::vector<char> &out);
+
+    void Close();
+
+    void PutBit(bool bit);
+    // Put the `len` low bits of `value`, len must be at most 56
+    void PutBits(uint64_t value, size_t len);
+
+  private:
+    std::vector<char> &out;
+    uint64_t buffer = 0;
+    size_t count = 0;
+};
+
+BitWriter::BitWriter(std::vector<char> &out) : out(out) { }
+
+void BitWriter::Close() {
+    // Pad the last byte with 0s
+    if (count)
+        out.push_back(static_cast<char>(buffer << (8 - count)));
+    buffer = 0;
+    count = 0;
+}
+
+void BitWriter::PutBit(bool bit) {
+    PutBits(bit, 1);
+}
+
+void BitWriter::PutBits(uint64_t value, size_t len) {
+    buffer = (buffer << len) | value;
+    count += len;
+    // Write out every complete byte
+    while (count >= 8) {
+        count -= 8;
+        out.push_back(static_cast<char>(buffer >> count));
+    }
+}
+
+// In-memory bit reader, the counterpart of BitWriter. It never checks for
+// the end of the data so that decoding loops don't branch on it: the data
+// must be followed by kPadding readable bytes, reads past the end return
+// garbage, and callers check Overrun() once they are done.
+class BitReader {
+  public:
+    static constexpr size_t kPadding = 8;
+
+    BitReader(const char *data, size_t size);
+
+    bool GetBit();
+    // Get `len` bits, len must be between 1 and 56
+    uint64_t GetBits(size_t len);
+    // Look at the next `len` bits without consuming them
+    uint64_t PeekBits(size_t len) const;
+    void SkipBits(size_t len);
+
+    size_t Position() const;
+    // Whether more bits were consumed than the data holds
+    bool Overrun() const;
+
+  private:
+    const char *data;
+    size_t size;
+    size_t pos = 0;
+};
+
+BitReader::BitReader(const char *data, size_t size)
+        : data(data), size(size) { }
+
+bool BitReader::GetBit() {
+    return GetBits(1);
+}
+
+uint64_t BitReader::GetBits(size_t len) {
+    uint64_t value = PeekBits(len);
+    SkipBits(len);
+    return value;
+}
+
+uint64_t BitReader::PeekBits(size_t len) const {
+    // Stay within the padding once past the end, without a branch
+    size_t byte = std::min(pos / 8, size);
+    uint64_t word;
+    memcpy(&word, data + byte, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return (word << (pos % 8)) >> (64 - len);
+}
+
+void BitReader::SkipBits(size_t len) {
+    pos += len;
+}
+
+size_t BitReader::Position() const {
+    return pos;
+}
+
+bool BitReader::Overrun() const {
+    return pos > 8 * size;
+}
+
 #endif  // BSTREAM_H_
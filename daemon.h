@@ -0,0 +1,476 @@
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "block.h"
+
+// Protocol of zapd on its Unix domain socket. Requests and responses are
+// framed alike:
+//
+//   op or status   1 byte, a DaemonOp or a DecodeStatus
+//   size           4 bytes, most significant first
+//   data           the bytes to code, or the coded bytes
+//
+// A compress request is answered with a framed zap stream and a
+// decompress request with the original bytes. Responses come back in
+// request order, so a client may send many requests before reading any.
+enum DaemonOp : uint8_t {
+    kDaemonCompress = 0,
+    kDaemonDecompress = 1,
+};
+
+// Workers each watch their share of the connections with epoll. The
+// requests that arrived together on a connection are answered together
+// and their responses written back at once.
+class ZapServer {
+  public:
+    static constexpr size_t kFrameHeaderSize = 5;
+    static constexpr size_t kMaxRequest = 64 << 20;
+    // Decompressed data is bounded too, a few bytes can stand for a
+    // megabyte, and response sizes must fit their 4 bytes
+    static constexpr size_t kMaxResponse = 256 << 20;
+
+    ZapServer(const std::string &path, unsigned int num_workers);
+    ~ZapServer();
+    // Listen on the socket and start the threads, return false on error
+    // or if something other than a socket is at the path
+    bool Start();
+    // Close every connection, join the threads and remove the socket
+    void Stop();
+
+    // Append the responses to every complete request at the start of `in`
+    // to `out` and set `used` to their size. Return false on a request
+    // too large to be served. `in` must be followed by BitReader::kPadding
+    // readable bytes.
+    static bool Serve(const char *in, size_t n, size_t &used,
+                      std::vector<char> &out);
+
+  private:
+    static constexpr size_t kReadSize = 64 << 10;
+
+    struct Connection {
+        int fd;
+        // Received bytes, with room for the bit reader padding after them
+        std::vector<char> in;
+        size_t received = 0;
+        std::vector<char> out;
+        size_t sent = 0;
+        bool closed = false;
+    };
+
+    // Buffers and connections stay with their worker between requests
+    struct Worker {
+        int epoll_fd = -1;
+        int wake_fd = -1;
+        std::mutex mutex;
+        std::vector<int> incoming;
+        std::map<int, std::unique_ptr<Connection>> connections;
+        std::thread thread;
+    };
+
+    void Accept();
+    void Work(Worker &w);
+    // Read what is available, answer it and write back. Return false once
+    // the connection is over
+    bool Handle(Worker &w, Connection &c, uint32_t events);
+    static bool Wake(int fd);
+
+    std::string path;
+    unsigned int num_workers;
+    int listen_fd = -1;
+    int stop_fd = -1;
+    std::atomic<bool> stopping{false};
+    std::deque<Worker> workers;
+    std::thread acceptor;
+};
+
+class ZapClient {
+  public:
+    ZapClient() = default;
+    ZapClient(const ZapClient &) = delete;
+    ZapClient &operator=(const ZapClient &) = delete;
+    ~ZapClient();
+
+    bool Connect(const std::string &path);
+    void Close();
+
+    // Return false if the daemon can't be reached, else the daemon's
+    // status is in `status`
+    bool Call(DaemonOp op, const char *in, size_t n, uint8_t &status,
+              std::vector<char> &out);
+    // Send every request while reading the responses, so that the daemon
+    // can answer them in batches
+    bool CallMany(DaemonOp op, const std::vector<std::string> &inputs,
+                  std::vector<uint8_t> &statuses,
+                  std::vector<std::string> &outputs);
+
+  private:
+    // Send `requests` and receive until `count` responses are complete
+    bool Exchange(const std::vector<char> &requests, size_t count,
+                  std::vector<char> &responses);
+    static void PutFrame(std::vector<char> &out, uint8_t op,
+                         const char *data, size_t n);
+
+    int fd = -1;
+};
+
+ZapServer::ZapServer(const std::string &path, unsigned int num_workers)
+        : path(path), num_workers(num_workers == 0 ? 1 : num_workers) {}
+
+ZapServer::~ZapServer() {
+    Stop();
+}
+
+bool ZapServer::Start() {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        return false;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    // A socket left by a previous run would make bind fail, but any
+    // other file at the path is not ours to remove
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode) || unlink(path.c_str()) < 0)
+            return false;
+    } else if (errno != ENOENT) {
+        return false;
+    }
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+        return false;
+    if (bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+        listen(listen_fd, SOMAXCONN) < 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    for (unsigned int i = 0; i < num_workers; i++) {
+        workers.emplace_back();
+        Worker &w = workers.back();
+        w.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        w.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = w.wake_fd;
+        epoll_ctl(w.epoll_fd, EPOLL_CTL_ADD, w.wake_fd, &ev);
+    }
+    for (auto &w : workers)
+        w.thread = std::thread([this, &w]() { Work(w); });
+    acceptor = std::thread([this]() { Accept(); });
+    return true;
+}
+
+void ZapServer::Stop() {
+    if (listen_fd < 0)
+        return;
+    stopping = true;
+    Wake(stop_fd);
+    acceptor.join();
+    for (auto &w : workers) {
+        Wake(w.wake_fd);
+        w.thread.join();
+        for (auto &c : w.connections)
+            close(c.first);
+        close(w.epoll_fd);
+        close(w.wake_fd);
+    }
+    workers.clear();
+    close(stop_fd);
+    close(listen_fd);
+    listen_fd = -1;
+    // Unless something else replaced the socket since
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path.c_str());
+}
+
+bool ZapServer::Serve(const char *in, size_t n, size_t &used,
+                      std::vector<char> &out) {
+    used = 0;
+    while (n - used >= kFrameHeaderSize) {
+        uint8_t op = in[used];
+        size_t size = BlockCodec::GetU32(in + used + 1);
+        if (size > kMaxRequest)
+            return false;
+        if (n - used - kFrameHeaderSize < size)
+            break;
+        const char *data = in + used + kFrameHeaderSize;
+        used += kFrameHeaderSize + size;
+
+        // Code straight after the response header, then patch it
+        size_t start = out.size();
+        out.push_back(kDecodeOk);
+        BlockCodec::PutU32(out, 0);
+        if (op == kDaemonCompress) {
+            BlockCodec::EncodeStream(data, size, out);
+        } else if (op == kDaemonDecompress) {
+            DecodeStatus status = BlockCodec::DecodeStream(data, size, out,
+                                                           kMaxResponse);
+            if (status != kDecodeOk) {
+                out.resize(start + kFrameHeaderSize);
+                out[start] = status;
+            }
+        } else {
+            out[start] = kDecodeCorrupt;
+        }
+        std::vector<char> length;
+        BlockCodec::PutU32(length, out.size() - start - kFrameHeaderSize);
+        std::copy(length.begin(), length.end(), out.begin() + start + 1);
+    }
+    return true;
+}
+
+void ZapServer::Accept() {
+    for (size_t next = 0; ; ) {
+        pollfd fds[2] = {{listen_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+            return;
+        if (stopping)
+            return;
+        if (!(fds[0].revents & POLLIN))
+            continue;
+        int fd = accept4(listen_fd, nullptr, nullptr,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+        // Deal the connections out round robin
+        Worker &w = workers[next++ % workers.size()];
+        {
+            std::lock_guard<std::mutex> lock(w.mutex);
+            w.incoming.push_back(fd);
+        }
+        Wake(w.wake_fd);
+    }
+}
+
+void ZapServer::Work(Worker &w) {
+    epoll_event events[64];
+    while (!stopping) {
+        int ready = epoll_wait(w.epoll_fd, events, 64, -1);
+        if (ready < 0 && errno != EINTR)
+            return;
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == w.wake_fd) {
+                uint64_t count;
+                while (read(w.wake_fd, &count, sizeof(count)) > 0) {}
+                std::vector<int> incoming;
+                {
+                    std::lock_guard<std::mutex> lock(w.mutex);
+                    incoming.swap(w.incoming);
+                }
+                for (int c : incoming) {
+                    epoll_event ev;
+                    ev.events = EPOLLIN;
+                    ev.data.fd = c;
+                    epoll_ctl(w.epoll_fd, EPOLL_CTL_ADD, c, &ev);
+                    w.connections[c].reset(new Connection{c});
+                }
+                continue;
+            }
+            auto it = w.connections.find(fd);
+            if (it == w.connections.end())
+                continue;
+            if (!Handle(w, *it->second, events[i].events)) {
+                epoll_ctl(w.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+                close(fd);
+                w.connections.erase(it);
+            }
+        }
+    }
+}
+
+bool ZapServer::Handle(Worker &w, Connection &c, uint32_t events) {
+    // While responses are pending, stop reading so that a client that
+    // doesn't read can't make the daemon buffer without bound
+    if (c.sent == c.out.size() && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        c.out.clear();
+        c.sent = 0;
+        for (;;) {
+            c.in.resize(c.received + kReadSize + BitReader::kPadding);
+            ssize_t r = read(c.fd, c.in.data() + c.received, kReadSize);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (r <= 0) {
+                c.closed = true;
+                break;
+            }
+            c.received += r;
+            if (static_cast<size_t>(r) < kReadSize)
+                break;
+        }
+        size_t used;
+        if (!Serve(c.in.data(), c.received, used, c.out))
+            return false;
+        memmove(c.in.data(), c.in.data() + used, c.received - used);
+        c.received -= used;
+    }
+
+    while (c.sent < c.out.size()) {
+        ssize_t r = send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (r < 0)
+            return false;
+        c.sent += r;
+    }
+    bool pending = c.sent < c.out.size();
+    if (c.closed && !pending)
+        return false;
+
+    epoll_event ev;
+    ev.events = pending ? EPOLLOUT : EPOLLIN;
+    ev.data.fd = c.fd;
+    epoll_ctl(w.epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+    return true;
+}
+
+bool ZapServer::Wake(int fd) {
+    uint64_t one = 1;
+    return write(fd, &one, sizeof(one)) == sizeof(one);
+}
+
+ZapClient::~ZapClient() {
+    Close();
+}
+
+bool ZapClient::Connect(const std::string &path) {
+    Close();
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        return false;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void ZapClient::Close() {
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+}
+
+bool ZapClient::Call(DaemonOp op, const char *in, size_t n, uint8_t &status,
+                     std::vector<char> &out) {
+    std::vector<char> request, response;
+    PutFrame(request, op, in, n);
+    if (!Exchange(request, 1, response))
+        return false;
+    status = response[0];
+    out.assign(response.begin() + ZapServer::kFrameHeaderSize, response.end());
+    return true;
+}
+
+bool ZapClient::CallMany(DaemonOp op, const std::vector<std::string> &inputs,
+                         std::vector<uint8_t> &statuses,
+                         std::vector<std::string> &outputs) {
+    std::vector<char> requests, responses;
+    for (auto &input : inputs)
+        PutFrame(requests, op, input.data(), input.size());
+    if (!Exchange(requests, inputs.size(), responses))
+        return false;
+
+    statuses.clear();
+    outputs.clear();
+    for (size_t pos = 0; pos < responses.size(); ) {
+        size_t size = BlockCodec::GetU32(&responses[pos + 1]);
+        statuses.push_back(responses[pos]);
+        outputs.emplace_back(&responses[pos + ZapServer::kFrameHeaderSize], size);
+        pos += ZapServer::kFrameHeaderSize + size;
+    }
+    return true;
+}
+
+bool ZapClient::Exchange(const std::vector<char> &requests, size_t count,
+                         std::vector<char> &responses) {
+    if (fd < 0)
+        return false;
+    size_t sent = 0, received = 0, complete = 0, next = 0;
+    responses.clear();
+    while (complete < count) {
+        pollfd pfd = {fd, POLLIN, 0};
+        if (sent < requests.size())
+            pfd.events |= POLLOUT;
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (pfd.revents & POLLOUT) {
+            ssize_t r = send(fd, requests.data() + sent, requests.size() - sent,
+                             MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (r < 0 && errno != EAGAIN && errno != EINTR)
+                return false;
+            if (r > 0)
+                sent += r;
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            responses.resize(received + (1 << 16));
+            ssize_t r = recv(fd, responses.data() + received, 1 << 16,
+                             MSG_DONTWAIT);
+            if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+                return false;
+            if (r > 0)
+                received += r;
+            responses.resize(received);
+            // Count the responses received in full
+            while (received - next >= ZapServer::kFrameHeaderSize) {
+                size_t size = BlockCodec::GetU32(&responses[next + 1]);
+                if (received - next - ZapServer::kFrameHeaderSize < size)
+                    break;
+                next += ZapServer::kFrameHeaderSize + size;
+                complete++;
+            }
+        }
+    }
+    return true;
+}
+
+void ZapClient::PutFrame(std::vector<char> &out, uint8_t op,
+                         const char *data, size_t n) {
+    out.push_back(op);
+    BlockCodec::PutU32(out, n);
+    out.insert(out.end(), data, data + n);
+}
+
+#endif  // DAEMON_H_
@@ -0,0 +1,147 @@
+#ifndef DEDUP_H_
+#define DEDUP_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <utility>
+
+// How the input is cut into blocks before looking for duplicates
+enum DedupMode {
+    kDedupNone,
+    // Blocks of the block size, as without dedup
+    kDedupFixed,
+    // Cut where a rolling hash of the content says so, so that an insertion
+    // only changes the blocks around it
+    kDedupContent,
+};
+
+struct DedupStats {
+    size_t blocks = 0;
+    size_t duplicates = 0;
+    uint64_t bytes = 0;
+    uint64_t duplicate_bytes = 0;
+    // Time spent cutting and fingerprinting
+    double hash_seconds = 0;
+    size_t index_bytes = 0;
+};
+
+// Fingerprints of the blocks seen so far, with the offset of the first
+// block having each. A fingerprint only says where to look: the blocks
+// must be compared before one refers to the other.
+class DedupIndex {
+  public:
+    static uint64_t Fingerprint(const char *data, size_t n);
+
+    // Length of the next content-defined block of `data`, between
+    // max_size / 8 and max_size bytes, or n if shorter
+    static size_t Cut(const char *data, size_t n, size_t max_size);
+
+    // Return true and the offset of the first block with this fingerprint,
+    // else remember `offset` for it
+    bool FindOrInsert(uint64_t fingerprint, size_t n, uint64_t &offset);
+    size_t Entries() const;
+    // Approximate heap size of the index
+    size_t MemoryBytes() const;
+
+  private:
+    struct Entry {
+        uint64_t offset;
+        size_t size;
+    };
+
+    static uint64_t Mix(uint64_t a, uint64_t b);
+    static uint64_t Load(const char *data);
+
+    std::unordered_map<uint64_t, Entry> entries;
+};
+
+uint64_t DedupIndex::Fingerprint(const char *data, size_t n) {
+    const uint64_t k0 = 0xa0761d6478bd642full, k1 = 0xe7037ed1a0b428dbull;
+    uint64_t h = Mix(n ^ k0, k1);
+    size_t i = 0;
+    // 16 bytes per step, mixed by 64x64->128 bit products
+    for (; i + 16 <= n; i += 16)
+        h = Mix(Load(data + i) ^ k0 ^ h, Load(data + i + 8) ^ k1);
+    if (i < n) {
+        char tail[16] = {0};
+        memcpy(tail, data + i, n - i);
+        h = Mix(Load(tail) ^ k0 ^ h, Load(tail + 8) ^ k1);
+    }
+    return Mix(h ^ k0, h ^ k1);
+}
+
+size_t DedupIndex::Cut(const char *data, size_t n, size_t max_size) {
+    // Gear hash, a byte only stays in it for 64 steps
+    struct Gear {
+        uint64_t table[256];
+        Gear() {
+            uint64_t x = 0x9E3779B97F4A7C15ull;
+            for (auto &t : table) {
+                x += 0x9E3779B97F4A7C15ull;
+                uint64_t z = x;
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+                t = z ^ (z >> 31);
+            }
+        }
+    };
+    static const Gear gear;
+
+    size_t min_size = max_size / 8;
+    if (n <= min_size)
+        return n;
+    // Cut on average every max_size / 4 bytes past the minimum, testing
+    // the high bits that depend on the most bytes
+    size_t bits = 0;
+    while ((size_t(2) << bits) <= max_size / 4)
+        bits++;
+    uint64_t mask = ~uint64_t(0) << (64 - bits);
+    uint64_t h = 0;
+    size_t end = std::min(n, max_size);
+    for (size_t i = min_size; i < end; i++) {
+        h = (h << 1) + gear.table[static_cast<unsigned char>(data[i])];
+        if ((h & mask) == 0)
+            return i + 1;
+    }
+    return end;
+}
+
+bool DedupIndex::FindOrInsert(uint64_t fingerprint, size_t n,
+                              uint64_t &offset) {
+    auto it = entries.find(fingerprint);
+    if (it == entries.end()) {
+        entries.emplace(fingerprint, Entry{offset, n});
+        return false;
+    }
+    if (it->second.size != n)
+        return false;
+    offset = it->second.offset;
+    return true;
+}
+
+size_t DedupIndex::Entries() const {
+    return entries.size();
+}
+
+size_t DedupIndex::MemoryBytes() const {
+    // A bucket pointer each, and a node with its next pointer per entry
+    return entries.bucket_count() * sizeof(void *) +
+           entries.size() * (sizeof(void *) +
+                             sizeof(std::pair<const uint64_t, Entry>));
+}
+
+uint64_t DedupIndex::Mix(uint64_t a, uint64_t b) {
+    __uint128_t product = static_cast<__uint128_t>(a) * b;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+}
+
+uint64_t DedupIndex::Load(const char *data) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+#endif  // DEDUP_H_
@@ -1,16 +1,24 @@
 #ifndef HUFFMAN_H_
 #define HUFFMAN_H_
 
+#include <algorithm>
 #include <array>
 #include <cstddef>
 #include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <sstream>
 #include <string>
 #include <map>
+#include <thread>
+#include <vector>
 
 #include "bstream.h"
+#include "kernels.h"
 #include "pqueue.h"
 
 class HuffmanNode {
@@ -45,70 +53,210 @@ private:
     HuffmanNode *left_, *right_;
 };
 
+// Result of decoding, malformed input is reported instead of thrown
+enum DecodeStatus {
+    kDecodeOk = 0,
+    kDecodeTruncated,
+    kDecodeCorrupt,
+    // A framed member of an older version of the format
+    kDecodeUnsupported,
+};
+
+class DecodeTable;
+
 class Huffman {
   public:
     static void Compress(std::ifstream &ifs, std::ofstream &ofs);
 
-    static void Decompress(std::ifstream &ifs, std::ofstream &ofs);
+    static DecodeStatus Decompress(std::ifstream &ifs, std::ofstream &ofs);
+    // Same output and status as Decompress, but the payload is cut into
+    // chunks at arbitrary bits and each thread decodes one from its cut.
+    // Codes resynchronize after a few symbols, so only the start of each
+    // chunk is decoded again from where the previous one really ended
+    static DecodeStatus DecompressParallel(std::ifstream &ifs,
+                                           std::ofstream &ofs,
+                                           unsigned int num_threads);
+
+    // Same output as Compress, but the payload is encoded by several threads
+    static void CompressParallel(std::ifstream &ifs, std::ofstream &ofs,
+                                 unsigned int num_threads);
+
+    // Block coding with canonical codes over the full byte alphabet
+    static constexpr size_t kMaxCodeLength = 32;
+    static void EncodeBlock(const char *in, size_t n, std::vector<char> &out);
+    // With the histogram and code lengths already computed
+    static void EncodeBlock(const char *in, size_t n, const size_t freq[256],
+                            const uint8_t lens[256], std::vector<char> &out);
+    // Depth of every symbol in a Huffman tree of `freq`, computed in place
+    // over the sorted frequencies without a heap or nodes
+    static void BuildLengths(const size_t freq[256], uint8_t lens[256]);
+    // Same lengths, or others as short in total, from the PQueue tree
+    static void BuildLengthsHeap(const size_t freq[256], uint8_t lens[256]);
+    // Moffat and Katajainen: replace the n > 1 increasing weights of `a`
+    // by their code lengths
+    static void MinimumRedundancy(size_t *a, size_t n);
+    // Canonical codes for the lengths of n symbols
+    static void AssignCodes(const uint8_t *lens, size_t n, uint32_t *codes);
+    // `in` must be followed by BitReader::kPadding readable bytes
+    static DecodeStatus DecodeBlock(const char *in, size_t n,
+                                    char *out, size_t raw);
+    // A block without its table, for a table the decoder already has
+    static void EncodeCodes(const char *in, size_t n, const uint8_t lens[256],
+                            std::vector<char> &out);
+    static DecodeStatus DecodeCodes(const char *in, size_t n,
+                                    const DecodeTable &table,
+                                    char *out, size_t raw);
+    // Read the table at the start of a block, `used` gets its size
+    static DecodeStatus ReadTable(const char *in, size_t n, uint8_t lens[256],
+                                  size_t &used);
 
   private:
     // Helper methods...
+    static HuffmanNode* BuildTree(const int chars[128]);
+
+    static void LengthsRecur(HuffmanNode *n, uint8_t depth, uint8_t lens[256]);
+
+    static void EncodeChunk(const char *begin, const char *end,
+                            const uint64_t codes[128],
+                            const uint8_t lens[128],
+                            char *out, size_t bit,
+                            char& head, char& tail, size_t& tail_pos);
+
     static void PreorderRecur(HuffmanNode *n, 
                               BinaryOutputStream& bos, 
                               std::string bits, std::map<char, 
                               std::string>& code_table);
 
-    static void BuildCodeTable(BinaryInputStream& bis, 
-                               std::map<std::string, 
-                               char>& code_table);
-    static void BuildCodeTableHelper(HuffmanNode* node, 
-                                BinaryInputStream& bis,
-                                std::string bits, 
-                                std::map<std::string, 
-                                char>& code_table);
+    // Read a preorder tree into tree, children are node indices and
+    // leaves are stored as -1 - char
+    static bool ReadTree(BitReader& br, std::vector<std::array<int, 2>>& tree,
+                         int& node, size_t depth);
+    // Read the tree and the char count of a single-stream file
+    static DecodeStatus ReadHeader(BitReader& br, size_t size,
+                                   std::vector<std::array<int, 2>>& tree,
+                                   int& root, int& freq);
+};
+
+// A canonical code found one length after the other. Without lookups it
+// is small and cheap to build, for blocks with many tables such as Order1
+class CanonicalTable {
+  public:
+    // Return false unless the lengths form a complete prefix code
+    bool Build(const uint8_t lens[256]);
+    uint8_t Decode(BitReader& br) const;
+
+  private:
+    friend class DecodeTable;
+    size_t max_len = 0;
+    // First canonical code, number of codes and index of the first
+    // symbol in sorted, for every length
+    uint32_t first[Huffman::kMaxCodeLength + 1];
+    uint32_t count[Huffman::kMaxCodeLength + 1];
+    uint32_t index[Huffman::kMaxCodeLength + 1];
+    uint8_t sorted[256];
+
+    // Find the code among the lengths from `len` up
+    uint8_t Walk(BitReader& br, size_t len) const;
+};
+
+// Lookup tables to decode a canonical code, one peek resolves every code
+// of up to kLookupBits bits, longer ones are found from their length
+class DecodeTable {
+  public:
+    static constexpr size_t kLookupBits = 11;
+
+    // Return false unless the lengths form a complete prefix code
+    bool Build(const uint8_t lens[256]);
+    // After Build with the lookup table, add a second one resolving every
+    // run of up to kMultiSymbols codes that fits in kMultiBits bits, for
+    // DecodeMany. It takes about as long to build as decoding kMultiMin
+    // symbols one at a time, so it only pays on longer blocks, and only if
+    // codes are short: return false and build nothing unless two codes
+    // fit in a lookup on average.
+    static constexpr size_t kMultiBits = 12;
+    static constexpr size_t kMultiSymbols = 4;
+    static constexpr size_t kMultiMin = 16384;
+    bool BuildMulti();
+
+    // Decode one symbol. A complete code decodes any bit sequence, so
+    // there is nothing to check here
+    uint8_t Decode(BitReader& br) const;
+    // Decode `n` symbols, several per lookup with BuildMulti, with the
+    // kernel of the active CPU tier
+    void DecodeMany(BitReader& br, char *out, size_t n) const;
+
+  private:
+    struct Entry {
+        uint8_t sym;
+        // 0 for the prefixes of longer codes
+        uint8_t len;
+    };
+    struct MultiEntry {
+        uint8_t sym[kMultiSymbols];
+        // 0 if the first code is longer than kMultiBits
+        uint8_t count;
+        // Bits of all the codes
+        uint8_t len;
+    };
+    Entry lookup[1 << kLookupBits];
+    // Empty unless built
+    std::vector<MultiEntry> multi;
+    // Codes longer than kLookupBits
+    CanonicalTable canonical;
+
+    void DecodeManyScalar(BitReader& br, char *out, size_t n) const;
+#ifdef KERNELS_X86
+    KERNELS_TARGET("avx2,bmi,bmi2")
+    void DecodeManyBmi2(BitReader& br, char *out, size_t n) const;
+#endif
+};
+
+// Lookup table over the tree of a single-stream file, whose codes needn't
+// be canonical. Codes longer than kLookupBits go on down the tree from
+// the node the lookup stopped at
+class TreeTable {
+  public:
+    static constexpr size_t kLookupBits = 11;
+
+    // The tree as read by Huffman::ReadTree, its root must not be a leaf.
+    // The table refers to it, so it must outlive the table
+    void Build(const std::vector<std::array<int, 2>>& tree, int root);
+    char Decode(BitReader& br) const;
+    // Node reached from the root by the next kLookupBits bits, and how
+    // many of them it took
+    int Lookup(uint32_t bits, size_t& len) const;
+
+  private:
+    struct Entry {
+        // A node as in the tree, a leaf if negative
+        int node;
+        uint8_t len;
+    };
+    const std::vector<std::array<int, 2>> *tree = nullptr;
+    Entry lookup[1 << kLookupBits];
 };
 
 void Huffman::Compress(std::ifstream &ifs, std::ofstream &ofs) {
     // array of all possible ASCII values
     int chars[128] = {0};
-    PQueue<HuffmanNode> pq;
     char c;
     // count frequency of every char in input file and put into ASCII array
     while (ifs.get(c)) {
         chars[c + 0]++;
     }
-    // create min priority queue, ordered by frequency
-    for (int i = 0; i < 128; i++) {
-        if (chars[i] != 0)
-            pq.Push(HuffmanNode(i, chars[i]));
-    }
-    if (pq.Size() == 0)
-        return;
     // Create Huffman Tree
-    while (pq.Size() > 1) {
-        // Create Huffman Node out of the top of the priority queue
-        HuffmanNode *n1 = new HuffmanNode(pq.Top().data(), pq.Top().freq(), 
-                                          pq.Top().left(),pq.Top().right());
-        // Remove Top Huffman Node from priority queue
-        pq.Pop();
-        HuffmanNode *n2 = new HuffmanNode(pq.Top().data(), pq.Top().freq(), 
-                                          pq.Top().left(),pq.Top().right());
-        pq.Pop();
-        // Push a new Huffman Node into priority queue with 
-        // the two popped Huffman Nodes as its children
-        pq.Push(HuffmanNode(0, n1->freq() + n2->freq(), n1, n2));
-    }
+    HuffmanNode *root = BuildTree(chars);
+    if (root == nullptr)
+        return;
+    size_t total = root->freq();
 
     std::map<char, std::string> code_table;
     BinaryOutputStream bos(ofs);
-    // Create the root of the Huffman Tree
-    HuffmanNode *root = new HuffmanNode(pq.Top().data(), pq.Top().freq(),
-                                        pq.Top().left(), pq.Top().right());
     // Traverse the entire Huffman Tree
     PreorderRecur(root, bos, "", code_table);
         
     // Put total number of characters in input file in output file
-    bos.PutInt(pq.Top().freq());
+    bos.PutInt(total);
     // Reset input file to read again
     ifs.clear();
     ifs.seekg(0, std::ios::beg);
@@ -127,6 +275,353 @@ void Huffman::Compress(std::ifstream &ifs, std::ofstream &ofs) {
     }
 }
 
+void Huffman::CompressParallel(std::ifstream &ifs, std::ofstream &ofs,
+                               unsigned int num_threads) {
+    if (num_threads == 0)
+        num_threads = 1;
+    // Load the whole input, the chunks are encoded from memory
+    std::string input((std::istreambuf_iterator<char>(ifs)),
+                      std::istreambuf_iterator<char>());
+    size_t chunk_size = (input.size() + num_threads - 1) / num_threads;
+    if (chunk_size == 0)
+        return;
+    num_threads = (input.size() + chunk_size - 1) / chunk_size;
+
+    // Each thread counts the frequencies of its own chunk
+    std::vector<std::array<int, 128>> counts(num_threads);
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t]() {
+            counts[t].fill(0);
+            size_t end = std::min(input.size(), (t + 1) * chunk_size);
+            for (size_t i = t * chunk_size; i < end; i++)
+                counts[t][input[i] + 0]++;
+        });
+    }
+    for (auto &th : threads)
+        th.join();
+    threads.clear();
+    int chars[128] = {0};
+    for (auto &count : counts)
+        for (int i = 0; i < 128; i++)
+            chars[i] += count[i];
+
+    // Write the header exactly as Compress does, but into memory
+    HuffmanNode *root = BuildTree(chars);
+    size_t total = root->freq();
+    std::map<char, std::string> code_table;
+    std::ostringstream header;
+    {
+        BinaryOutputStream bos(header);
+        PreorderRecur(root, bos, "", code_table);
+        bos.PutInt(total);
+    }
+    // One bit per tree node, eight per leaf and the character count
+    size_t leaves = code_table.size();
+    size_t header_bits = (2 * leaves - 1) + 8 * leaves + 8 * sizeof(int);
+
+    // Turn the string codes into right-aligned integers
+    uint64_t codes[128] = {0};
+    uint8_t lens[128] = {0};
+    for (auto &entry : code_table) {
+        for (char bit : entry.second)
+            codes[entry.first + 0] = (codes[entry.first + 0] << 1) | (bit == '1');
+        lens[entry.first + 0] = entry.second.length();
+    }
+
+    // The bit size of every chunk is known up front, prefix sum them
+    // into the offset at which each chunk starts in the output
+    std::vector<size_t> offsets(num_threads + 1);
+    offsets[0] = header_bits;
+    for (unsigned int t = 0; t < num_threads; t++) {
+        size_t bits = 0;
+        size_t end = std::min(input.size(), (t + 1) * chunk_size);
+        for (size_t i = t * chunk_size; i < end; i++)
+            bits += lens[input[i] + 0];
+        offsets[t + 1] = offsets[t] + bits;
+    }
+
+    std::vector<char> out((offsets[num_threads] + 7) / 8, 0);
+    std::string header_bytes = header.str();
+    std::copy(header_bytes.begin(), header_bytes.end(), out.begin());
+
+    // Encode all chunks concurrently, each writes only the bytes it owns
+    std::vector<char> heads(num_threads, 0), tails(num_threads, 0);
+    std::vector<size_t> tail_pos(num_threads, 0);
+    for (unsigned int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t]() {
+            size_t end = std::min(input.size(), (t + 1) * chunk_size);
+            EncodeChunk(&input[t * chunk_size], &input[0] + end, codes, lens,
+                        out.data(), offsets[t], heads[t], tails[t],
+                        tail_pos[t]);
+        });
+    }
+    for (auto &th : threads)
+        th.join();
+
+    // Stitch the bytes shared with the neighbouring chunks
+    for (unsigned int t = 0; t < num_threads; t++) {
+        if (offsets[t] == offsets[t + 1])
+            continue;
+        out[offsets[t] / 8] |= heads[t];
+        if (tail_pos[t] < out.size())
+            out[tail_pos[t]] |= tails[t];
+    }
+    ofs.write(out.data(), out.size());
+}
+
+void Huffman::EncodeChunk(const char *begin, const char *end,
+                          const uint64_t codes[128], const uint8_t lens[128],
+                          char *out, size_t bit,
+                          char& head, char& tail, size_t& tail_pos) {
+    size_t first = bit / 8;
+    size_t pos = first;
+    // Bits before the chunk start belong to the previous chunk
+    uint64_t acc = 0;
+    size_t count = bit % 8;
+    for (const char *p = begin; p != end; p++) {
+        acc = (acc << lens[*p + 0]) | codes[*p + 0];
+        count += lens[*p + 0];
+        while (count >= 8) {
+            count -= 8;
+            char byte = acc >> count;
+            // The first byte may be shared with the previous chunk
+            if (pos == first)
+                head = byte;
+            else
+                out[pos] = byte;
+            pos++;
+        }
+    }
+    // The last partial byte may be shared with the next chunk
+    tail = count ? static_cast<char>(acc << (8 - count)) : 0;
+    tail_pos = pos;
+}
+
+HuffmanNode* Huffman::BuildTree(const int chars[128]) {
+    PQueue<HuffmanNode> pq;
+    // create min priority queue, ordered by frequency
+    for (int i = 0; i < 128; i++) {
+        if (chars[i] != 0)
+            pq.Push(HuffmanNode(i, chars[i]));
+    }
+    if (pq.Size() == 0)
+        return nullptr;
+    while (pq.Size() > 1) {
+        // Create Huffman Node out of the top of the priority queue
+        HuffmanNode *n1 = new HuffmanNode(pq.Top().data(), pq.Top().freq(), 
+                                          pq.Top().left(),pq.Top().right());
+        // Remove Top Huffman Node from priority queue
+        pq.Pop();
+        HuffmanNode *n2 = new HuffmanNode(pq.Top().data(), pq.Top().freq(), 
+                                          pq.Top().left(),pq.Top().right());
+        pq.Pop();
+        // Push a new Huffman Node into priority queue with 
+        // the two popped Huffman Nodes as its children
+        pq.Push(HuffmanNode(0, n1->freq() + n2->freq(), n1, n2));
+    }
+    // Create the root of the Huffman Tree
+    return new HuffmanNode(pq.Top().data(), pq.Top().freq(),
+                           pq.Top().left(), pq.Top().right());
+}
+
+void Huffman::EncodeBlock(const char *in, size_t n, std::vector<char> &out) {
+    size_t freq[256];
+    Kernels::Histogram(in, n, freq);
+    uint8_t lens[256];
+    BuildLengths(freq, lens);
+    EncodeBlock(in, n, freq, lens, out);
+}
+
+void Huffman::EncodeBlock(const char *in, size_t n, const size_t freq[256],
+                          const uint8_t lens[256], std::vector<char> &out) {
+    // Code table: number of symbols minus one, then (symbol, length) pairs
+    size_t symbols = 0;
+    for (int i = 0; i < 256; i++)
+        symbols += freq[i] != 0;
+    out.push_back(static_cast<char>(symbols - 1));
+    for (int i = 0; i < 256; i++) {
+        if (freq[i] == 0)
+            continue;
+        out.push_back(static_cast<char>(i));
+        out.push_back(static_cast<char>(lens[i]));
+    }
+
+    // Followed by the code of every byte
+    EncodeCodes(in, n, lens, out);
+}
+
+void Huffman::EncodeCodes(const char *in, size_t n, const uint8_t lens[256],
+                          std::vector<char> &out) {
+    uint32_t codes[256];
+    AssignCodes(lens, 256, codes);
+    Kernels::PackCodes(in, n, codes, lens, out);
+}
+
+DecodeStatus Huffman::DecodeBlock(const char *in, size_t n,
+                                  char *out, size_t raw) {
+    uint8_t lens[256];
+    size_t used;
+    DecodeStatus status = ReadTable(in, n, lens, used);
+    if (status != kDecodeOk)
+        return status;
+    // A single symbol has an empty code
+    if (used == 3) {
+        memset(out, in[1], raw);
+        return kDecodeOk;
+    }
+    DecodeTable table;
+    if (!table.Build(lens))
+        return kDecodeCorrupt;
+    if (raw >= DecodeTable::kMultiMin)
+        table.BuildMulti();
+    return DecodeCodes(in + used, n - used, table, out, raw);
+}
+
+DecodeStatus Huffman::DecodeCodes(const char *in, size_t n,
+                                  const DecodeTable &table,
+                                  char *out, size_t raw) {
+    // The position is only validated once the whole block is decoded
+    BitReader br(in, n);
+    table.DecodeMany(br, out, raw);
+    return br.Overrun() ? kDecodeTruncated : kDecodeOk;
+}
+
+DecodeStatus Huffman::ReadTable(const char *in, size_t n, uint8_t lens[256],
+                                size_t &used) {
+    if (n < 1)
+        return kDecodeTruncated;
+    size_t symbols = static_cast<unsigned char>(in[0]) + 1;
+    if (n < 1 + 2 * symbols)
+        return kDecodeTruncated;
+    memset(lens, 0, 256);
+    for (size_t i = 0; i < symbols; i++) {
+        unsigned char c = in[1 + 2 * i];
+        if (lens[c] != 0)
+            return kDecodeCorrupt;
+        lens[c] = in[2 + 2 * i];
+    }
+    used = 1 + 2 * symbols;
+    return kDecodeOk;
+}
+
+void Huffman::BuildLengths(const size_t freq[256], uint8_t lens[256]) {
+    // Sort the symbols by frequency once, ties by symbol
+    uint16_t order[256];
+    size_t n = 0;
+    for (int i = 0; i < 256; i++) {
+        lens[i] = 0;
+        if (freq[i] != 0)
+            order[n++] = i;
+    }
+    if (n <= 1)
+        return;
+    std::sort(order, order + n, [&](uint16_t a, uint16_t b) {
+        return freq[a] < freq[b] || (freq[a] == freq[b] && a < b);
+    });
+    size_t a[256];
+    for (size_t i = 0; i < n; i++)
+        a[i] = freq[order[i]];
+    MinimumRedundancy(a, n);
+    for (size_t i = 0; i < n; i++)
+        lens[order[i]] = a[i];
+}
+
+void Huffman::MinimumRedundancy(size_t *a, size_t n) {
+    // Combine left to right: leaves come from a[leaf..], internal nodes
+    // from a[root..next), each replaced by the index of its parent
+    a[0] += a[1];
+    size_t root = 0, leaf = 2;
+    for (size_t next = 1; next < n - 1; next++) {
+        if (leaf >= n || a[root] < a[leaf]) {
+            a[next] = a[root];
+            a[root++] = next;
+        } else {
+            a[next] = a[leaf++];
+        }
+        if (leaf >= n || (root < next && a[root] < a[leaf])) {
+            a[next] += a[root];
+            a[root++] = next;
+        } else {
+            a[next] += a[leaf++];
+        }
+    }
+
+    // Depths of the internal nodes, from the root down
+    a[n - 2] = 0;
+    for (size_t next = n - 2; next-- > 0; )
+        a[next] = a[a[next]] + 1;
+
+    // Depths of the leaves, from the most frequent one
+    size_t available = 1, used = 0, depth = 0;
+    size_t internal = n - 2, next = n;
+    bool internal_left = true;
+    while (available > 0) {
+        while (internal_left && a[internal] == depth) {
+            used++;
+            if (internal == 0)
+                internal_left = false;
+            else
+                internal--;
+        }
+        while (available > used) {
+            a[--next] = depth;
+            available--;
+        }
+        available = 2 * used;
+        depth++;
+        used = 0;
+    }
+}
+
+void Huffman::BuildLengthsHeap(const size_t freq[256], uint8_t lens[256]) {
+    PQueue<HuffmanNode> pq;
+    for (int i = 0; i < 256; i++) {
+        lens[i] = 0;
+        if (freq[i] != 0)
+            pq.Push(HuffmanNode(i, freq[i]));
+    }
+    if (pq.Size() == 0)
+        return;
+    // Same construction as BuildTree, over 256 symbols
+    while (pq.Size() > 1) {
+        HuffmanNode *n1 = new HuffmanNode(pq.Top().data(), pq.Top().freq(),
+                                          pq.Top().left(), pq.Top().right());
+        pq.Pop();
+        HuffmanNode *n2 = new HuffmanNode(pq.Top().data(), pq.Top().freq(),
+                                          pq.Top().left(), pq.Top().right());
+        pq.Pop();
+        pq.Push(HuffmanNode(0, n1->freq() + n2->freq(), n1, n2));
+    }
+    HuffmanNode *root = new HuffmanNode(pq.Top().data(), pq.Top().freq(),
+                                        pq.Top().left(), pq.Top().right());
+    // Only the depth of every leaf is kept
+    LengthsRecur(root, 0, lens);
+}
+
+void Huffman::LengthsRecur(HuffmanNode *n, uint8_t depth, uint8_t lens[256]) {
+    if (n->IsLeaf()) {
+        lens[static_cast<unsigned char>(n->data())] = depth;
+    } else {
+        LengthsRecur(n->left(), depth + 1, lens);
+        LengthsRecur(n->right(), depth + 1, lens);
+    }
+    delete n;
+}
+
+void Huffman::AssignCodes(const uint8_t *lens, size_t n, uint32_t *codes) {
+    // Canonical codes: consecutive values within a length, in symbol order
+    size_t count[kMaxCodeLength + 1] = {0};
+    for (size_t i = 0; i < n; i++)
+        count[lens[i]]++;
+    count[0] = 0;
+    uint32_t next[kMaxCodeLength + 1] = {0};
+    for (size_t len = 1; len <= kMaxCodeLength; len++)
+        next[len] = (next[len - 1] + count[len - 1]) << 1;
+    for (size_t i = 0; i < n; i++)
+        codes[i] = lens[i] ? next[lens[i]]++ : 0;
+}
+
 void Huffman::PreorderRecur(HuffmanNode *n, BinaryOutputStream& bos, 
           std::string bits, std::map<char, std::string>& code_table) {
     // If the current node is a leaf
@@ -152,112 +647,425 @@ void Huffman::PreorderRecur(HuffmanNode *n, BinaryOutputStream& bos,
     delete n;
 }
 
-void Huffman::Decompress(std::ifstream &ifs, std::ofstream &ofs) {
-    BinaryInputStream bis(ifs);
-    
-    std::map<std::string, char> code_table;
-    // Create code table
-    BuildCodeTable(bis, code_table);
+DecodeStatus Huffman::Decompress(std::ifstream &ifs, std::ofstream &ofs) {
+    // Load the input followed by the slack the bit reader needs
+    std::vector<char> input((std::istreambuf_iterator<char>(ifs)),
+                            std::istreambuf_iterator<char>());
+    size_t size = input.size();
+    input.resize(size + BitReader::kPadding, 0);
+    // Nothing to do for an empty file
+    if (size == 0) {
+        ofs.close();
+        return kDecodeOk;
+    }
+
+    BitReader br(input.data(), size);
+    std::vector<std::array<int, 2>> tree;
+    int root, freq;
+    DecodeStatus status = ReadHeader(br, size, tree, root, freq);
+    if (status != kDecodeOk)
+        return status;
+
+    std::string output(freq, '\0');
+    if (root < 0) {
+        // A single char has an empty code
+        std::fill(output.begin(), output.end(), static_cast<char>(-1 - root));
+    } else {
+        // Walk down the tree one bit at a time for every char
+        for (int i = 0; i < freq; i++) {
+            int node = root;
+            while (node >= 0)
+                node = tree[node][br.GetBit()];
+            output[i] = -1 - node;
+        }
+        if (br.Overrun())
+            return kDecodeTruncated;
+    }
+    ofs.write(output.data(), output.size());
+    ofs.close();
+    return kDecodeOk;
+}
+
+DecodeStatus Huffman::DecompressParallel(std::ifstream &ifs,
+                                         std::ofstream &ofs,
+                                         unsigned int num_threads) {
+    // Chunks shorter than this aren't worth a thread
+    const size_t kMinChunkBits = 1 << 15;
+    // Codeword starts remembered at the beginning of each chunk, to find
+    // where the true decode joins the speculative one
+    const size_t kSyncSymbols = 4096;
+
+    std::vector<char> input((std::istreambuf_iterator<char>(ifs)),
+                            std::istreambuf_iterator<char>());
+    size_t size = input.size();
+    input.resize(size + BitReader::kPadding, 0);
+    if (size == 0) {
+        ofs.close();
+        return kDecodeOk;
+    }
+
+    BitReader br(input.data(), size);
+    std::vector<std::array<int, 2>> tree;
+    int root, freq;
+    DecodeStatus status = ReadHeader(br, size, tree, root, freq);
+    if (status != kDecodeOk)
+        return status;
+    if (root < 0) {
+        std::string output(freq, static_cast<char>(-1 - root));
+        ofs.write(output.data(), output.size());
+        ofs.close();
+        return kDecodeOk;
+    }
+    TreeTable table;
+    table.Build(tree, root);
+
+    // Cut the payload bits into one chunk per thread, the header was not
+    // overrun so it ends within the data
+    size_t begin = br.Position(), end = 8 * size;
+    size_t chunks = std::max<size_t>(1, std::min<size_t>(
+            num_threads, (end - begin) / kMinChunkBits));
+    std::vector<size_t> cuts(chunks + 1);
+    for (size_t k = 0; k <= chunks; k++)
+        cuts[k] = begin + (end - begin) * k / chunks;
+
+    // Decode every char that starts before the end of the chunk. Only the
+    // first chunk starts on a code, the others may start anywhere in one
+    struct Chunk {
+        std::string out;
+        std::vector<size_t> starts;
+        size_t end;
+    };
+    std::vector<Chunk> decoded(chunks);
+    auto decode = [&](size_t k) {
+        Chunk &chunk = decoded[k];
+        BitReader cbr(input.data(), size);
+        cbr.SkipBits(cuts[k]);
+        chunk.out.reserve((cuts[k + 1] - cuts[k]) / 4);
+        while (cbr.Position() < cuts[k + 1]) {
+            if (chunk.starts.size() < kSyncSymbols)
+                chunk.starts.push_back(cbr.Position());
+            chunk.out.push_back(table.Decode(cbr));
+        }
+        chunk.end = cbr.Position();
+    };
+    std::vector<std::thread> threads;
+    for (size_t k = 1; k < chunks; k++)
+        threads.emplace_back(decode, k);
+    decode(0);
+    for (auto &th : threads)
+        th.join();
+
+    // Stitch the chunks in order. The previous chunk really ended at
+    // `pos`: decode from there until a char starts where the chunk also
+    // has one, from which on the chunk's chars are the true ones
+    std::string output = std::move(decoded[0].out);
+    size_t pos = decoded[0].end;
+    for (size_t k = 1; k < chunks; k++) {
+        Chunk &chunk = decoded[k];
+        BitReader cbr(input.data(), size);
+        cbr.SkipBits(pos);
+        size_t j = 0;
+        for (;;) {
+            pos = cbr.Position();
+            while (j < chunk.starts.size() && chunk.starts[j] < pos)
+                j++;
+            if (j < chunk.starts.size() && chunk.starts[j] == pos) {
+                output.append(chunk.out, j, std::string::npos);
+                pos = chunk.end;
+                break;
+            }
+            // Not in sync within the remembered starts, decode the rest
+            // of the chunk here
+            if (j == chunk.starts.size() || pos >= cuts[k + 1]) {
+                while (cbr.Position() < cuts[k + 1])
+                    output.push_back(table.Decode(cbr));
+                pos = cbr.Position();
+                break;
+            }
+            output.push_back(table.Decode(cbr));
+        }
+        std::string().swap(chunk.out);
+    }
+
+    // Chars past the count come from the padding of the last byte. Fewer
+    // chars, or a last one running past the data, mean a truncated file
+    size_t count = static_cast<size_t>(freq);
+    if (output.size() < count || (output.size() == count && pos > end))
+        return kDecodeTruncated;
+    ofs.write(output.data(), count);
+    ofs.close();
+    return kDecodeOk;
+}
+
+DecodeStatus Huffman::ReadHeader(BitReader& br, size_t size,
+                                 std::vector<std::array<int, 2>>& tree,
+                                 int& root, int& freq) {
+    // Rebuild the Huffman tree
+    if (!ReadTree(br, tree, root, 0))
+        return kDecodeCorrupt;
     // Get total number of chars out of input file
-    int freq = bis.GetInt();
-    // Read file until no more chars left
-    for (int i = 0; i < freq; i++) {
-      std::string bits = "";
-      // Find whether the current bit string is in code table
-      auto itr = code_table.find(bits);
-      // Keep adding to bit string until string matches element in code table
-      while (itr == code_table.end()) {
-        bool bit;
-        // Attempt to get next bit from input file
-        try {
-            bit = bis.GetBit();
-        } // If fail then only one char in code table
-        catch (std::underflow_error const&) { }
-        
-        if (bit == 0)
-          bits += "0";
-        else
-          bits += "1";
-        // Check if bit string matches element in code table
-        itr = code_table.find(bits);
-      }
-      // Put char matching bit string into output file
-      ofs.put(itr->second);
-  }
-  ofs.close();
-    
-}
-
-
-void Huffman::BuildCodeTable(BinaryInputStream& bis, std::map<std::string, char>& code_table) {
-    HuffmanNode* root = new HuffmanNode(0,0);
-    bool first_bit;
-    
-    try {
-        // Get first bit of input file
-        first_bit = bis.GetBit();
-    } catch(std::underflow_error const&) {
-        // If empty file
-        exit(0);
-    }
-    
-    // if the first bit is a 1
-    if (first_bit == 1) {
-        // Get the following char value
-        char temp = bis.GetChar();
-        // Insert the char value with code "0" into code table
-        code_table.insert(std::pair<std::string, char>("0", temp));
-        return;
+    freq = br.GetBits(sizeof(int) * 8);
+    if (br.Overrun())
+        return kDecodeTruncated;
+    // Every char takes at least one bit, unless there is only one
+    if (freq < 0 || (root >= 0 && static_cast<size_t>(freq) > 8 * size))
+        return kDecodeCorrupt;
+    return kDecodeOk;
+}
+
+bool Huffman::ReadTree(BitReader& br, std::vector<std::array<int, 2>>& tree,
+                       int& node, size_t depth) {
+    // Compress never writes more than 128 leaves
+    if (br.Overrun() || depth > 128)
+        return false;
+    // A leaf is a 1 followed by its char value
+    if (br.GetBit()) {
+        node = -1 - static_cast<int>(br.GetBits(8));
+        return true;
     }
-    // If the first bit is a 0
-    // Build the rest of the Huffman tree
-    BuildCodeTableHelper (root, bis, "", code_table);
+    // An internal node is a 0 followed by its left and right subtrees
+    node = tree.size();
+    tree.push_back({0, 0});
+    int left, right;
+    if (!ReadTree(br, tree, left, depth + 1) ||
+        !ReadTree(br, tree, right, depth + 1))
+        return false;
+    tree[node] = {left, right};
+    return true;
 }
 
-void Huffman::BuildCodeTableHelper(HuffmanNode* node, BinaryInputStream& bis,
-                         std::string bits, std::map<std::string, char>& code_table) {
-    // If the current node is a leaf
-    if (node->data() != 0) {
-        // Insert the current bit string along 
-        // with the char value into code table
-        code_table.insert(std::pair<std::string, char>(bits, node->data()));
-        // delete current node
-        delete node;
-        return;
+bool CanonicalTable::Build(const uint8_t lens[256]) {
+    for (size_t len = 0; len <= Huffman::kMaxCodeLength; len++)
+        count[len] = 0;
+    for (int i = 0; i < 256; i++) {
+        if (lens[i] > Huffman::kMaxCodeLength)
+            return false;
+        count[lens[i]]++;
     }
-    // Reset node to give new children
-    delete node;
-    // Get the next bit in the input file
-    bool bit = bis.GetBit();
-    if (bit == 0) {
-        // Make current node's left child an internal Huffman Node
-        node = new HuffmanNode(0,0, new HuffmanNode(0,0), nullptr);
-    } else {
-        // Make current node's left child a leaf node
-        node = new HuffmanNode(0, 0, new HuffmanNode(bis.GetChar(), 0), node->right());
-    }
-    // Recurse on the newly created left
-    // Huffman Node adding a "0" to bit string
-    BuildCodeTableHelper(node->left(), bis, bits + "0", code_table);
-    // After traversing entire left subtree, delete current node
-    delete node;
-
-    // Get next bit from input file
-    bit = bis.GetBit();
-    if (bit == 0) {
-        // Make current node's right child an internal Huffman Node
-        node = new HuffmanNode(0, 0, nullptr, new HuffmanNode(0, 0));
-    } else {
-        // Make current node's right child a leaf node
-        node = new HuffmanNode(0, 0, node->left(), 
-                                new HuffmanNode(bis.GetChar(), 0));
+    count[0] = 0;
+
+    // The code must neither be oversubscribed nor leave gaps
+    int64_t left = 1;
+    max_len = 0;
+    for (size_t len = 1; len <= Huffman::kMaxCodeLength; len++) {
+        left = (left << 1) - count[len];
+        if (left < 0)
+            return false;
+        if (count[len])
+            max_len = len;
+    }
+    if (left != 0)
+        return false;
+
+    // Canonical codes, as assigned by Huffman::AssignCodes
+    uint32_t code = 0, sym_index = 0;
+    for (size_t len = 1; len <= max_len; len++) {
+        first[len] = code;
+        index[len] = sym_index;
+        code = (code + count[len]) << 1;
+        sym_index += count[len];
+    }
+    uint32_t next[Huffman::kMaxCodeLength + 1];
+    std::copy(index, index + max_len + 1, next);
+    for (int i = 0; i < 256; i++)
+        if (lens[i])
+            sorted[next[lens[i]]++] = i;
+    return true;
+}
+
+bool DecodeTable::Build(const uint8_t lens[256]) {
+    // Any multi-symbol table was for the code before
+    multi.clear();
+    if (!canonical.Build(lens))
+        return false;
+    const CanonicalTable &c = canonical;
+
+    // Fill the lookup entries of every short code, the others stay 0
+    memset(lookup, 0, sizeof(lookup));
+    for (size_t len = 1; len <= std::min(c.max_len, kLookupBits); len++) {
+        for (uint32_t i = 0; i < c.count[len]; i++) {
+            size_t shift = kLookupBits - len;
+            size_t start = static_cast<size_t>(c.first[len] + i) << shift;
+            for (size_t j = 0; j < (size_t(1) << shift); j++)
+                lookup[start + j] = {c.sorted[c.index[len] + i],
+                                     static_cast<uint8_t>(len)};
+        }
+    }
+    return true;
+}
+
+bool DecodeTable::BuildMulti() {
+    static_assert(kMultiBits >= kLookupBits, "codes are found by lookup");
+    // Average length with the probabilities the lengths stand for
+    double average = 0;
+    for (size_t len = 1; len <= canonical.max_len; len++)
+        average += canonical.count[len] * double(len) / std::ldexp(1.0, len);
+    if (2 * average > kMultiBits) {
+        multi.clear();
+        return false;
+    }
+    multi.resize(size_t(1) << kMultiBits);
+    const uint32_t mask = (uint32_t(1) << kMultiBits) - 1;
+    // Where each code of each entry ends in the index
+    uint8_t ends[1 << kMultiBits][kMultiSymbols];
+
+    // All zeros is the first code repeated
+    Entry zero = lookup[0];
+    MultiEntry &e0 = multi[0];
+    e0 = {};
+    for (size_t end = zero.len; zero.len && e0.count < kMultiSymbols &&
+                                end <= kMultiBits; end += zero.len) {
+        e0.sym[e0.count] = zero.sym;
+        ends[0][e0.count++] = end;
+    }
+    e0.len = e0.count * zero.len;
+
+    // Any other entry is its first code, then the codes of the entry of
+    // the bits after it that end within the index. Those bits are the
+    // index shifted, with more trailing zeros, so entries are built by
+    // decreasing number of trailing zeros.
+    auto build = [&](uint32_t i) {
+        MultiEntry &e = multi[i];
+        e = {};
+        Entry code = lookup[i >> (kMultiBits - kLookupBits)];
+        if (code.len == 0)
+            return;
+        uint32_t j = (i << code.len) & mask;
+        e.sym[0] = code.sym;
+        ends[i][0] = code.len;
+        e.count = 1;
+        for (size_t k = 0; k < multi[j].count && e.count < kMultiSymbols &&
+                           code.len + ends[j][k] <= kMultiBits; k++) {
+            e.sym[e.count] = multi[j].sym[k];
+            ends[i][e.count++] = code.len + ends[j][k];
+        }
+        e.len = ends[i][e.count - 1];
+    };
+    for (size_t zeros = kMultiBits; zeros-- > 0; )
+        for (uint32_t i = uint32_t(1) << zeros; i <= mask; i += uint32_t(2) << zeros)
+            build(i);
+    return true;
+}
+
+void DecodeTable::DecodeMany(BitReader& br, char *out, size_t n) const {
+#ifdef KERNELS_X86
+    if (Kernels::Active() >= kTierBmi2)
+        return DecodeManyBmi2(br, out, n);
+#endif
+    DecodeManyScalar(br, out, n);
+}
+
+void DecodeTable::DecodeManyScalar(BitReader& br, char *out,
+                                   size_t n) const {
+    size_t i = 0;
+    if (!multi.empty()) {
+        // Every entry writes kMultiSymbols bytes, as long as they fit
+        while (i + kMultiSymbols <= n) {
+            const MultiEntry &e = multi[br.PeekBits(kMultiBits)];
+            if (e.count == 0) {
+                out[i++] = Decode(br);
+                continue;
+            }
+            memcpy(out + i, e.sym, kMultiSymbols);
+            i += e.count;
+            br.SkipBits(e.len);
+        }
     }
-    // Recurse on the newly created right
-    // Huffman node adding a "1" to bit string
-    BuildCodeTableHelper(node->right(), bis, bits + "1", code_table);
-    // After traversing entire right subtree, delete current node
-    delete node;
+    for (; i < n; i++)
+        out[i] = Decode(br);
 }
 
+#ifdef KERNELS_X86
+void DecodeTable::DecodeManyBmi2(BitReader& br, char *out, size_t n) const {
+    // Where the scalar loop loads the bits of every code, one 56-bit
+    // window serves as many codes as it surely holds, each taken out with
+    // shrx and bzhi. A long code, or one past the window, is decoded from
+    // the reader
+    constexpr size_t kWindow = 56;
+    size_t i = 0;
+    while (i < n) {
+        uint64_t window = br.PeekBits(kWindow);
+        size_t used = 0;
+        for (;;) {
+            if (!multi.empty() && i + kMultiSymbols <= n &&
+                used + kMultiBits <= kWindow) {
+                const MultiEntry &e = multi[_bzhi_u64(
+                        window >> (kWindow - kMultiBits - used), kMultiBits)];
+                if (e.count != 0) {
+                    memcpy(out + i, e.sym, kMultiSymbols);
+                    i += e.count;
+                    used += e.len;
+                    continue;
+                }
+            }
+            if (i == n || used + kLookupBits > kWindow)
+                break;
+            Entry e = lookup[_bzhi_u64(window >> (kWindow - kLookupBits - used),
+                                       kLookupBits)];
+            if (e.len == 0)
+                break;
+            out[i++] = e.sym;
+            used += e.len;
+        }
+        br.SkipBits(used);
+        if (i < n)
+            out[i++] = Decode(br);
+    }
+}
+#endif
+
+uint8_t DecodeTable::Decode(BitReader& br) const {
+    Entry e = lookup[br.PeekBits(kLookupBits)];
+    if (e.len == 0)
+        return canonical.Walk(br, kLookupBits + 1);
+    br.SkipBits(e.len);
+    return e.sym;
+}
+
+uint8_t CanonicalTable::Decode(BitReader& br) const {
+    return Walk(br, 1);
+}
+
+uint8_t CanonicalTable::Walk(BitReader& br, size_t len) const {
+    uint64_t bits = br.PeekBits(max_len);
+    // The code is complete, so some length always matches
+    for (; len < max_len; len++) {
+        uint32_t code = bits >> (max_len - len);
+        if (code - first[len] < count[len])
+            break;
+    }
+    uint32_t code = bits >> (max_len - len);
+    br.SkipBits(len);
+    return sorted[index[len] + code - first[len]];
+}
+
+void TreeTable::Build(const std::vector<std::array<int, 2>>& tree, int root) {
+    this->tree = &tree;
+    // Follow the bits of every index down from the root
+    for (size_t i = 0; i < (size_t(1) << kLookupBits); i++) {
+        int node = root;
+        uint8_t len = 0;
+        while (node >= 0 && len < kLookupBits) {
+            node = tree[node][(i >> (kLookupBits - 1 - len)) & 1];
+            len++;
+        }
+        lookup[i] = {node, len};
+    }
+}
+
+char TreeTable::Decode(BitReader& br) const {
+    size_t len;
+    int node = Lookup(br.PeekBits(kLookupBits), len);
+    br.SkipBits(len);
+    while (node >= 0)
+        node = (*tree)[node][br.GetBit()];
+    return -1 - node;
+}
+
+int TreeTable::Lookup(uint32_t bits, size_t& len) const {
+    Entry e = lookup[bits];
+    len = e.len;
+    return e.node;
+}
 
 #endif  // HUFFMAN_H_
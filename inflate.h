@@ -0,0 +1,455 @@
+#ifndef INFLATE_H_
+#define INFLATE_H_
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <vector>
+
+#include "block.h"
+#include "huffman.h"
+
+#if __cpp_impl_coroutine
+#include <coroutine>
+#include <iterator>
+#include <string_view>
+#endif
+
+// Progress of Inflater::Inflate
+enum InflateStatus {
+    // The whole stream is decoded
+    kInflateDone,
+    kInflateNeedInput,
+    kInflateNeedOutput,
+    kInflateCorrupt,
+    // A framed member repeats its earlier bytes with a kBlockRef block,
+    // which needs more of the output than the Inflater keeps, or is of an
+    // older version of the format
+    kInflateUnsupported,
+};
+
+// Resumable decoder of zap files, in the manner of zlib's inflate: it takes
+// the input in chunks of any size and fills the caller's output buffer,
+// stops wherever either runs out, and goes on from there on the next call.
+// A single-stream file may stop even within the tree or a code, and
+// besides the tree only up to 64 bits of input are kept. Framed files
+// stop between whole blocks, one block of input and its bytes are kept,
+// and the checksum of every member is verified. As members may follow one
+// another, only Finish tells a framed file is complete.
+class Inflater {
+  public:
+    Inflater() = default;
+    // The lookup table points into the tree
+    Inflater(const Inflater &) = delete;
+    Inflater &operator=(const Inflater &) = delete;
+
+    // Consume `in` and fill `out` as far as both go, `in_used` and
+    // `out_used` get how much of each was taken
+    InflateStatus Inflate(const char *in, size_t n, size_t &in_used,
+                          char *out, size_t avail, size_t &out_used);
+    // Status once the input has ended: OK if the stream was complete or
+    // empty, truncated if it stopped short, corrupt if it was corrupt or
+    // unsupported
+    DecodeStatus Finish() const;
+    // Start over with a new stream
+    void Reset();
+
+  private:
+    enum State {
+        kTree, kCount, kCodes, kDone, kFailed,
+        // Framed files
+        kMagic, kHeader, kPayload, kBlock, kUnsupported,
+    };
+    // An internal node of the tree being read, with its children so far
+    struct Pending {
+        int node;
+        int filled;
+    };
+
+    InflateStatus InflateFramed(const char *in, size_t n, size_t &in_used,
+                                char *out, size_t avail, size_t &out_used);
+    // Copy `in` into `frame` until it holds `size` bytes, and return
+    // whether it does
+    bool Gather(const char *in, size_t n, size_t &in_used, size_t size);
+    // Move whole bytes of `in` into the bit buffer while they fit
+    void Fill(const char *in, size_t n, size_t &in_used);
+    uint64_t Take(size_t len);
+    // Hang a node read from the preorder tree under the pending one
+    void Attach(int node);
+
+    State state = kTree;
+    bool started = false;
+    // The next `count` bits, most significant first
+    uint64_t bits = 0;
+    size_t count = 0;
+    // As read by Huffman::ReadTree
+    std::vector<std::array<int, 2>> tree;
+    std::vector<Pending> pending;
+    int root = 0;
+    TreeTable table;
+    uint32_t remaining = 0;
+    // Where the current code has got to in the tree
+    int node = 0;
+
+    bool framed = false;
+    // Bytes of the current magic, header or payload, and how many of them
+    // are in, or how many bytes of `block` are out
+    std::vector<char> frame;
+    size_t have = 0;
+    uint8_t type = 0;
+    size_t raw = 0, coded = 0;
+    std::vector<char> block;
+    TableHistory history;
+    // CRC32C of the member so far, and whether its checksum matched
+    uint32_t crc = 0;
+    bool checked = false;
+    size_t members = 0;
+};
+
+InflateStatus Inflater::Inflate(const char *in, size_t n, size_t &in_used,
+                                char *out, size_t avail, size_t &out_used) {
+    in_used = 0;
+    out_used = 0;
+    // A single-stream file never starts with the first byte of the magic
+    if (!started && n > 0 && in[0] == BlockCodec::kMagic[0]) {
+        framed = true;
+        state = kMagic;
+    }
+    started |= n > 0;
+    if (framed)
+        return InflateFramed(in, n, in_used, out, avail, out_used);
+
+    // The preorder tree, one node at a time: a 0 for an internal node, a 1
+    // and 8 bits for a leaf
+    while (state == kTree) {
+        Fill(in, n, in_used);
+        if (count == 0)
+            return kInflateNeedInput;
+        // Compress never writes more than 128 leaves
+        if (pending.size() > 128) {
+            state = kFailed;
+            break;
+        }
+        if ((bits >> (count - 1)) & 1) {
+            if (count < 9)
+                return kInflateNeedInput;
+            Attach(-1 - static_cast<int>(Take(9) & 0xFF));
+        } else {
+            Take(1);
+            tree.push_back({0, 0});
+            Attach(tree.size() - 1);
+        }
+    }
+
+    if (state == kCount) {
+        Fill(in, n, in_used);
+        if (count < 32)
+            return kInflateNeedInput;
+        int freq = static_cast<int>(Take(32));
+        if (freq < 0) {
+            state = kFailed;
+        } else {
+            remaining = freq;
+            node = root;
+            if (root >= 0)
+                table.Build(tree, root);
+            state = remaining > 0 ? kCodes : kDone;
+        }
+    }
+
+    while (state == kCodes) {
+        if (out_used == avail)
+            return kInflateNeedOutput;
+        // A single char has an empty code
+        if (root < 0) {
+            size_t run = std::min<size_t>(remaining, avail - out_used);
+            std::fill(out + out_used, out + out_used + run,
+                      static_cast<char>(-1 - root));
+            out_used += run;
+            remaining -= run;
+        } else {
+            Fill(in, n, in_used);
+            // Whole lookups from the root, single bits down the tree
+            // otherwise and near the end of the input
+            if (node == root && count >= TreeTable::kLookupBits) {
+                size_t len;
+                node = table.Lookup(
+                        (bits >> (count - TreeTable::kLookupBits)) &
+                        ((1u << TreeTable::kLookupBits) - 1), len);
+                count -= len;
+            }
+            while (node >= 0 && count > 0)
+                node = tree[node][Take(1)];
+            if (node >= 0)
+                return kInflateNeedInput;
+            out[out_used++] = -1 - node;
+            node = root;
+            remaining--;
+        }
+        if (remaining == 0)
+            state = kDone;
+    }
+    return state == kDone ? kInflateDone : kInflateCorrupt;
+}
+
+InflateStatus Inflater::InflateFramed(const char *in, size_t n,
+                                      size_t &in_used, char *out,
+                                      size_t avail, size_t &out_used) {
+    for (;;) {
+        switch (state) {
+        case kMagic:
+            if (!Gather(in, n, in_used, sizeof(BlockCodec::kMagic)))
+                return kInflateNeedInput;
+            have = 0;
+            state = BlockCodec::HasMagic(frame.data(), frame.size()) ? kHeader
+                    : BlockCodec::HasOldMagic(frame.data(), frame.size())
+                        ? kUnsupported : kFailed;
+            break;
+        case kHeader: {
+            // The end of a member is its type alone
+            if (have == 0 && !Gather(in, n, in_used, 1))
+                return kInflateNeedInput;
+            uint8_t next = frame[0];
+            if (checked != (next == kBlockEnd)) {
+                state = kFailed;
+                break;
+            }
+            if (next == kBlockEnd) {
+                members++;
+                crc = 0;
+                checked = false;
+                history.Reset();
+                have = 0;
+                state = kMagic;
+                break;
+            }
+            if (!Gather(in, n, in_used, BlockCodec::kHeaderSize))
+                return kInflateNeedInput;
+            type = next;
+            raw = BlockCodec::GetU32(frame.data() + 1);
+            coded = BlockCodec::GetU32(frame.data() + 5);
+            have = 0;
+            // Blocks never code larger than they are stored
+            if (raw > BlockCodec::kMaxBlockSize ||
+                coded > BlockCodec::kMaxBlockSize ||
+                (type == kBlockChecksum &&
+                 (raw != 0 || coded != BlockCodec::kChecksumSize)))
+                state = kFailed;
+            else
+                state = type == kBlockRef ? kUnsupported : kPayload;
+            break;
+        }
+        case kPayload:
+            if (!Gather(in, n, in_used, coded))
+                return kInflateNeedInput;
+            have = 0;
+            if (type == kBlockChecksum) {
+                checked = BlockCodec::GetU32(frame.data()) == crc;
+                state = checked ? kHeader : kFailed;
+                break;
+            }
+            block.resize(raw);
+            if (BlockCodec::Decode(type, frame.data(), coded, block.data(),
+                                   raw, history) != kDecodeOk) {
+                state = kFailed;
+                break;
+            }
+            crc = Kernels::Crc32c(block.data(), raw, crc);
+            state = kBlock;
+            break;
+        case kBlock: {
+            size_t run = std::min(raw - have, avail - out_used);
+            memcpy(out + out_used, block.data() + have, run);
+            out_used += run;
+            have += run;
+            if (have < raw)
+                return kInflateNeedOutput;
+            have = 0;
+            state = kHeader;
+            break;
+        }
+        case kUnsupported:
+            return kInflateUnsupported;
+        default:
+            return kInflateCorrupt;
+        }
+    }
+}
+
+DecodeStatus Inflater::Finish() const {
+    if (state == kDone || (state == kTree && !started))
+        return kDecodeOk;
+    // Framed files may end after any member
+    if (state == kMagic && have == 0 && members > 0)
+        return kDecodeOk;
+    return state == kFailed || state == kUnsupported ? kDecodeCorrupt
+                                                     : kDecodeTruncated;
+}
+
+void Inflater::Reset() {
+    state = kTree;
+    started = false;
+    bits = 0;
+    count = 0;
+    tree.clear();
+    pending.clear();
+    root = 0;
+    remaining = 0;
+    node = 0;
+    framed = false;
+    have = 0;
+    history.Reset();
+    crc = 0;
+    checked = false;
+    members = 0;
+}
+
+bool Inflater::Gather(const char *in, size_t n, size_t &in_used,
+                      size_t size) {
+    // Payloads are followed by the padding decoders may read
+    if (frame.size() < size + BitReader::kPadding)
+        frame.resize(size + BitReader::kPadding);
+    size_t take = std::min(size - have, n - in_used);
+    memcpy(frame.data() + have, in + in_used, take);
+    in_used += take;
+    have += take;
+    return have == size;
+}
+
+void Inflater::Fill(const char *in, size_t n, size_t &in_used) {
+    while (count <= 56 && in_used < n) {
+        bits = (bits << 8) | static_cast<unsigned char>(in[in_used++]);
+        count += 8;
+    }
+}
+
+uint64_t Inflater::Take(size_t len) {
+    count -= len;
+    return (bits >> count) & ((uint64_t(1) << len) - 1);
+}
+
+void Inflater::Attach(int node) {
+    if (pending.empty())
+        root = node;
+    else
+        tree[pending.back().node][pending.back().filled++] = node;
+    if (node >= 0) {
+        pending.push_back({node, 0});
+        return;
+    }
+    // A leaf may complete its parent, and the parent its own
+    while (!pending.empty() && pending.back().filled == 2)
+        pending.pop_back();
+    if (pending.empty())
+        state = kCount;
+}
+
+#if __cpp_impl_coroutine
+// Generator of the chunks InflateChunks decodes, each valid until the next
+// one is asked for
+class InflateGenerator {
+  public:
+    struct promise_type {
+        std::string_view chunk;
+
+        InflateGenerator get_return_object() {
+            return InflateGenerator(
+                    std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(std::string_view c) noexcept {
+            chunk = c;
+            return {};
+        }
+        void return_void() { }
+        void unhandled_exception() { throw; }
+    };
+
+    class iterator {
+      public:
+        explicit iterator(std::coroutine_handle<promise_type> handle)
+                : handle(handle) { }
+        std::string_view operator*() const { return handle.promise().chunk; }
+        iterator &operator++() {
+            handle.resume();
+            return *this;
+        }
+        bool operator==(std::default_sentinel_t) const { return handle.done(); }
+
+      private:
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    explicit InflateGenerator(std::coroutine_handle<promise_type> handle);
+    InflateGenerator(InflateGenerator &&other) noexcept;
+    InflateGenerator(const InflateGenerator &) = delete;
+    ~InflateGenerator();
+
+    iterator begin();
+    std::default_sentinel_t end() const;
+
+  private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+InflateGenerator::InflateGenerator(std::coroutine_handle<promise_type> handle)
+        : handle(handle) { }
+
+InflateGenerator::InflateGenerator(InflateGenerator &&other) noexcept
+        : handle(other.handle) {
+    other.handle = nullptr;
+}
+
+InflateGenerator::~InflateGenerator() {
+    if (handle)
+        handle.destroy();
+}
+
+InflateGenerator::iterator InflateGenerator::begin() {
+    handle.resume();
+    return iterator(handle);
+}
+
+std::default_sentinel_t InflateGenerator::end() const {
+    return std::default_sentinel;
+}
+
+// Decode a zap file from `source` into chunks of up to `chunk`
+// bytes, reading it `chunk` bytes at a time. `status` is set once the
+// chunks run out.
+InflateGenerator InflateChunks(std::istream &source, size_t chunk,
+                               DecodeStatus &status) {
+    Inflater inflater;
+    std::vector<char> in(chunk), out(chunk);
+    size_t start = 0, end = 0;
+    // More input only once the bits already taken are used up
+    InflateStatus progress = kInflateNeedInput;
+    for (;;) {
+        if (start == end && progress == kInflateNeedInput) {
+            source.read(in.data(), in.size());
+            start = 0;
+            end = source.gcount();
+            if (end == 0) {
+                status = inflater.Finish();
+                co_return;
+            }
+        }
+        size_t in_used, out_used;
+        progress = inflater.Inflate(in.data() + start, end - start, in_used,
+                                    out.data(), out.size(), out_used);
+        start += in_used;
+        if (out_used > 0)
+            co_yield std::string_view(out.data(), out_used);
+        if (progress != kInflateNeedInput && progress != kInflateNeedOutput) {
+            status = progress == kInflateDone ? kDecodeOk : kDecodeCorrupt;
+            co_return;
+        }
+    }
+}
+#endif
+
+#endif  // INFLATE_H_
@@ -0,0 +1,412 @@
+#ifndef KERNELS_H_
+#define KERNELS_H_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+#include "bstream.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86 1
+#define KERNELS_TARGET(isa) __attribute__((target(isa)))
+#else
+#define KERNELS_TARGET(isa)
+#endif
+
+// The instruction sets a kernel may be compiled for, each one implying
+// the ones before it
+enum CpuTier : int {
+    kTierScalar = 0,
+    kTierSse42 = 1,
+    kTierAvx2 = 2,
+    // AVX2 with BMI1 and BMI2
+    kTierBmi2 = 3,
+};
+
+// The hot loops of the coders, each with a portable version and one for
+// the instruction set that changes how it is done, picked at run time so
+// that the binaries still run on any x86-64:
+//   Histogram    AVX2 counts 32 equal bytes at once
+//   PackCodes    BMI2 writes whole bytes after every code, without a branch
+//   Crc32c       SSE4.2 has the crc32 instruction
+// and DecodeTable::DecodeMany, whose BMI2 version takes several codes out
+// of one load. A tier runs the best version of every kernel it implies.
+// All give the same output. The ZAP_CPU environment variable (scalar,
+// sse4.2, avx2 or bmi2) caps the tier, for testing and comparing them.
+class Kernels {
+  public:
+    static constexpr const char *kEnvironment = "ZAP_CPU";
+
+    // Best tier this CPU supports
+    static CpuTier Detected();
+    // The tier ZAP_CPU asks for, or the detected one if it isn't set or
+    // isn't a tier name, never above the detected one
+    static CpuTier FromEnvironment();
+    // Tier the kernels use, FromEnvironment until Use is called
+    static CpuTier Active();
+    // Use `tier`, or the detected one if it is lower, and return it
+    static CpuTier Use(CpuTier tier);
+
+    static const char *Name(CpuTier tier);
+    // Return false unless `name` is one of the names above
+    static bool Parse(const char *name, CpuTier &tier);
+
+    // Count the bytes of `in` into `freq`, which is overwritten
+    static void Histogram(const char *in, size_t n, size_t freq[256]);
+    // Append the code of every symbol of `in`, most significant bit first,
+    // the last byte padded with zeros, as BitWriter would. `codes` and
+    // `lens` are indexed by symbol, codes are at most 32 bits.
+    template <typename Symbol>
+    static void PackCodes(const Symbol *in, size_t n, const uint32_t *codes,
+                          const uint8_t *lens, std::vector<char> &out);
+    // CRC32C (Castagnoli) of `data`, continuing from the CRC of the bytes
+    // before it
+    static uint32_t Crc32c(const char *data, size_t n, uint32_t crc = 0);
+    // CRC32C of two pieces of data one after the other, from the CRC of
+    // each and the length of the second, in time logarithmic in it
+    static uint32_t Crc32cCombine(uint32_t first, uint32_t second, size_t n);
+
+  private:
+    // Castagnoli's, bit-reflected
+    static constexpr uint32_t kCrc32cPolynomial = 0x82F63B78;
+    // Product of two polynomials modulo the CRC's, bit-reflected
+    static uint32_t MultiplyModulo(uint32_t a, uint32_t b);
+    static std::atomic<int>& Current();
+
+    static void HistogramScalar(const char *in, size_t n, size_t freq[256]);
+    template <typename Symbol>
+    static void PackScalar(const Symbol *in, size_t n, const uint32_t *codes,
+                           const uint8_t *lens, std::vector<char> &out);
+    static uint32_t Crc32cScalar(const char *data, size_t n, uint32_t crc);
+#ifdef KERNELS_X86
+    KERNELS_TARGET("avx2")
+    static void HistogramAvx2(const char *in, size_t n, size_t freq[256]);
+    template <typename Symbol>
+    KERNELS_TARGET("avx2,bmi,bmi2")
+    static void PackBmi2(const Symbol *in, size_t n, const uint32_t *codes,
+                         const uint8_t *lens, std::vector<char> &out);
+    KERNELS_TARGET("sse4.2")
+    static uint32_t Crc32cSse42(const char *data, size_t n, uint32_t crc);
+#endif
+};
+
+CpuTier Kernels::Detected() {
+#ifdef KERNELS_X86
+    static const CpuTier detected = [] {
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("sse4.2"))
+            return kTierScalar;
+        if (!__builtin_cpu_supports("avx2"))
+            return kTierSse42;
+        if (!__builtin_cpu_supports("bmi") || !__builtin_cpu_supports("bmi2"))
+            return kTierAvx2;
+        return kTierBmi2;
+    }();
+    return detected;
+#else
+    return kTierScalar;
+#endif
+}
+
+CpuTier Kernels::FromEnvironment() {
+    CpuTier tier;
+    const char *name = getenv(kEnvironment);
+    if (name == nullptr || !Parse(name, tier))
+        return Detected();
+    return std::min(tier, Detected());
+}
+
+CpuTier Kernels::Active() {
+    return static_cast<CpuTier>(Current().load(std::memory_order_relaxed));
+}
+
+CpuTier Kernels::Use(CpuTier tier) {
+    tier = std::min(tier, Detected());
+    Current().store(tier, std::memory_order_relaxed);
+    return tier;
+}
+
+std::atomic<int>& Kernels::Current() {
+    static std::atomic<int> current(FromEnvironment());
+    return current;
+}
+
+const char *Kernels::Name(CpuTier tier) {
+    switch (tier) {
+    case kTierScalar:
+        return "scalar";
+    case kTierSse42:
+        return "sse4.2";
+    case kTierAvx2:
+        return "avx2";
+    case kTierBmi2:
+        return "bmi2";
+    }
+    return "unknown";
+}
+
+bool Kernels::Parse(const char *name, CpuTier &tier) {
+    for (CpuTier t : {kTierScalar, kTierSse42, kTierAvx2, kTierBmi2}) {
+        if (strcmp(name, Name(t)) == 0) {
+            tier = t;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t Kernels::Crc32c(const char *data, size_t n, uint32_t crc) {
+#ifdef KERNELS_X86
+    if (Active() >= kTierSse42)
+        return Crc32cSse42(data, n, crc);
+#endif
+    return Crc32cScalar(data, n, crc);
+}
+
+uint32_t Kernels::Crc32cCombine(uint32_t first, uint32_t second, size_t n) {
+    // Appending n zero bytes multiplies by x^(8n), made of the powers
+    // x^(2^k) for the bits of 8n
+    static const auto powers = [] {
+        std::array<uint32_t, 64 + 3> p;
+        p[0] = uint32_t(1) << 30;
+        for (size_t k = 1; k < p.size(); k++)
+            p[k] = MultiplyModulo(p[k - 1], p[k - 1]);
+        return p;
+    }();
+    uint32_t shift = uint32_t(1) << 31;
+    for (size_t k = 3; n > 0; n >>= 1, k++)
+        if (n & 1)
+            shift = MultiplyModulo(powers[k], shift);
+    return MultiplyModulo(shift, first) ^ second;
+}
+
+uint32_t Kernels::MultiplyModulo(uint32_t a, uint32_t b) {
+    // Bit 31 is x^0
+    uint32_t product = 0;
+    for (uint32_t m = uint32_t(1) << 31; m != 0; m >>= 1) {
+        if (a & m)
+            product ^= b;
+        b = b & 1 ? (b >> 1) ^ kCrc32cPolynomial : b >> 1;
+    }
+    return product;
+}
+
+void Kernels::Histogram(const char *in, size_t n, size_t freq[256]) {
+#ifdef KERNELS_X86
+    if (Active() >= kTierAvx2)
+        return HistogramAvx2(in, n, freq);
+#endif
+    HistogramScalar(in, n, freq);
+}
+
+template <typename Symbol>
+void Kernels::PackCodes(const Symbol *in, size_t n, const uint32_t *codes,
+                        const uint8_t *lens, std::vector<char> &out) {
+#ifdef KERNELS_X86
+    if (Active() >= kTierBmi2)
+        return PackBmi2(in, n, codes, lens, out);
+#endif
+    PackScalar(in, n, codes, lens, out);
+}
+
+void Kernels::HistogramScalar(const char *in, size_t n, size_t freq[256]) {
+    // Bytes go round four tables so that runs of one byte don't wait on
+    // the same counter, read eight at a time
+    constexpr size_t kChunk = size_t(1) << 30;
+    uint32_t counts[4][256];
+    std::fill(freq, freq + 256, 0);
+    for (size_t start = 0; start < n; start += kChunk) {
+        const unsigned char *p =
+            reinterpret_cast<const unsigned char *>(in) + start;
+        size_t len = std::min(kChunk, n - start), i = 0;
+        memset(counts, 0, sizeof(counts));
+        for (; i + 8 <= len; i += 8) {
+            uint64_t w;
+            memcpy(&w, p + i, 8);
+            counts[0][w & 0xFF]++;
+            counts[1][(w >> 8) & 0xFF]++;
+            counts[2][(w >> 16) & 0xFF]++;
+            counts[3][(w >> 24) & 0xFF]++;
+            counts[0][(w >> 32) & 0xFF]++;
+            counts[1][(w >> 40) & 0xFF]++;
+            counts[2][(w >> 48) & 0xFF]++;
+            counts[3][w >> 56]++;
+        }
+        for (; i < len; i++)
+            counts[0][p[i]]++;
+        for (int c = 0; c < 256; c++)
+            freq[c] += size_t(counts[0][c]) + counts[1][c] + counts[2][c] +
+                       counts[3][c];
+    }
+}
+
+template <typename Symbol>
+void Kernels::PackScalar(const Symbol *in, size_t n, const uint32_t *codes,
+                         const uint8_t *lens, std::vector<char> &out) {
+    // Codes are at most 32 bits, so a 64-bit buffer holding fewer than 32
+    // takes any of them, and 32 bits at a time are written out
+    constexpr size_t kStep = 4096;
+    uint64_t buffer = 0;
+    size_t count = 0, pos = out.size();
+    for (size_t i = 0; i < n; ) {
+        size_t end = std::min(n, i + kStep);
+        out.resize(pos + 4 * (end - i));
+        char *p = out.data();
+        for (; i < end; i++) {
+            auto c = static_cast<std::make_unsigned_t<Symbol>>(in[i]);
+            buffer = buffer << lens[c] | codes[c];
+            count += lens[c];
+            if (count >= 32) {
+                count -= 32;
+                uint32_t word = static_cast<uint32_t>(buffer >> count);
+                p[pos] = static_cast<char>(word >> 24);
+                p[pos + 1] = static_cast<char>(word >> 16);
+                p[pos + 2] = static_cast<char>(word >> 8);
+                p[pos + 3] = static_cast<char>(word);
+                pos += 4;
+            }
+        }
+    }
+    out.resize(pos + 4);
+    while (count >= 8) {
+        count -= 8;
+        out[pos++] = static_cast<char>(buffer >> count);
+    }
+    if (count > 0)
+        out[pos++] = static_cast<char>(buffer << (8 - count));
+    out.resize(pos);
+}
+
+uint32_t Kernels::Crc32cScalar(const char *data, size_t n, uint32_t crc) {
+    // Eight bytes per step through eight tables, table[k] advancing a byte
+    // by k more zero bytes
+    static const auto table = [] {
+        std::array<std::array<uint32_t, 256>, 8> t;
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? (c >> 1) ^ kCrc32cPolynomial : c >> 1;
+            t[0][i] = c;
+        }
+        for (size_t k = 1; k < 8; k++)
+            for (uint32_t i = 0; i < 256; i++)
+                t[k][i] = t[0][t[k - 1][i] & 0xFF] ^ t[k - 1][i] >> 8;
+        return t;
+    }();
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+    crc = ~crc;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint32_t low = crc ^ (uint32_t(p[i]) | uint32_t(p[i + 1]) << 8 |
+                              uint32_t(p[i + 2]) << 16 |
+                              uint32_t(p[i + 3]) << 24);
+        crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^
+              table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24] ^
+              table[3][p[i + 4]] ^ table[2][p[i + 5]] ^
+              table[1][p[i + 6]] ^ table[0][p[i + 7]];
+    }
+    for (; i < n; i++)
+        crc = table[0][(crc ^ p[i]) & 0xFF] ^ crc >> 8;
+    return ~crc;
+}
+
+#ifdef KERNELS_X86
+void Kernels::HistogramAvx2(const char *in, size_t n, size_t freq[256]) {
+    // 32 bytes at a time: a vector of one byte repeated, as in runs, is
+    // counted with a single addition, the bytes of any other go round
+    // four tables as in the scalar version
+    constexpr size_t kChunk = size_t(1) << 30;
+    uint32_t counts[4][256];
+    std::fill(freq, freq + 256, 0);
+    for (size_t start = 0; start < n; start += kChunk) {
+        const unsigned char *p =
+            reinterpret_cast<const unsigned char *>(in) + start;
+        size_t len = std::min(kChunk, n - start), i = 0;
+        memset(counts, 0, sizeof(counts));
+        for (; i + 32 <= len; i += 32) {
+            __m256i v = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i *>(p + i));
+            __m256i first = _mm256_broadcastb_epi8(_mm256_castsi256_si128(v));
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, first)) == -1) {
+                counts[0][p[i]] += 32;
+                continue;
+            }
+            for (size_t k = 0; k < 32; k += 8) {
+                uint64_t w;
+                memcpy(&w, p + i + k, 8);
+                counts[0][w & 0xFF]++;
+                counts[1][(w >> 8) & 0xFF]++;
+                counts[2][(w >> 16) & 0xFF]++;
+                counts[3][(w >> 24) & 0xFF]++;
+                counts[0][(w >> 32) & 0xFF]++;
+                counts[1][(w >> 40) & 0xFF]++;
+                counts[2][(w >> 48) & 0xFF]++;
+                counts[3][w >> 56]++;
+            }
+        }
+        for (; i < len; i++)
+            counts[0][p[i]]++;
+        for (int c = 0; c < 256; c++)
+            freq[c] += size_t(counts[0][c]) + counts[1][c] + counts[2][c] +
+                       counts[3][c];
+    }
+}
+
+template <typename Symbol>
+void Kernels::PackBmi2(const Symbol *in, size_t n, const uint32_t *codes,
+                       const uint8_t *lens, std::vector<char> &out) {
+    // After every code, an unaligned 8-byte store writes out the bits held
+    // and the whole bytes among them are kept: no branch, variable shifts
+    // by shlx. Fewer than 8 bits stay held, so with a code they fit
+    constexpr size_t kStep = 4096;
+    uint64_t buffer = 0;
+    size_t count = 0, pos = out.size();
+    for (size_t i = 0; i < n; ) {
+        size_t end = std::min(n, i + kStep);
+        out.resize(pos + 4 * (end - i) + 8);
+        char *p = out.data() + pos;
+        for (; i < end; i++) {
+            auto c = static_cast<std::make_unsigned_t<Symbol>>(in[i]);
+            buffer = buffer << lens[c] | codes[c];
+            count += lens[c];
+            // In two shifts, as no bit may be held
+            uint64_t word = __builtin_bswap64(buffer << (63 - count) << 1);
+            memcpy(p, &word, 8);
+            p += count >> 3;
+            count &= 7;
+        }
+        pos = p - out.data();
+    }
+    out.resize(pos + 1);
+    if (count > 0)
+        out[pos++] = static_cast<char>(buffer << (8 - count));
+    out.resize(pos);
+}
+
+uint32_t Kernels::Crc32cSse42(const char *data, size_t n, uint32_t crc) {
+    crc = ~crc;
+    size_t i = 0;
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        crc64 = _mm_crc32_u64(crc64, w);
+    }
+    crc = static_cast<uint32_t>(crc64);
+#endif
+    for (; i < n; i++)
+        crc = _mm_crc32_u8(crc, static_cast<unsigned char>(data[i]));
+    return ~crc;
+}
+#endif
+
+#endif  // KERNELS_H_
@@ -0,0 +1,138 @@
+#ifndef ORDER1_H_
+#define ORDER1_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "bstream.h"
+#include "huffman.h"
+
+// Order-1 Huffman coding: every byte is coded with the canonical code of
+// the byte before it, the first one with the code of context 0.
+//
+// Block payload:
+//   number of contexts - 1 (1 byte)
+//   for each context: its byte, then a code table as in Huffman blocks
+//   (number of symbols - 1, then (symbol, length) pairs)
+//   the code of every byte
+class Order1 {
+  public:
+    static void EncodeBlock(const char *in, size_t n, std::vector<char> &out);
+    // `in` must be followed by BitReader::kPadding readable bytes
+    static DecodeStatus DecodeBlock(const char *in, size_t n,
+                                    char *out, size_t raw);
+};
+
+void Order1::EncodeBlock(const char *in, size_t n, std::vector<char> &out) {
+    // Frequencies of every (context, byte) pair
+    std::vector<size_t> freq(256 * 256, 0);
+    unsigned char prev = 0;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = in[i];
+        freq[prev * 256 + c]++;
+        prev = c;
+    }
+
+    std::vector<uint8_t> lens(256 * 256, 0);
+    std::vector<uint32_t> codes(256 * 256, 0);
+    std::vector<int> contexts;
+    for (int ctx = 0; ctx < 256; ctx++) {
+        size_t symbols = 0;
+        for (int i = 0; i < 256; i++)
+            symbols += freq[ctx * 256 + i] != 0;
+        if (symbols == 0)
+            continue;
+        contexts.push_back(ctx);
+        Huffman::BuildLengths(&freq[ctx * 256], &lens[ctx * 256]);
+        Huffman::AssignCodes(&lens[ctx * 256], 256, &codes[ctx * 256]);
+    }
+
+    out.push_back(static_cast<char>(contexts.size() - 1));
+    for (int ctx : contexts) {
+        out.push_back(static_cast<char>(ctx));
+        size_t symbols = 0;
+        for (int i = 0; i < 256; i++)
+            symbols += freq[ctx * 256 + i] != 0;
+        out.push_back(static_cast<char>(symbols - 1));
+        for (int i = 0; i < 256; i++) {
+            if (freq[ctx * 256 + i] == 0)
+                continue;
+            out.push_back(static_cast<char>(i));
+            out.push_back(static_cast<char>(lens[ctx * 256 + i]));
+        }
+    }
+
+    BitWriter bw(out);
+    prev = 0;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = in[i];
+        bw.PutBits(codes[prev * 256 + c], lens[prev * 256 + c]);
+        prev = c;
+    }
+    bw.Close();
+}
+
+DecodeStatus Order1::DecodeBlock(const char *in, size_t n,
+                                 char *out, size_t raw) {
+    if (n < 1)
+        return kDecodeTruncated;
+    size_t contexts = static_cast<unsigned char>(in[0]) + 1;
+
+    // Contexts with a single symbol need no table
+    enum { kMissing, kSingle, kTable };
+    uint8_t kind[256] = {0};
+    uint8_t single[256];
+    int slot[256];
+    // Too many tables for lookups, codes are found by length
+    std::vector<CanonicalTable> tables(contexts);
+    size_t pos = 1;
+    for (size_t i = 0; i < contexts; i++) {
+        if (pos + 2 > n)
+            return kDecodeTruncated;
+        unsigned char ctx = in[pos];
+        size_t symbols = static_cast<unsigned char>(in[pos + 1]) + 1;
+        pos += 2;
+        if (pos + 2 * symbols > n)
+            return kDecodeTruncated;
+        if (kind[ctx] != kMissing)
+            return kDecodeCorrupt;
+
+        if (symbols == 1) {
+            kind[ctx] = kSingle;
+            single[ctx] = in[pos];
+        } else {
+            uint8_t lens[256] = {0};
+            for (size_t j = 0; j < symbols; j++) {
+                unsigned char c = in[pos + 2 * j];
+                if (lens[c] != 0)
+                    return kDecodeCorrupt;
+                lens[c] = in[pos + 2 * j + 1];
+            }
+            if (!tables[i].Build(lens))
+                return kDecodeCorrupt;
+            kind[ctx] = kTable;
+            slot[ctx] = i;
+        }
+        pos += 2 * symbols;
+    }
+
+    BitReader br(in + pos, n - pos);
+    unsigned char prev = 0;
+    for (size_t i = 0; i < raw; i++) {
+        switch (kind[prev]) {
+        case kTable:
+            prev = tables[slot[prev]].Decode(br);
+            break;
+        case kSingle:
+            prev = single[prev];
+            break;
+        default:
+            return kDecodeCorrupt;
+        }
+        out[i] = prev;
+    }
+    return br.Overrun() ? kDecodeTruncated : kDecodeOk;
+}
+
+#endif  // ORDER1_H_
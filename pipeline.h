@@ -0,0 +1,472 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "block.h"
+#include "dedup.h"
+
+// Bounded lock-free queue between exactly one producer and one consumer
+template <typename T>
+class SPSCRing {
+public:
+    // Capacity is rounded up to a power of two
+    explicit SPSCRing(size_t capacity);
+    // Return false instead of blocking when full or empty
+    bool TryPush(const T &item);
+    bool TryPop(T &item);
+
+private:
+    std::vector<T> items;
+    size_t mask;
+    // Consumer and producer positions, on separate cache lines
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
+
+template <typename T>
+SPSCRing<T>::SPSCRing(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    items.resize(size);
+    mask = size - 1;
+}
+
+template <typename T>
+bool SPSCRing<T>::TryPush(const T &item) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == items.size())
+        return false;
+    items[t & mask] = item;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T>
+bool SPSCRing<T>::TryPop(T &item) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire))
+        return false;
+    item = items[h & mask];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+}
+
+// Reusable buffers for one block travelling through the pipeline
+struct PipelineBlock {
+    uint8_t type = 0;
+    // Output offset of the bytes a kBlockRef block repeats
+    uint64_t ref = 0;
+    // Position of the block in the member
+    size_t index = 0;
+    // CRC32C of `raw`, filled by the worker, or for a kBlockChecksum block
+    // the one it holds
+    uint32_t crc = 0;
+    // When decoding, the table of the block if it has one, and where its
+    // codes start in `coded`
+    std::shared_ptr<const TableHistory::Table> table;
+    size_t codes = 0;
+    std::vector<char> raw;
+    std::vector<char> coded;
+};
+
+// Reader thread -> coding workers -> writer, connected by SPSC rings.
+// The reader hands blocks to the workers round robin and the writer
+// collects them in the same order, so the output order is preserved.
+// Blocks go back from the writer to the reader once written.
+class Pipeline {
+public:
+    // With dedup, a block already seen in the input is written as a
+    // reference to it, and `stats` are filled if given
+    static bool Compress(int in_fd, int out_fd, unsigned int num_workers,
+                         size_t block_size = BlockCodec::kDefaultBlockSize,
+                         DedupMode dedup = kDedupNone,
+                         DedupStats *stats = nullptr);
+    // Expects one or more framed streams, see BlockCodec. References are
+    // copied back from the output, so then `out_fd` must be a readable
+    // file written from its start.
+    static bool Decompress(int in_fd, int out_fd, unsigned int num_workers);
+
+    // Fill a block, return > 0 if filled, 0 at the end and < 0 on error
+    using ReadStage = std::function<int(PipelineBlock &)>;
+    // Return false on error
+    using CodeStage = std::function<bool(PipelineBlock &)>;
+    using WriteStage = std::function<bool(PipelineBlock &)>;
+
+    static bool Run(unsigned int num_workers, const ReadStage &read,
+                    const CodeStage &code, const WriteStage &write);
+
+    // Blocking I/O helpers, retrying short reads and writes
+    static bool ReadAll(int fd, char *data, size_t n, off_t offset,
+                        size_t &got);
+    static bool WriteAll(int fd, const char *data, size_t n);
+
+private:
+    // Blocks in flight per worker
+    static constexpr size_t kDepth = 2;
+
+    // Yield at first, then sleep so that waiting stages leave the cores
+    // to the busy ones
+    static void Backoff(size_t spins);
+
+    // Spin until the ring accepts or yields an item, unless the run failed
+    template <typename T>
+    static bool Push(SPSCRing<T> &ring, const T &item,
+                     const std::atomic<bool> &failed);
+    template <typename T>
+    static bool Pop(SPSCRing<T> &ring, T &item,
+                    const std::atomic<bool> &failed);
+};
+
+bool Pipeline::Compress(int in_fd, int out_fd, unsigned int num_workers,
+                        size_t block_size, DedupMode dedup, DedupStats *stats) {
+    if (block_size == 0 || block_size > BlockCodec::kMaxBlockSize)
+        block_size = BlockCodec::kDefaultBlockSize;
+    if (num_workers == 0)
+        num_workers = 1;
+    if (!WriteAll(out_fd, BlockCodec::kMagic, sizeof(BlockCodec::kMagic)))
+        return false;
+
+    // Duplicates are found by the reader, which sees the blocks in order
+    DedupIndex index;
+    DedupStats counts;
+    std::vector<char> earlier;
+    auto find_duplicate = [&](PipelineBlock &b, off_t offset) {
+        auto start = std::chrono::steady_clock::now();
+        if (dedup == kDedupContent)
+            b.raw.resize(DedupIndex::Cut(b.raw.data(), b.raw.size(), block_size));
+        size_t n = b.raw.size();
+        uint64_t fingerprint = DedupIndex::Fingerprint(b.raw.data(), n);
+        std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+        counts.hash_seconds += elapsed.count();
+        counts.blocks++;
+        counts.bytes += n;
+
+        // Input and member offsets are the same, compare with the input
+        uint64_t ref = offset;
+        size_t got;
+        if (!index.FindOrInsert(fingerprint, n, ref))
+            return true;
+        earlier.resize(n);
+        if (!ReadAll(in_fd, earlier.data(), n, ref, got))
+            return false;
+        if (got == n && memcmp(earlier.data(), b.raw.data(), n) == 0) {
+            b.type = kBlockRef;
+            b.ref = ref;
+            counts.duplicates++;
+            counts.duplicate_bytes += n;
+        }
+        return true;
+    };
+
+    off_t offset = 0;
+    size_t blocks = 0;
+    auto read = [&](PipelineBlock &b) {
+        size_t got;
+        b.index = blocks++;
+        b.raw.resize(block_size);
+        if (!ReadAll(in_fd, b.raw.data(), block_size, offset, got))
+            return -1;
+        b.raw.resize(got);
+        b.type = kBlockHuffman;
+        if (got > 0 && dedup != kDedupNone && !find_duplicate(b, offset))
+            return -1;
+        offset += b.raw.size();
+        return got > 0 ? 1 : 0;
+    };
+    // Block i goes to worker i % num_workers, whose previous block was
+    // num_workers blocks before: only its table can be reused
+    std::vector<BlockTable> tables(num_workers);
+    auto code = [&](PipelineBlock &b) {
+        BlockTable &table = tables[b.index % num_workers];
+        table.distance = b.index >= num_workers ? num_workers : 0;
+        b.crc = Kernels::Crc32c(b.raw.data(), b.raw.size());
+        b.coded.clear();
+        if (b.type == kBlockRef) {
+            BlockCodec::EncodeRef(b.ref, b.raw.size(), b.coded);
+            memset(table.lens, 0, sizeof(table.lens));
+        } else {
+            BlockCodec::Encode(b.raw.data(), b.raw.size(), b.coded, &table);
+        }
+        return true;
+    };
+    // The writer only combines the CRCs of the blocks
+    uint32_t crc = 0;
+    auto write = [&](PipelineBlock &b) {
+        crc = Kernels::Crc32cCombine(crc, b.crc, b.raw.size());
+        return WriteAll(out_fd, b.coded.data(), b.coded.size());
+    };
+    bool ok = Run(num_workers, read, code, write);
+    if (stats) {
+        counts.index_bytes = index.MemoryBytes();
+        *stats = counts;
+    }
+    if (!ok)
+        return false;
+
+    std::vector<char> end;
+    BlockCodec::EncodeEnd(crc, end);
+    return WriteAll(out_fd, end.data(), end.size());
+}
+
+bool Pipeline::Decompress(int in_fd, int out_fd, unsigned int num_workers) {
+    char magic[sizeof(BlockCodec::kMagic)];
+    size_t got;
+    if (!ReadAll(in_fd, magic, sizeof(magic), 0, got) ||
+        !BlockCodec::HasMagic(magic, got))
+        return false;
+
+    // The reader walks the block headers and keeps the code tables, workers
+    // only see payloads. Positions in the output tell where references
+    // point to.
+    off_t offset = sizeof(magic);
+    uint64_t member = 0, position = 0;
+    size_t blocks = 0;
+    // Whether the member's checksum was read, only its end may follow
+    bool checked = false;
+    TableHistory history;
+    auto read = [&](PipelineBlock &b) {
+        char header[BlockCodec::kHeaderSize];
+        if (!ReadAll(in_fd, header, 1, offset, got) || got != 1)
+            return -1;
+        b.type = header[0];
+        // Another member may follow the end of this one
+        while (b.type == kBlockEnd) {
+            if (!checked)
+                return -1;
+            checked = false;
+            offset++;
+            if (!ReadAll(in_fd, magic, sizeof(magic), offset, got))
+                return -1;
+            if (got == 0)
+                return 0;
+            if (!BlockCodec::HasMagic(magic, got))
+                return -1;
+            offset += sizeof(magic);
+            member = position;
+            blocks = 0;
+            history.Reset();
+            if (!ReadAll(in_fd, header, 1, offset, got) || got != 1)
+                return -1;
+            b.type = header[0];
+        }
+        if (checked)
+            return -1;
+        if (!ReadAll(in_fd, header + 1, sizeof(header) - 1, offset + 1, got) ||
+            got != sizeof(header) - 1)
+            return -1;
+        uint32_t raw = BlockCodec::GetU32(header + 1);
+        uint32_t coded = BlockCodec::GetU32(header + 5);
+        if (raw > BlockCodec::kMaxBlockSize || coded > 2 * BlockCodec::kMaxBlockSize)
+            return -1;
+        offset += sizeof(header);
+
+        // Keep zeroed slack after the payload for the bit reader
+        b.coded.resize(coded + BitReader::kPadding);
+        if (!ReadAll(in_fd, b.coded.data(), coded, offset, got) || got != coded)
+            return -1;
+        std::fill(b.coded.begin() + coded, b.coded.end(), 0);
+        offset += coded;
+        b.raw.resize(raw);
+        b.index = blocks++;
+        if (b.type == kBlockChecksum) {
+            if (raw != 0 || coded != BlockCodec::kChecksumSize)
+                return -1;
+            b.crc = BlockCodec::GetU32(b.coded.data());
+            b.table.reset();
+            checked = true;
+            return 1;
+        }
+        if (history.Next(b.type, b.coded.data(), coded, raw, b.table,
+                         b.codes) != kDecodeOk)
+            return -1;
+
+        if (b.type == kBlockRef) {
+            if (coded != BlockCodec::kRefSize)
+                return -1;
+            uint64_t ref = uint64_t(BlockCodec::GetU32(b.coded.data())) << 32 |
+                           BlockCodec::GetU32(b.coded.data() + 4);
+            // Only what this member already decoded can be repeated
+            if (ref > position - member || raw > position - member - ref)
+                return -1;
+            b.ref = member + ref;
+        }
+        position += raw;
+        return 1;
+    };
+    auto code = [](PipelineBlock &b) {
+        if (b.type == kBlockRef || b.type == kBlockChecksum)
+            return true;
+        size_t coded = b.coded.size() - BitReader::kPadding;
+        DecodeStatus status;
+        if (b.table)
+            status = Huffman::DecodeCodes(b.coded.data() + b.codes,
+                                          coded - b.codes, b.table->decode,
+                                          b.raw.data(), b.raw.size());
+        else
+            status = BlockCodec::Decode(b.type, b.coded.data(), coded,
+                                        b.raw.data(), b.raw.size());
+        if (status != kDecodeOk)
+            return false;
+        b.crc = Kernels::Crc32c(b.raw.data(), b.raw.size());
+        return true;
+    };
+    // The writer is the only one to see the output, it resolves references
+    // and checks the CRC of each member, combined from those of its blocks
+    uint32_t crc = 0;
+    auto write = [&](PipelineBlock &b) {
+        size_t got;
+        if (b.index == 0)
+            crc = 0;
+        if (b.type == kBlockChecksum)
+            return crc == b.crc;
+        if (b.type == kBlockRef) {
+            if (!ReadAll(out_fd, b.raw.data(), b.raw.size(), b.ref, got) ||
+                got != b.raw.size())
+                return false;
+            b.crc = Kernels::Crc32c(b.raw.data(), b.raw.size());
+        }
+        crc = Kernels::Crc32cCombine(crc, b.crc, b.raw.size());
+        return WriteAll(out_fd, b.raw.data(), b.raw.size());
+    };
+    return Run(num_workers, read, code, write);
+}
+
+bool Pipeline::Run(unsigned int num_workers, const ReadStage &read,
+                   const CodeStage &code, const WriteStage &write) {
+    if (num_workers == 0)
+        num_workers = 1;
+    // Rings are sized so that pushing never has to wait
+    size_t pool = num_workers * kDepth + 1;
+    std::vector<PipelineBlock> blocks(pool);
+    SPSCRing<PipelineBlock *> free_ring(pool + 1);
+    std::deque<SPSCRing<PipelineBlock *>> to_worker, to_writer;
+    for (unsigned int w = 0; w < num_workers; w++) {
+        to_worker.emplace_back(pool + 1);
+        to_writer.emplace_back(pool + 1);
+    }
+    for (auto &b : blocks)
+        free_ring.TryPush(&b);
+    std::atomic<bool> failed{false};
+
+    std::thread reader([&]() {
+        for (size_t i = 0; ; i++) {
+            PipelineBlock *b;
+            if (!Pop(free_ring, b, failed))
+                return;
+            int got = read(*b);
+            if (got < 0)
+                failed = true;
+            if (got <= 0) {
+                // A null block tells every worker to stop
+                PipelineBlock *end = nullptr;
+                for (unsigned int w = 0; w < num_workers; w++)
+                    Push(to_worker[(i + w) % num_workers], end, failed);
+                return;
+            }
+            Push(to_worker[i % num_workers], b, failed);
+        }
+    });
+
+    std::vector<std::thread> workers;
+    for (unsigned int w = 0; w < num_workers; w++) {
+        workers.emplace_back([&, w]() {
+            PipelineBlock *b;
+            while (Pop(to_worker[w], b, failed)) {
+                if (b != nullptr && !code(*b))
+                    failed = true;
+                Push(to_writer[w], b, failed);
+                if (b == nullptr)
+                    return;
+            }
+        });
+    }
+
+    // The calling thread is the writer
+    for (size_t i = 0; ; i++) {
+        PipelineBlock *b;
+        if (!Pop(to_writer[i % num_workers], b, failed) || b == nullptr ||
+            failed)
+            break;
+        if (!write(*b)) {
+            failed = true;
+            break;
+        }
+        Push(free_ring, b, failed);
+    }
+
+    reader.join();
+    for (auto &worker : workers)
+        worker.join();
+    return !failed;
+}
+
+bool Pipeline::ReadAll(int fd, char *data, size_t n, off_t offset,
+                       size_t &got) {
+    got = 0;
+    while (got < n) {
+        ssize_t r = pread(fd, data + got, n - got, offset + got);
+        if (r < 0)
+            return false;
+        // End of file
+        if (r == 0)
+            break;
+        got += r;
+    }
+    return true;
+}
+
+bool Pipeline::WriteAll(int fd, const char *data, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, data, n);
+        if (w < 0)
+            return false;
+        data += w;
+        n -= w;
+    }
+    return true;
+}
+
+void Pipeline::Backoff(size_t spins) {
+    if (spins < 64)
+        std::this_thread::yield();
+    else
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+template <typename T>
+bool Pipeline::Push(SPSCRing<T> &ring, const T &item,
+                    const std::atomic<bool> &failed) {
+    for (size_t spins = 0; !ring.TryPush(item); spins++) {
+        if (failed)
+            return false;
+        Backoff(spins);
+    }
+    return true;
+}
+
+template <typename T>
+bool Pipeline::Pop(SPSCRing<T> &ring, T &item,
+                   const std::atomic<bool> &failed) {
+    for (size_t spins = 0; !ring.TryPop(item); spins++) {
+        if (failed)
+            return false;
+        Backoff(spins);
+    }
+    return true;
+}
+
+#endif  // PIPELINE_H_
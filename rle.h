@@ -0,0 +1,100 @@
+#ifndef RLE_H_
+#define RLE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "bstream.h"
+#include "huffman.h"
+
+// Run-length preprocessing: a run of 4 or more equal bytes is written as
+// 4 of them followed by a byte counting the extra repeats, so runs longer
+// than kMaxRun are split. Shorter runs are copied as they are.
+//
+// Block payload: size of the transformed data (32 bits), then the
+// transformed data as a Huffman block.
+class Rle {
+  public:
+    static constexpr size_t kMinRun = 4;
+    static constexpr size_t kMaxRun = kMinRun + 255;
+
+    static void Encode(const char *in, size_t n, std::vector<char> &out);
+    // Return false unless `in` expands to exactly `raw` bytes
+    static bool Decode(const char *in, size_t n, char *out, size_t raw);
+
+    static void EncodeBlock(const char *in, size_t n, std::vector<char> &out);
+    // `in` must be followed by BitReader::kPadding readable bytes
+    static DecodeStatus DecodeBlock(const char *in, size_t n,
+                                    char *out, size_t raw);
+};
+
+void Rle::Encode(const char *in, size_t n, std::vector<char> &out) {
+    for (size_t i = 0; i < n; ) {
+        char c = in[i];
+        size_t run = 1;
+        while (i + run < n && in[i + run] == c && run < kMaxRun)
+            run++;
+        out.insert(out.end(), std::min(run, kMinRun), c);
+        if (run >= kMinRun)
+            out.push_back(static_cast<char>(run - kMinRun));
+        i += run;
+    }
+}
+
+bool Rle::Decode(const char *in, size_t n, char *out, size_t raw) {
+    size_t pos = 0, run = 0;
+    char prev = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (pos == raw)
+            return false;
+        char c = in[i];
+        out[pos++] = c;
+        run = (run > 0 && c == prev) ? run + 1 : 1;
+        prev = c;
+        // A full run is always followed by its count
+        if (run == kMinRun) {
+            if (++i == n)
+                return false;
+            size_t extra = static_cast<unsigned char>(in[i]);
+            if (extra > raw - pos)
+                return false;
+            memset(out + pos, c, extra);
+            pos += extra;
+            run = 0;
+        }
+    }
+    return pos == raw;
+}
+
+void Rle::EncodeBlock(const char *in, size_t n, std::vector<char> &out) {
+    std::vector<char> transformed;
+    Encode(in, n, transformed);
+    BitWriter bw(out);
+    bw.PutBits(transformed.size(), 32);
+    bw.Close();
+    Huffman::EncodeBlock(transformed.data(), transformed.size(), out);
+}
+
+DecodeStatus Rle::DecodeBlock(const char *in, size_t n,
+                              char *out, size_t raw) {
+    if (n < 4)
+        return kDecodeTruncated;
+    BitReader br(in, n);
+    size_t size = br.GetBits(32);
+    // Every 4 bytes of output take at most 5 transformed bytes
+    if (size == 0 || size > raw + raw / kMinRun + 1)
+        return kDecodeCorrupt;
+
+    std::vector<char> transformed(size);
+    DecodeStatus status = Huffman::DecodeBlock(in + 4, n - 4,
+                                               transformed.data(), size);
+    if (status != kDecodeOk)
+        return status;
+    return Decode(transformed.data(), size, out, raw) ? kDecodeOk
+                                                      : kDecodeCorrupt;
+}
+
+#endif  // RLE_H_
@@ -0,0 +1,247 @@
+#ifndef TANS_H_
+#define TANS_H_
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "bstream.h"
+#include "huffman.h"
+
+// Table-based asymmetric numeral systems. Symbol probabilities are
+// approximated by counts out of 2^table_log instead of powers of two, so
+// skewed data costs less than one bit per symbol.
+//
+// Block payload, packed with BitWriter:
+//   table_log - kMinTableLog (4 bits), number of symbols - 1 (8 bits)
+//   for each symbol: value (8 bits), normalized count - 1 (table_log bits)
+//   initial decoder state (table_log bits)
+//   the bits of every symbol, in input order
+class Tans {
+  public:
+    static constexpr size_t kMinTableLog = 5;
+    static constexpr size_t kMaxTableLog = 12;
+    static constexpr size_t kDefaultTableLog = 11;
+
+    // Scale the frequencies of `n` symbols to counts summing to
+    // 2^table_log, every present symbol keeping at least 1. Return table_log
+    static size_t Normalize(const size_t freq[256], size_t n,
+                            uint16_t norm[256]);
+    // Coded size in bits, header included
+    static double EstimateBits(const size_t freq[256], const uint16_t norm[256],
+                               size_t table_log);
+
+    static void EncodeBlock(const char *in, size_t n, std::vector<char> &out);
+    static void EncodeBlock(const char *in, size_t n, const uint16_t norm[256],
+                            size_t table_log, std::vector<char> &out);
+    // `in` must be followed by BitReader::kPadding readable bytes
+    static DecodeStatus DecodeBlock(const char *in, size_t n,
+                                    char *out, size_t raw);
+
+  private:
+    struct DecodeEntry {
+        // Next state is base plus the next nbits bits
+        uint16_t base;
+        uint8_t sym;
+        uint8_t nbits;
+    };
+
+    // Deal the states out to the symbols, spread over the whole table
+    static void Spread(const uint16_t norm[256], size_t table_log,
+                       uint8_t *spread);
+    static size_t HighBit(size_t x);
+};
+
+size_t Tans::Normalize(const size_t freq[256], size_t n, uint16_t norm[256]) {
+    size_t symbols = 0, largest = 0;
+    for (int i = 0; i < 256; i++) {
+        symbols += freq[i] != 0;
+        if (freq[i] > freq[largest])
+            largest = i;
+    }
+    // Small blocks don't need a large table, but every symbol needs a state
+    size_t table_log = std::min(kDefaultTableLog,
+                                std::max(kMinTableLog, HighBit(n) + 1));
+    while ((size_t(1) << table_log) < symbols)
+        table_log++;
+    size_t size = size_t(1) << table_log;
+
+    size_t sum = 0;
+    for (int i = 0; i < 256; i++) {
+        norm[i] = 0;
+        if (freq[i] == 0)
+            continue;
+        norm[i] = std::max<size_t>(1, (freq[i] * size + n / 2) / n);
+        sum += norm[i];
+    }
+    // Settle the rounding error on the most frequent symbol, or on the
+    // largest counts if it can't take all of it
+    while (sum != size) {
+        size_t target = largest;
+        if (sum > size && norm[target] <= 1) {
+            for (int i = 0; i < 256; i++)
+                if (norm[i] > norm[target])
+                    target = i;
+        }
+        if (sum > size) {
+            size_t take = std::min<size_t>(sum - size, norm[target] - 1);
+            norm[target] -= take;
+            sum -= take;
+            // Spread what is left one by one over the other symbols
+            for (int i = 0; i < 256 && sum > size; i++) {
+                if (norm[i] > 1) {
+                    norm[i]--;
+                    sum--;
+                }
+            }
+        } else {
+            norm[target] += size - sum;
+            sum = size;
+        }
+    }
+    return table_log;
+}
+
+double Tans::EstimateBits(const size_t freq[256], const uint16_t norm[256],
+                          size_t table_log) {
+    double bits = 4 + 8 + table_log;
+    for (int i = 0; i < 256; i++) {
+        if (freq[i] == 0)
+            continue;
+        bits += 8 + table_log;
+        bits += freq[i] * (table_log - std::log2(norm[i]));
+    }
+    return bits;
+}
+
+void Tans::EncodeBlock(const char *in, size_t n, std::vector<char> &out) {
+    size_t freq[256] = {0};
+    for (size_t i = 0; i < n; i++)
+        freq[static_cast<unsigned char>(in[i])]++;
+    uint16_t norm[256];
+    size_t table_log = Normalize(freq, n, norm);
+    EncodeBlock(in, n, norm, table_log, out);
+}
+
+void Tans::EncodeBlock(const char *in, size_t n, const uint16_t norm[256],
+                       size_t table_log, std::vector<char> &out) {
+    size_t size = size_t(1) << table_log;
+    std::vector<uint8_t> spread(size);
+    Spread(norm, table_log, spread.data());
+
+    // For every symbol, the states reached from each x in [norm, 2 norm)
+    size_t start[256];
+    size_t total = 0;
+    for (int i = 0; i < 256; i++) {
+        start[i] = total;
+        total += norm[i];
+    }
+    std::vector<uint16_t> states(size);
+    uint16_t next[256];
+    memcpy(next, norm, sizeof(next));
+    for (size_t i = 0; i < size; i++) {
+        uint8_t sym = spread[i];
+        states[start[sym] + next[sym]++ - norm[sym]] = size + i;
+    }
+
+    // Encode backwards, so that the decoder reads the bits in input order
+    std::vector<uint32_t> emitted(n);
+    size_t state = size;
+    for (size_t i = n; i-- > 0; ) {
+        unsigned char c = in[i];
+        // Shift the state into [norm, 2 norm)
+        size_t nbits = HighBit(state) - HighBit(norm[c]);
+        if ((state >> nbits) < norm[c])
+            nbits--;
+        emitted[i] = ((state & ((size_t(1) << nbits) - 1)) << 4) | nbits;
+        state = states[start[c] + (state >> nbits) - norm[c]];
+    }
+
+    BitWriter bw(out);
+    size_t symbols = 0;
+    for (int i = 0; i < 256; i++)
+        symbols += norm[i] != 0;
+    bw.PutBits(table_log - kMinTableLog, 4);
+    bw.PutBits(symbols - 1, 8);
+    for (int i = 0; i < 256; i++) {
+        if (norm[i] == 0)
+            continue;
+        bw.PutBits(i, 8);
+        bw.PutBits(norm[i] - 1, table_log);
+    }
+    bw.PutBits(state - size, table_log);
+    for (size_t i = 0; i < n; i++)
+        bw.PutBits(emitted[i] >> 4, emitted[i] & 0xF);
+    bw.Close();
+}
+
+DecodeStatus Tans::DecodeBlock(const char *in, size_t n,
+                               char *out, size_t raw) {
+    BitReader br(in, n);
+    size_t table_log = br.GetBits(4) + kMinTableLog;
+    size_t symbols = br.GetBits(8) + 1;
+    if (table_log > kMaxTableLog)
+        return kDecodeCorrupt;
+    size_t size = size_t(1) << table_log;
+
+    // The header is small, check it as it is read
+    uint16_t norm[256] = {0};
+    size_t sum = 0;
+    for (size_t i = 0; i < symbols; i++) {
+        uint8_t sym = br.GetBits(8);
+        if (norm[sym] != 0)
+            return kDecodeCorrupt;
+        norm[sym] = br.GetBits(table_log) + 1;
+        sum += norm[sym];
+    }
+    if (br.Overrun())
+        return kDecodeTruncated;
+    if (sum != size)
+        return kDecodeCorrupt;
+
+    std::vector<uint8_t> spread(size);
+    Spread(norm, table_log, spread.data());
+    std::vector<DecodeEntry> table(size);
+    uint16_t next[256];
+    memcpy(next, norm, sizeof(next));
+    for (size_t i = 0; i < size; i++) {
+        uint8_t sym = spread[i];
+        size_t x = next[sym]++;
+        uint8_t nbits = table_log - HighBit(x);
+        table[i] = {static_cast<uint16_t>((x << nbits) - size), sym, nbits};
+    }
+
+    // The position is only validated once the whole block is decoded
+    size_t state = br.GetBits(table_log);
+    for (size_t i = 0; i < raw; i++) {
+        DecodeEntry e = table[state];
+        out[i] = e.sym;
+        uint64_t bits = br.PeekBits(kMaxTableLog);
+        state = e.base + (bits >> (kMaxTableLog - e.nbits));
+        br.SkipBits(e.nbits);
+    }
+    return br.Overrun() ? kDecodeTruncated : kDecodeOk;
+}
+
+void Tans::Spread(const uint16_t norm[256], size_t table_log,
+                  uint8_t *spread) {
+    size_t size = size_t(1) << table_log;
+    size_t mask = size - 1;
+    // Odd step, so every position is visited once
+    size_t step = (size >> 1) + (size >> 3) + 3;
+    size_t pos = 0;
+    for (int i = 0; i < 256; i++) {
+        for (size_t j = 0; j < norm[i]; j++) {
+            spread[pos] = i;
+            pos = (pos + step) & mask;
+        }
+    }
+}
+
+size_t Tans::HighBit(size_t x) {
+    return 63 - __builtin_clzll(x | 1);
+}
+
+#endif  // TANS_H_
@@ -0,0 +1,154 @@
+#include <gtest/gtest.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "batch.h"
+
+// Compress `messages` in one batch, then decode every output on its own
+static void RoundTrip(const std::vector<std::string> &messages,
+                      bool share_table, std::vector<char> &arena,
+                      std::vector<size_t> &offsets) {
+    std::vector<const char *> inputs;
+    std::vector<size_t> sizes;
+    for (auto &message : messages) {
+        inputs.push_back(message.data());
+        sizes.push_back(message.size());
+    }
+    Batch batch;
+    ASSERT_TRUE(batch.Compress(inputs.data(), sizes.data(), messages.size(),
+                               share_table, arena, offsets));
+    ASSERT_EQ(offsets.size(), messages.size() + 1);
+    EXPECT_EQ(arena.size(), offsets.back() + BitReader::kPadding);
+
+    Batch decoder;
+    if (offsets[0] > 0) {
+        EXPECT_TRUE(decoder.SetTable(arena.data(), offsets[0]));
+    }
+    std::vector<char> output;
+    for (size_t i = 0; i < messages.size(); i++) {
+        EXPECT_EQ(decoder.Decompress(&arena[offsets[i]],
+                                     offsets[i + 1] - offsets[i], output),
+                  kDecodeOk);
+        EXPECT_EQ(std::string(output.begin(), output.end()), messages[i]);
+    }
+}
+
+TEST(Batch, RoundTrip) {
+    std::mt19937 gen(8);
+    std::vector<std::string> messages;
+    for (int i = 0; i < 300; i++) {
+        std::string message;
+        size_t size = 100 + gen() % 1948;
+        for (size_t j = 0; j < size; j++)
+            message += "{\"id\": 12, \"name\": \"zap\"}"[gen() % 26];
+        messages.push_back(message);
+    }
+    std::string uniform;
+    for (int i = 0; i < 500; i++)
+        uniform += static_cast<char>(gen());
+    for (std::string odd : {std::string(), std::string("a"),
+                            std::string(1000, 'b'), uniform})
+        messages.push_back(odd);
+
+    std::vector<char> own, shared;
+    std::vector<size_t> offsets;
+    RoundTrip(messages, false, own, offsets);
+    EXPECT_EQ(offsets[0], 0u);
+    RoundTrip(messages, true, shared, offsets);
+    EXPECT_GT(offsets[0], 0u);
+    // Small similar messages don't pay for a table each
+    EXPECT_LT(shared.size(), own.size());
+}
+
+TEST(Batch, SharedTableOnlyWhenClose) {
+    std::vector<std::string> messages(50, std::string(400, 'x'));
+    for (auto &message : messages)
+        for (size_t i = 0; i < message.size(); i++)
+            message[i] = "abcd"[i % 4];
+    // Unlike the others, with symbols the shared table hardly knows
+    std::string different;
+    for (int i = 0; i < 2000; i++)
+        different += static_cast<char>('e' + i % 20);
+    messages.push_back(different);
+
+    std::vector<const char *> inputs;
+    std::vector<size_t> sizes;
+    for (auto &message : messages) {
+        inputs.push_back(message.data());
+        sizes.push_back(message.size());
+    }
+    Batch batch;
+    std::vector<char> arena;
+    std::vector<size_t> offsets;
+    ASSERT_TRUE(batch.Compress(inputs.data(), sizes.data(), messages.size(),
+                               true, arena, offsets));
+    // Kind in the low bits of the first varint byte
+    EXPECT_EQ(arena[offsets[0]] & 3, Batch::kSharedTable);
+    EXPECT_EQ(arena[offsets[50]] & 3, Batch::kOwnTable);
+}
+
+TEST(Batch, TableChange) {
+    // Enough short messages for multi-symbol entries, then a batch of
+    // other symbols with a table of its own
+    std::mt19937 gen(3);
+    std::vector<std::string> first(100), second(5);
+    for (auto &message : first)
+        for (int j = 0; j < 400; j++)
+            message += "aab"[gen() % 3];
+    for (auto &message : second)
+        for (int j = 0; j < 400; j++)
+            message += "xyz"[gen() % 3];
+    std::vector<char> arenas[2];
+    std::vector<size_t> offsets[2];
+    RoundTrip(first, true, arenas[0], offsets[0]);
+    RoundTrip(second, true, arenas[1], offsets[1]);
+
+    Batch decoder;
+    std::vector<char> output;
+    for (int b = 0; b < 2; b++) {
+        const std::vector<std::string> &messages = b == 0 ? first : second;
+        ASSERT_GT(offsets[b][0], 0u);
+        EXPECT_TRUE(decoder.SetTable(arenas[b].data(), offsets[b][0]));
+        for (size_t i = 0; i < messages.size(); i++) {
+            EXPECT_EQ(decoder.Decompress(&arenas[b][offsets[b][i]],
+                                         offsets[b][i + 1] - offsets[b][i],
+                                         output),
+                      kDecodeOk);
+            EXPECT_EQ(std::string(output.begin(), output.end()),
+                      messages[i]);
+        }
+    }
+}
+
+TEST(Batch, Errors) {
+    std::string message(300, 'a');
+    for (size_t i = 0; i < message.size(); i += 2)
+        message[i] = "bcde"[i % 4];
+    const char *input = message.data();
+    size_t size = message.size();
+    Batch batch;
+    std::vector<char> arena, output;
+    std::vector<size_t> offsets;
+    ASSERT_TRUE(batch.Compress(&input, &size, 1, true, arena, offsets));
+
+    // Shared table missing, then cut short
+    Batch decoder;
+    size_t n = offsets[1] - offsets[0];
+    EXPECT_EQ(decoder.Decompress(&arena[offsets[0]], n, output), kDecodeCorrupt);
+    EXPECT_TRUE(decoder.SetTable(arena.data(), offsets[0]));
+    EXPECT_EQ(decoder.Decompress(&arena[offsets[0]], n - 2, output),
+              kDecodeTruncated);
+    EXPECT_EQ(decoder.Decompress(&arena[offsets[0]], 1, output),
+              kDecodeTruncated);
+    EXPECT_FALSE(decoder.SetTable(arena.data(), offsets[0] - 1));
+
+    size = Batch::kMaxMessage + 1;
+    EXPECT_FALSE(batch.Compress(&input, &size, 1, false, arena, offsets));
+}
+
+int main(int argc, char *argv[]) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -261,6 +261,43 @@ TEST(BStream, ExeptionThrow) {
     EXPECT_THROW(bis.GetBit(), std::exception);
 }
 
+TEST(BStream, MemoryBitsInputAndOutput) {
+    std::vector<char> data;
+    BitWriter bw(data);
+    bw.PutBit(1);
+    bw.PutBits(0x2F, 7);
+    bw.PutBits(0x12345, 20);
+    bw.PutBit(0);
+    bw.PutBits(0x5, 3);
+    bw.Close();
+    ASSERT_EQ(data.size(), 4);
+
+    // The reader needs readable slack after the data
+    size_t size = data.size();
+    data.resize(size + BitReader::kPadding, 0);
+    BitReader br(data.data(), size);
+    EXPECT_EQ(br.GetBit(), 1);
+    EXPECT_EQ(br.PeekBits(7), 0x2F);
+    EXPECT_EQ(br.GetBits(7), 0x2F);
+    EXPECT_EQ(br.GetBits(20), 0x12345);
+    EXPECT_EQ(br.GetBit(), 0);
+    EXPECT_EQ(br.GetBits(3), 0x5);
+    EXPECT_EQ(br.Position(), 32);
+    EXPECT_FALSE(br.Overrun());
+}
+
+TEST(BStream, MemoryBitsOverrun) {
+    const char val[1 + BitReader::kPadding] = {'\x81'};
+    BitReader br(val, 1);
+
+    EXPECT_EQ(br.GetBits(8), 0x81);
+    EXPECT_FALSE(br.Overrun());
+    // Reading past the end doesn't throw, it is reported afterwards
+    br.GetBits(56);
+    br.GetBits(56);
+    EXPECT_TRUE(br.Overrun());
+}
+
 int main(int argc, char *argv[]) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
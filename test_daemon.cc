@@ -0,0 +1,209 @@
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "daemon.h"
+
+static const char kSocket[] = "test_daemon.sock";
+
+TEST(ZapServer, Serve) {
+    std::string text("a daemon answers every complete request");
+    std::vector<char> requests;
+    requests.push_back(kDaemonCompress);
+    BlockCodec::PutU32(requests, text.size());
+    requests.insert(requests.end(), text.begin(), text.end());
+    // An unknown op and the start of another request
+    requests.push_back(7);
+    BlockCodec::PutU32(requests, 0);
+    requests.push_back(kDaemonCompress);
+    BlockCodec::PutU32(requests, 100);
+    size_t n = requests.size();
+    requests.resize(n + BitReader::kPadding, 0);
+
+    size_t used;
+    std::vector<char> responses;
+    EXPECT_TRUE(ZapServer::Serve(requests.data(), n, used, responses));
+    EXPECT_EQ(used, n - ZapServer::kFrameHeaderSize);
+    EXPECT_EQ(responses[0], kDecodeOk);
+    size_t size = BlockCodec::GetU32(&responses[1]);
+    std::vector<char> zapped(responses.begin() + ZapServer::kFrameHeaderSize,
+                             responses.begin() + ZapServer::kFrameHeaderSize + size);
+    zapped.resize(size + BitReader::kPadding, 0);
+    std::vector<char> output;
+    EXPECT_EQ(BlockCodec::DecodeStream(zapped.data(), size, output), kDecodeOk);
+    EXPECT_EQ(std::string(output.begin(), output.end()), text);
+
+    size_t pos = ZapServer::kFrameHeaderSize + size;
+    EXPECT_EQ(responses[pos], kDecodeCorrupt);
+    EXPECT_EQ(BlockCodec::GetU32(&responses[pos + 1]), 0u);
+    EXPECT_EQ(responses.size(), pos + ZapServer::kFrameHeaderSize);
+
+    // Too large to be served at all
+    std::vector<char> huge;
+    huge.push_back(kDaemonCompress);
+    BlockCodec::PutU32(huge, ZapServer::kMaxRequest + 1);
+    huge.resize(huge.size() + BitReader::kPadding, 0);
+    EXPECT_FALSE(ZapServer::Serve(huge.data(), ZapServer::kFrameHeaderSize,
+                                  used, responses));
+}
+
+TEST(ZapServer, Expansion) {
+    // A few bytes per megabyte block, repeated past the response limit
+    std::string run(BlockCodec::kMaxBlockSize, 'z');
+    std::vector<char> frame;
+    BlockCodec::Encode(run.data(), run.size(), frame);
+    ASSERT_LT(frame.size(), 100u);
+    std::vector<char> bomb(BlockCodec::kMagic,
+                           BlockCodec::kMagic + sizeof(BlockCodec::kMagic));
+    size_t blocks = ZapServer::kMaxResponse / run.size() + 1;
+    for (size_t i = 0; i < blocks; i++)
+        bomb.insert(bomb.end(), frame.begin(), frame.end());
+    bomb.push_back(static_cast<char>(kBlockEnd));
+
+    std::vector<char> request;
+    request.push_back(kDaemonDecompress);
+    BlockCodec::PutU32(request, bomb.size());
+    request.insert(request.end(), bomb.begin(), bomb.end());
+    size_t n = request.size();
+    request.resize(n + BitReader::kPadding, 0);
+    size_t used;
+    std::vector<char> responses;
+    EXPECT_TRUE(ZapServer::Serve(request.data(), n, used, responses));
+    EXPECT_EQ(used, n);
+    ASSERT_EQ(responses.size(), ZapServer::kFrameHeaderSize);
+    EXPECT_EQ(responses[0], kDecodeCorrupt);
+
+    // Up to the limit a stream still decodes
+    std::string runs(3 * BlockCodec::kMaxBlockSize, 'z');
+    std::vector<char> zapped, output;
+    BlockCodec::EncodeStream(runs.data(), runs.size(), zapped,
+                             BlockCodec::kMaxBlockSize);
+    n = zapped.size();
+    zapped.resize(n + BitReader::kPadding, 0);
+    EXPECT_EQ(BlockCodec::DecodeStream(zapped.data(), n, output, runs.size()),
+              kDecodeOk);
+    EXPECT_EQ(output.size(), runs.size());
+    output.clear();
+    EXPECT_EQ(BlockCodec::DecodeStream(zapped.data(), n, output,
+                                       runs.size() - 1),
+              kDecodeCorrupt);
+}
+
+TEST(ZapServer, RoundTrip) {
+    ZapServer server(kSocket, 2);
+    ASSERT_TRUE(server.Start());
+    ZapClient client;
+    ASSERT_TRUE(client.Connect(kSocket));
+
+    std::mt19937 gen(3);
+    std::string input;
+    for (int i = 0; i < 300000; i++)
+        input += "zap daemon"[gen() % 10];
+    uint8_t status;
+    std::vector<char> zapped, output;
+    ASSERT_TRUE(client.Call(kDaemonCompress, input.data(), input.size(),
+                            status, zapped));
+    EXPECT_EQ(status, kDecodeOk);
+    EXPECT_LT(zapped.size(), input.size() / 2);
+    ASSERT_TRUE(client.Call(kDaemonDecompress, zapped.data(), zapped.size(),
+                            status, output));
+    EXPECT_EQ(status, kDecodeOk);
+    EXPECT_EQ(std::string(output.begin(), output.end()), input);
+
+    // Errors come back as statuses and the connection stays usable
+    zapped.pop_back();
+    ASSERT_TRUE(client.Call(kDaemonDecompress, zapped.data(), zapped.size(),
+                            status, output));
+    EXPECT_EQ(status, kDecodeTruncated);
+    EXPECT_TRUE(output.empty());
+    ASSERT_TRUE(client.Call(kDaemonCompress, "", 0, status, zapped));
+    EXPECT_EQ(status, kDecodeOk);
+    EXPECT_EQ(zapped.size(), sizeof(BlockCodec::kMagic) + BlockCodec::kEndSize);
+}
+
+TEST(ZapServer, ConcurrentBatches) {
+    ZapServer server(kSocket, 3);
+    ASSERT_TRUE(server.Start());
+
+    // Many clients, each pipelining many small requests
+    std::vector<std::thread> threads;
+    std::vector<int> failures(8, 0);
+    for (int t = 0; t < 8; t++) {
+        threads.emplace_back([t, &failures]() {
+            ZapClient client;
+            if (!client.Connect(kSocket)) {
+                failures[t]++;
+                return;
+            }
+            std::vector<std::string> inputs;
+            for (int i = 0; i < 200; i++)
+                inputs.push_back("message " + std::to_string(t) + " " +
+                                 std::string(i * 13 % 500, 'a' + i % 26));
+            std::vector<uint8_t> statuses;
+            std::vector<std::string> zapped, outputs;
+            if (!client.CallMany(kDaemonCompress, inputs, statuses, zapped) ||
+                !client.CallMany(kDaemonDecompress, zapped, statuses, outputs) ||
+                outputs != inputs) {
+                failures[t]++;
+                return;
+            }
+            for (uint8_t status : statuses)
+                failures[t] += status != kDecodeOk;
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    for (int t = 0; t < 8; t++)
+        EXPECT_EQ(failures[t], 0) << "client " << t;
+}
+
+TEST(ZapServer, SocketPath) {
+    // A socket left behind is replaced
+    {
+        ZapServer server(kSocket, 1);
+        ASSERT_TRUE(server.Start());
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, kSocket, sizeof(kSocket));
+    ASSERT_EQ(bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)), 0);
+    close(fd);
+    {
+        ZapServer server(kSocket, 1);
+        EXPECT_TRUE(server.Start());
+    }
+
+    // Any other file is left alone
+    const char notes[] = "test_daemon_notes.txt";
+    {
+        std::ofstream ofs(notes);
+        ofs << "notes";
+    }
+    ZapServer server(notes, 1);
+    EXPECT_FALSE(server.Start());
+    std::ifstream ifs(notes);
+    std::string kept;
+    ifs >> kept;
+    EXPECT_EQ(kept, "notes");
+    std::remove(notes);
+}
+
+TEST(ZapClient, NoDaemon) {
+    ZapClient client;
+    EXPECT_FALSE(client.Connect("test_daemon_missing.sock"));
+    uint8_t status;
+    std::vector<char> out;
+    EXPECT_FALSE(client.Call(kDaemonCompress, "a", 1, status, out));
+}
+
+int main(int argc, char *argv[]) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,80 @@
+#include <gtest/gtest.h>
+
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "dedup.h"
+
+// Offsets of the content-defined cuts of `data`
+static std::vector<size_t> Cuts(const std::string &data, size_t max_size) {
+    std::vector<size_t> cuts;
+    for (size_t pos = 0; pos < data.size(); ) {
+        pos += DedupIndex::Cut(&data[pos], data.size() - pos, max_size);
+        cuts.push_back(pos);
+    }
+    return cuts;
+}
+
+TEST(DedupIndex, Fingerprint) {
+    std::string a(1000, 'a'), b(a);
+    EXPECT_EQ(DedupIndex::Fingerprint(a.data(), a.size()),
+              DedupIndex::Fingerprint(b.data(), b.size()));
+    b[999] = 'b';
+    EXPECT_NE(DedupIndex::Fingerprint(a.data(), a.size()),
+              DedupIndex::Fingerprint(b.data(), b.size()));
+    // Trailing zeros are not padding
+    std::string zero("a\0", 2);
+    EXPECT_NE(DedupIndex::Fingerprint(zero.data(), 1),
+              DedupIndex::Fingerprint(zero.data(), 2));
+    EXPECT_NE(DedupIndex::Fingerprint(a.data(), 16),
+              DedupIndex::Fingerprint(a.data(), 17));
+}
+
+TEST(DedupIndex, Cut) {
+    std::mt19937 gen(11);
+    std::string data;
+    for (int i = 0; i < 1 << 20; i++)
+        data += static_cast<char>(gen());
+    size_t max_size = 1 << 16;
+
+    std::vector<size_t> cuts = Cuts(data, max_size);
+    for (size_t i = 0; i + 1 < cuts.size(); i++) {
+        size_t size = cuts[i] - (i > 0 ? cuts[i - 1] : 0);
+        EXPECT_GE(size, max_size / 8);
+        EXPECT_LE(size, max_size);
+    }
+    // About every max_size / 8 + max_size / 4 bytes
+    EXPECT_GT(cuts.size(), data.size() / max_size);
+    EXPECT_LT(cuts.size(), data.size() / (max_size / 8));
+
+    // An insertion only moves the cuts around it
+    std::string shifted = "inserted" + data;
+    std::set<size_t> moved;
+    for (size_t cut : Cuts(shifted, max_size))
+        moved.insert(cut - 8);
+    size_t kept = 0;
+    for (size_t cut : cuts)
+        kept += moved.count(cut);
+    EXPECT_GE(kept + 2, cuts.size());
+}
+
+TEST(DedupIndex, FindOrInsert) {
+    DedupIndex index;
+    uint64_t offset = 100;
+    EXPECT_FALSE(index.FindOrInsert(42, 10, offset));
+    offset = 200;
+    EXPECT_TRUE(index.FindOrInsert(42, 10, offset));
+    EXPECT_EQ(offset, 100u);
+    // Same fingerprint, other size: not a duplicate
+    offset = 300;
+    EXPECT_FALSE(index.FindOrInsert(42, 11, offset));
+    EXPECT_EQ(index.Entries(), 1u);
+    EXPECT_GT(index.MemoryBytes(), 0u);
+}
+
+int main(int argc, char *argv[]) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,324 @@
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+
+#include "huffman.h"
+
+// Read a whole file into a string
+static std::string ReadFile(const std::string &filename) {
+    std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    return ss.str();
+}
+
+static void WriteFile(const std::string &filename, const std::string &data) {
+    std::ofstream ofs(filename, std::ios::out |
+                                std::ios::trunc |
+                                std::ios::binary);
+    ofs.write(data.data(), data.size());
+}
+
+// Compress `input` sequentially and with `num_threads` threads
+static void CompressBoth(const std::string &input, unsigned int num_threads,
+                         std::string &sequential, std::string &parallel) {
+    WriteFile("test_huffman_input", input);
+    {
+        std::ifstream ifs("test_huffman_input", std::ios::in | std::ios::binary);
+        std::ofstream ofs("test_huffman_seq", std::ios::out |
+                                              std::ios::trunc |
+                                              std::ios::binary);
+        Huffman::Compress(ifs, ofs);
+    }
+    {
+        std::ifstream ifs("test_huffman_input", std::ios::in | std::ios::binary);
+        std::ofstream ofs("test_huffman_par", std::ios::out |
+                                              std::ios::trunc |
+                                              std::ios::binary);
+        Huffman::CompressParallel(ifs, ofs, num_threads);
+    }
+    sequential = ReadFile("test_huffman_seq");
+    parallel = ReadFile("test_huffman_par");
+    std::remove("test_huffman_input");
+    std::remove("test_huffman_seq");
+    std::remove("test_huffman_par");
+}
+
+TEST(Huffman, ParallelMatchesSequential) {
+    std::string text = ReadFile("frederick_douglass.txt");
+    ASSERT_FALSE(text.empty());
+
+    for (unsigned int threads : {1, 2, 3, 4, 7, 16}) {
+        std::string sequential, parallel;
+        CompressBoth(text, threads, sequential, parallel);
+        EXPECT_EQ(sequential, parallel) << threads << " threads";
+    }
+}
+
+TEST(Huffman, ParallelSmallInputs) {
+    for (std::string input : {"", "a", "aaaa", "ab", "abracadabra",
+                              "the quick brown fox jumps over the lazy dog"}) {
+        for (unsigned int threads : {1, 2, 5, 64}) {
+            std::string sequential, parallel;
+            CompressBoth(input, threads, sequential, parallel);
+            EXPECT_EQ(sequential, parallel) << input << ", "
+                                            << threads << " threads";
+        }
+    }
+}
+
+// Decode a block from a copy followed by the padding the decoder needs
+static DecodeStatus DecodeBlock(const std::vector<char> &coded, size_t n,
+                                std::string &out) {
+    std::vector<char> padded(coded.begin(), coded.begin() + n);
+    padded.resize(n + BitReader::kPadding, 0);
+    return Huffman::DecodeBlock(padded.data(), n, &out[0], out.size());
+}
+
+TEST(Huffman, BlockRoundTrip) {
+    std::string text = ReadFile("frederick_douglass.txt").substr(0, 50000);
+    std::string bytes;
+    for (int i = 0; i < 256; i++)
+        bytes += std::string(i + 1, static_cast<char>(i));
+    // Fibonacci frequencies give codes longer than the lookup bits
+    std::string skewed;
+    size_t a = 1, b = 1;
+    for (int i = 0; i < 20; i++) {
+        skewed += std::string(a, static_cast<char>('A' + i));
+        b += a;
+        std::swap(a, b);
+    }
+
+    for (std::string input : {text, bytes, skewed, std::string("a"),
+                              std::string(1000, '\xff'), std::string("ab")}) {
+        std::vector<char> coded;
+        Huffman::EncodeBlock(input.data(), input.size(), coded);
+        std::string decoded(input.size(), '\0');
+        EXPECT_EQ(DecodeBlock(coded, coded.size(), decoded), kDecodeOk);
+        EXPECT_EQ(decoded, input);
+    }
+}
+
+TEST(Huffman, BlockErrors) {
+    std::vector<char> coded;
+    std::string input("abracadabra");
+    Huffman::EncodeBlock(input.data(), input.size(), coded);
+    std::string out(input.size(), '\0');
+
+    // Missing payload bits
+    EXPECT_EQ(DecodeBlock(coded, coded.size() - 2, out), kDecodeTruncated);
+    // Truncated code table
+    EXPECT_EQ(DecodeBlock(coded, 3, out), kDecodeTruncated);
+    // Lengths that don't form a complete code
+    std::vector<char> incomplete = coded;
+    incomplete[2] = 7;
+    EXPECT_EQ(DecodeBlock(incomplete, incomplete.size(), out), kDecodeCorrupt);
+}
+
+TEST(Huffman, BuildLengths) {
+    std::mt19937_64 gen(12);
+    for (int t = 0; t < 2000; t++) {
+        // Flat, spread out and power of two frequencies
+        size_t freq[256] = {0};
+        int symbols = 1 + gen() % 256;
+        for (int i = 0; i < symbols; i++) {
+            size_t f = t % 3 == 0 ? 1 + gen() % 5
+                     : t % 3 == 1 ? 1 + gen() % 1000000
+                                  : size_t(1) << (gen() % 20);
+            freq[gen() % 256] = f;
+        }
+        uint8_t lens[256], heap_lens[256];
+        Huffman::BuildLengths(freq, lens);
+        Huffman::BuildLengthsHeap(freq, heap_lens);
+
+        // As short as the tree from the heap, and a complete code
+        size_t bits = 0, heap_bits = 0, present = 0;
+        double kraft = 0;
+        for (int i = 0; i < 256; i++) {
+            bits += freq[i] * lens[i];
+            heap_bits += freq[i] * heap_lens[i];
+            present += freq[i] != 0;
+            if (freq[i] != 0)
+                kraft += std::ldexp(1.0, -lens[i]);
+            else
+                EXPECT_EQ(lens[i], 0);
+        }
+        EXPECT_EQ(bits, heap_bits);
+        if (present > 1) {
+            EXPECT_EQ(kraft, 1.0);
+        }
+    }
+
+    size_t freq[256] = {0};
+    uint8_t lens[256];
+    Huffman::BuildLengths(freq, lens);
+    EXPECT_EQ(lens['a'], 0);
+    // A single symbol has an empty code
+    freq['a'] = 7;
+    Huffman::BuildLengths(freq, lens);
+    EXPECT_EQ(lens['a'], 0);
+    freq['b'] = 1;
+    Huffman::BuildLengths(freq, lens);
+    EXPECT_EQ(lens['a'], 1);
+    EXPECT_EQ(lens['b'], 1);
+    // Fibonacci frequencies make the deepest tree
+    size_t fib[256] = {1, 1};
+    for (int i = 2; i < 30; i++)
+        fib[i] = fib[i - 1] + fib[i - 2];
+    Huffman::BuildLengths(fib, lens);
+    EXPECT_EQ(lens[0], 29);
+    EXPECT_EQ(lens[29], 1);
+}
+
+TEST(Huffman, DecodeMany) {
+    std::mt19937 gen(8);
+    // Short codes as in text, a code of one bit for almost everything,
+    // codes up to the longest length, and codes too long for several a
+    // lookup
+    std::vector<size_t> text(256, 0), skewed(256, 0), long_codes(256, 0);
+    std::vector<size_t> uniform(256, 1);
+    std::string sample = ReadFile("frederick_douglass.txt");
+    for (char c : sample)
+        text[static_cast<unsigned char>(c)]++;
+    skewed['a'] = 100000;
+    skewed['b'] = skewed['c'] = 1;
+    for (int i = 0; i < 30; i++)
+        long_codes[i] = size_t(1) << i;
+    for (auto *freq : {&text, &skewed, &long_codes, &uniform}) {
+        uint8_t lens[256];
+        Huffman::BuildLengths(freq->data(), lens);
+        std::string symbols;
+        for (int i = 0; i < 256; i++)
+            if (lens[i])
+                symbols += static_cast<char>(i);
+
+        for (size_t n : {0, 1, 3, 4, 5, 1000, 100003}) {
+            // The common symbols mostly, all of them now and then
+            std::string input(n, '\0');
+            for (auto &c : input)
+                c = gen() % 4 ? symbols[gen() % std::min<size_t>(4, symbols.size())]
+                              : symbols[gen() % symbols.size()];
+            std::vector<char> coded;
+            Huffman::EncodeCodes(input.data(), n, lens, coded);
+            coded.resize(coded.size() + BitReader::kPadding, 0);
+
+            DecodeTable table;
+            ASSERT_TRUE(table.Build(lens));
+            bool built = table.BuildMulti();
+            EXPECT_EQ(built, freq != &uniform);
+            std::string output(n, '\0');
+            BitReader br(coded.data(), coded.size() - BitReader::kPadding);
+            table.DecodeMany(br, &output[0], n);
+            EXPECT_FALSE(br.Overrun());
+            EXPECT_TRUE(output == input) << n;
+        }
+    }
+}
+
+TEST(Huffman, DecompressLegacy) {
+    std::string text = ReadFile("frederick_douglass.txt");
+    for (std::string input : {text, std::string("z"), std::string(300, 'z'),
+                              std::string("xy"), std::string("")}) {
+        std::string sequential, parallel;
+        CompressBoth(input, 2, sequential, parallel);
+        WriteFile("test_huffman_zap", sequential);
+        {
+            std::ifstream ifs("test_huffman_zap", std::ios::in | std::ios::binary);
+            std::ofstream ofs("test_huffman_out", std::ios::out |
+                                                  std::ios::trunc |
+                                                  std::ios::binary);
+            EXPECT_EQ(Huffman::Decompress(ifs, ofs), kDecodeOk);
+        }
+        EXPECT_EQ(ReadFile("test_huffman_out"), input);
+    }
+
+    // Cut the stream in the middle of the payload
+    std::string sequential, parallel;
+    CompressBoth(text, 1, sequential, parallel);
+    WriteFile("test_huffman_zap", sequential.substr(0, sequential.size() / 2));
+    {
+        std::ifstream ifs("test_huffman_zap", std::ios::in | std::ios::binary);
+        std::ofstream ofs("test_huffman_out", std::ios::out |
+                                              std::ios::trunc |
+                                              std::ios::binary);
+        EXPECT_EQ(Huffman::Decompress(ifs, ofs), kDecodeTruncated);
+    }
+    // And in the middle of the tree
+    WriteFile("test_huffman_zap", sequential.substr(0, 3));
+    {
+        std::ifstream ifs("test_huffman_zap", std::ios::in | std::ios::binary);
+        std::ofstream ofs("test_huffman_out", std::ios::out |
+                                              std::ios::trunc |
+                                              std::ios::binary);
+        EXPECT_EQ(Huffman::Decompress(ifs, ofs), kDecodeCorrupt);
+    }
+    std::remove("test_huffman_zap");
+    std::remove("test_huffman_out");
+}
+
+// Decompress a single-stream file sequentially, or with `num_threads`
+static DecodeStatus DecompressWith(const std::string &zap,
+                                   unsigned int num_threads,
+                                   std::string &output) {
+    WriteFile("test_huffman_zap", zap);
+    DecodeStatus status;
+    {
+        std::ifstream ifs("test_huffman_zap", std::ios::in | std::ios::binary);
+        std::ofstream ofs("test_huffman_out", std::ios::out |
+                                              std::ios::trunc |
+                                              std::ios::binary);
+        status = num_threads == 0
+                 ? Huffman::Decompress(ifs, ofs)
+                 : Huffman::DecompressParallel(ifs, ofs, num_threads);
+    }
+    output = ReadFile("test_huffman_out");
+    std::remove("test_huffman_zap");
+    std::remove("test_huffman_out");
+    return status;
+}
+
+TEST(Huffman, DecompressParallel) {
+    std::string text = ReadFile("frederick_douglass.txt");
+    // Geometric chars, whose rare ones have codes past the lookup
+    std::mt19937 gen(5);
+    std::geometric_distribution<int> geometric(0.35);
+    std::string skewed(1 << 20, 0);
+    for (char &c : skewed)
+        c = std::min(geometric(gen), 127);
+    std::string repeated;
+    for (int i = 0; i < 8; i++)
+        repeated += text;
+
+    for (std::string input : {text, skewed, repeated, std::string("z"),
+                              std::string(300, 'z'), std::string("xy"),
+                              std::string("")}) {
+        std::string sequential, parallel;
+        CompressBoth(input, 1, sequential, parallel);
+        for (unsigned int threads : {1, 2, 3, 8, 64}) {
+            std::string output;
+            EXPECT_EQ(DecompressWith(sequential, threads, output), kDecodeOk);
+            EXPECT_TRUE(output == input) << threads << " threads";
+        }
+    }
+
+    // Truncated anywhere, the status is the sequential one
+    std::string sequential, parallel;
+    CompressBoth(repeated, 1, sequential, parallel);
+    for (size_t cut : {size_t(3), size_t(40), sequential.size() / 3,
+                       sequential.size() - 1}) {
+        std::string zap = sequential.substr(0, cut), expected, output;
+        DecodeStatus status = DecompressWith(zap, 0, expected);
+        EXPECT_NE(status, kDecodeOk);
+        EXPECT_EQ(DecompressWith(zap, 4, output), status) << cut;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,223 @@
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+
+#include "inflate.h"
+
+static std::string ReadFile(const std::string &filename) {
+    std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    return ss.str();
+}
+
+static void WriteFile(const std::string &filename, const std::string &data) {
+    std::ofstream ofs(filename, std::ios::out |
+                                std::ios::trunc |
+                                std::ios::binary);
+    ofs.write(data.data(), data.size());
+}
+
+// A single-stream file of `input`
+static std::string Zap(const std::string &input) {
+    WriteFile("test_inflate_input", input);
+    {
+        std::ifstream ifs("test_inflate_input", std::ios::in | std::ios::binary);
+        std::ofstream ofs("test_inflate_zap", std::ios::out |
+                                              std::ios::trunc |
+                                              std::ios::binary);
+        Huffman::Compress(ifs, ofs);
+    }
+    std::string zapped = ReadFile("test_inflate_zap");
+    std::remove("test_inflate_input");
+    std::remove("test_inflate_zap");
+    return zapped;
+}
+
+// Feed `zapped` to an Inflater in random chunks of at most `max_in` bytes,
+// with room for at most `max_out` bytes at a time
+static DecodeStatus Inflate(const std::string &zapped, size_t max_in,
+                            size_t max_out, std::string &output) {
+    std::mt19937 gen(max_in * 31 + max_out);
+    Inflater inflater;
+    std::vector<char> out(max_out);
+    size_t pos = 0;
+    output.clear();
+    for (;;) {
+        size_t n = std::min<size_t>(zapped.size() - pos, 1 + gen() % max_in);
+        size_t avail = 1 + gen() % max_out;
+        size_t in_used, out_used;
+        InflateStatus status = inflater.Inflate(&zapped[pos], n, in_used,
+                                                out.data(), avail, out_used);
+        EXPECT_LE(in_used, n);
+        EXPECT_LE(out_used, avail);
+        pos += in_used;
+        output.append(out.data(), out_used);
+        if (status == kInflateDone)
+            return kDecodeOk;
+        if (status == kInflateCorrupt)
+            return kDecodeCorrupt;
+        // Asking for input with input left would be a stall
+        if (status == kInflateNeedInput && pos == zapped.size())
+            return inflater.Finish();
+        EXPECT_TRUE(status == kInflateNeedOutput || in_used == n);
+    }
+}
+
+TEST(Inflater, Chunks) {
+    std::string text = ReadFile("frederick_douglass.txt");
+    ASSERT_FALSE(text.empty());
+    std::string zapped = Zap(text);
+    for (auto &chunks : {std::make_pair(1, 1), std::make_pair(1, 4096),
+                         std::make_pair(3, 7), std::make_pair(4096, 1),
+                         std::make_pair(65536, 65536)}) {
+        std::string output;
+        EXPECT_EQ(Inflate(zapped, chunks.first, chunks.second, output),
+                  kDecodeOk);
+        EXPECT_TRUE(output == text) << chunks.first << " " << chunks.second;
+    }
+}
+
+TEST(Inflater, SmallStreams) {
+    for (std::string input : {std::string(""), std::string("z"),
+                              std::string(300, 'z'), std::string("xy")}) {
+        std::string output;
+        EXPECT_EQ(Inflate(Zap(input), 1, 2, output), kDecodeOk);
+        EXPECT_EQ(output, input);
+    }
+}
+
+TEST(Inflater, Errors) {
+    std::string zapped = Zap(ReadFile("frederick_douglass.txt"));
+    std::string output;
+    // Cut in the payload, in the count and in the tree
+    for (size_t cut : {zapped.size() / 2, size_t(100), size_t(3)})
+        EXPECT_EQ(Inflate(zapped.substr(0, cut), 5, 5, output),
+                  kDecodeTruncated);
+    // A tree deeper than any Compress writes
+    EXPECT_EQ(Inflate(std::string(20, '\0'), 5, 5, output), kDecodeCorrupt);
+
+    // Starting over after an error
+    Inflater inflater;
+    size_t in_used, out_used;
+    char out[16];
+    EXPECT_EQ(inflater.Inflate(std::string(20, '\0').data(), 20, in_used,
+                               out, sizeof(out), out_used), kInflateCorrupt);
+    EXPECT_EQ(inflater.Finish(), kDecodeCorrupt);
+    inflater.Reset();
+    std::string xy = Zap("xy");
+    EXPECT_EQ(inflater.Inflate(xy.data(), xy.size(), in_used,
+                               out, sizeof(out), out_used), kInflateDone);
+    EXPECT_EQ(std::string(out, out_used), "xy");
+}
+
+// A framed file of `input` in blocks of `block_size` bytes
+static std::string Frame(const std::string &input, size_t block_size) {
+    std::vector<char> framed;
+    BlockCodec::EncodeStream(input.data(), input.size(), framed, block_size);
+    return std::string(framed.begin(), framed.end());
+}
+
+TEST(Inflater, Framed) {
+    std::string text = ReadFile("frederick_douglass.txt");
+    // Small blocks reuse the tables of the ones before, and members follow
+    // one another
+    std::string zapped = Frame(text, 4096) + Frame("", 4096) +
+                         Frame(text.substr(0, 10000), 1 << 20);
+    std::string expected = text + text.substr(0, 10000);
+    for (auto &chunks : {std::make_pair(1, 1), std::make_pair(3, 7),
+                         std::make_pair(65536, 65536)}) {
+        std::string output;
+        EXPECT_EQ(Inflate(zapped, chunks.first, chunks.second, output),
+                  kDecodeOk);
+        EXPECT_TRUE(output == expected) << chunks.first << " " << chunks.second;
+    }
+
+    std::string output;
+    // Cut in a payload, in a header and in the magic of the next member
+    for (size_t cut : {zapped.size() / 2, sizeof(BlockCodec::kMagic) + 3,
+                       zapped.size() - 1, size_t(2)})
+        EXPECT_EQ(Inflate(zapped.substr(0, cut), 5, 5, output),
+                  kDecodeTruncated) << cut;
+    // A changed byte, caught by the checksum if not by the decoder
+    std::string changed = Frame(text, 4096);
+    changed[changed.size() / 2] ^= 1;
+    EXPECT_EQ(Inflate(changed, 100, 100, output), kDecodeCorrupt);
+    // No checksum
+    std::string unchecked = Frame("xy", 4096);
+    unchecked.erase(unchecked.size() - BlockCodec::kEndSize,
+                    BlockCodec::kEndSize - 1);
+    EXPECT_EQ(Inflate(unchecked, 100, 100, output), kDecodeCorrupt);
+
+    // References need the output of the whole member
+    std::vector<char> ref(BlockCodec::kMagic,
+                          BlockCodec::kMagic + sizeof(BlockCodec::kMagic));
+    BlockCodec::Encode("abcd", 4, ref);
+    BlockCodec::EncodeRef(0, 4, ref);
+    BlockCodec::EncodeEnd(Kernels::Crc32c("abcdabcd", 8), ref);
+    Inflater inflater;
+    size_t in_used, out_used;
+    char out[16];
+    EXPECT_EQ(inflater.Inflate(ref.data(), ref.size(), in_used,
+                               out, sizeof(out), out_used),
+              kInflateUnsupported);
+    EXPECT_EQ(std::string(out, out_used), "abcd");
+    EXPECT_EQ(inflater.Finish(), kDecodeCorrupt);
+
+    // Or a member of the format before checksums
+    inflater.Reset();
+    std::vector<char> old(BlockCodec::kOldMagic,
+                          BlockCodec::kOldMagic + sizeof(BlockCodec::kOldMagic));
+    BlockCodec::Encode("abcd", 4, old);
+    old.push_back(char(kBlockEnd));
+    EXPECT_EQ(inflater.Inflate(old.data(), old.size(), in_used,
+                               out, sizeof(out), out_used),
+              kInflateUnsupported);
+    EXPECT_EQ(out_used, 0u);
+
+    // Starting over on a single-stream file
+    inflater.Reset();
+    std::string xy = Zap("xy");
+    EXPECT_EQ(inflater.Inflate(xy.data(), xy.size(), in_used,
+                               out, sizeof(out), out_used), kInflateDone);
+    EXPECT_EQ(std::string(out, out_used), "xy");
+}
+
+#if __cpp_impl_coroutine
+TEST(Inflater, Coroutine) {
+    std::string text = ReadFile("frederick_douglass.txt");
+    for (size_t chunk : {1, 100, 1 << 16}) {
+        std::istringstream source(Zap(text));
+        DecodeStatus status = kDecodeCorrupt;
+        std::string output;
+        for (std::string_view piece : InflateChunks(source, chunk, status)) {
+            EXPECT_LE(piece.size(), chunk);
+            output.append(piece);
+        }
+        EXPECT_EQ(status, kDecodeOk);
+        EXPECT_TRUE(output == text) << chunk;
+
+        std::istringstream framed(Frame(text, 1 << 14));
+        output.clear();
+        for (std::string_view piece : InflateChunks(framed, chunk, status))
+            output.append(piece);
+        EXPECT_EQ(status, kDecodeOk);
+        EXPECT_TRUE(output == text) << chunk;
+    }
+
+    std::istringstream truncated(Zap(text).substr(0, 1000));
+    DecodeStatus status = kDecodeOk;
+    for (std::string_view piece : InflateChunks(truncated, 64, status))
+        (void)piece;
+    EXPECT_EQ(status, kDecodeTruncated);
+}
+#endif
+
+int main(int argc, char *argv[]) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,236 @@
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "huffman.h"
+#include "kernels.h"
+
+// Every tier this CPU can run
+static std::vector<CpuTier> Tiers() {
+    std::vector<CpuTier> tiers;
+    for (CpuTier t : {kTierScalar, kTierSse42, kTierAvx2, kTierBmi2})
+        if (t <= Kernels::Detected())
+            tiers.push_back(t);
+    return tiers;
+}
+
+// Random bytes, skewed more and more towards small ones, so that codes
+// get long
+static std::string Skewed(size_t n, unsigned int seed) {
+    std::mt19937 gen(seed);
+    std::geometric_distribution<int> geometric(0.3);
+    std::string s(n, '\0');
+    for (size_t i = 0; i < n; i++)
+        s[i] = static_cast<char>(i % 97 == 0 ? gen() : geometric(gen));
+    return s;
+}
+
+TEST(Kernels, Tiers) {
+    CpuTier tier;
+    for (CpuTier t : Tiers()) {
+        ASSERT_TRUE(Kernels::Parse(Kernels::Name(t), tier));
+        EXPECT_EQ(tier, t);
+        EXPECT_EQ(Kernels::Use(t), t);
+        EXPECT_EQ(Kernels::Active(), t);
+    }
+    EXPECT_FALSE(Kernels::Parse("avx512", tier));
+    EXPECT_EQ(Kernels::Use(kTierBmi2), Kernels::Detected());
+
+    // The environment asks for a tier, but never more than the CPU has
+    setenv(Kernels::kEnvironment, "scalar", 1);
+    EXPECT_EQ(Kernels::FromEnvironment(), kTierScalar);
+    setenv(Kernels::kEnvironment, "sse4.2", 1);
+    EXPECT_EQ(Kernels::FromEnvironment(),
+              std::min(kTierSse42, Kernels::Detected()));
+    setenv(Kernels::kEnvironment, "bmi2", 1);
+    EXPECT_EQ(Kernels::FromEnvironment(), Kernels::Detected());
+    setenv(Kernels::kEnvironment, "fastest", 1);
+    EXPECT_EQ(Kernels::FromEnvironment(), Kernels::Detected());
+    unsetenv(Kernels::kEnvironment);
+    EXPECT_EQ(Kernels::FromEnvironment(), Kernels::Detected());
+}
+
+TEST(Kernels, Histogram) {
+    std::mt19937 gen(1);
+    // Runs of a byte between others, crossing the 32-byte vectors
+    std::string runs;
+    while (runs.size() < 100000)
+        runs += std::string(gen() % 100, static_cast<char>(gen() % 3));
+    for (size_t n : {0, 1, 7, 8, 9, 31, 32, 33, 1000, 100003}) {
+        std::string random(n, '\0');
+        for (char &c : random)
+            c = static_cast<char>(gen());
+        for (const std::string &in : {random, std::string(n, 'a'),
+                                      Skewed(n, 2),
+                                      runs.substr(0, n)}) {
+            size_t expected[256] = {0};
+            for (unsigned char c : in)
+                expected[c]++;
+            for (CpuTier t : Tiers()) {
+                Kernels::Use(t);
+                size_t freq[256];
+                std::fill(freq, freq + 256, 12345);
+                Kernels::Histogram(in.data(), n, freq);
+                EXPECT_TRUE(std::equal(freq, freq + 256, expected))
+                    << n << " bytes, " << Kernels::Name(t);
+            }
+        }
+    }
+}
+
+TEST(Kernels, PackCodes) {
+    // Fibonacci frequencies give codes up to the longest length
+    size_t freq[256] = {0};
+    size_t a = 1, b = 1;
+    for (size_t i = 0; i < Huffman::kMaxCodeLength + 1; i++) {
+        freq[i] = a;
+        b += a;
+        a = b - a;
+    }
+    uint8_t long_lens[256], skewed_lens[256];
+    Huffman::BuildLengths(freq, long_lens);
+    ASSERT_EQ(long_lens[0], Huffman::kMaxCodeLength);
+
+    std::string skewed = Skewed(50000, 3), rare;
+    size_t skewed_freq[256] = {0};
+    for (unsigned char c : skewed)
+        skewed_freq[c]++;
+    Huffman::BuildLengths(skewed_freq, skewed_lens);
+    for (size_t i = 0; i < 20000; i++)
+        rare += static_cast<char>(i * 7 % (Huffman::kMaxCodeLength + 1));
+
+    for (auto test : {std::make_pair(&skewed, skewed_lens),
+                      std::make_pair(&rare, long_lens)}) {
+        const std::string &in = *test.first;
+        uint32_t codes[256];
+        Huffman::AssignCodes(test.second, 256, codes);
+        for (size_t n : {size_t(0), size_t(1), size_t(5), in.size()}) {
+            std::vector<char> expected(3, 'x');
+            BitWriter bw(expected);
+            for (size_t i = 0; i < n; i++) {
+                unsigned char c = in[i];
+                bw.PutBits(codes[c], test.second[c]);
+            }
+            bw.Close();
+            for (CpuTier t : Tiers()) {
+                Kernels::Use(t);
+                std::vector<char> out(3, 'x');
+                Kernels::PackCodes(in.data(), n, codes, test.second, out);
+                EXPECT_TRUE(out == expected)
+                    << n << " symbols, " << Kernels::Name(t);
+            }
+        }
+    }
+
+    // Wider symbols, with codes of up to 32 bits
+    std::mt19937 gen(5);
+    std::vector<uint32_t> codes(5000);
+    std::vector<uint8_t> lens(codes.size());
+    for (size_t s = 0; s < codes.size(); s++) {
+        lens[s] = 1 + s % 32;
+        codes[s] = gen() >> (32 - lens[s]);
+    }
+    std::vector<uint16_t> symbols(30000);
+    std::vector<char> expected, out;
+    BitWriter bw(expected);
+    for (auto &s : symbols) {
+        s = gen() % codes.size();
+        bw.PutBits(codes[s], lens[s]);
+    }
+    bw.Close();
+    for (CpuTier t : Tiers()) {
+        Kernels::Use(t);
+        out.clear();
+        Kernels::PackCodes(symbols.data(), symbols.size(), codes.data(),
+                           lens.data(), out);
+        EXPECT_TRUE(out == expected) << Kernels::Name(t);
+    }
+    Kernels::Use(Kernels::Detected());
+}
+
+TEST(Kernels, Decoding) {
+    // Short codes for multi-symbol entries, and codes longer than a lookup
+    std::string skewed = Skewed(100000, 6), text;
+    for (size_t i = 0; i < 100000; i++)
+        text += "a daemon answers every complete request"[i * 7 % 39];
+    for (const std::string &in : {skewed, text}) {
+        size_t freq[256];
+        Kernels::Histogram(in.data(), in.size(), freq);
+        uint8_t lens[256];
+        Huffman::BuildLengths(freq, lens);
+        size_t bits = 0;
+        for (int c = 0; c < 256; c++)
+            bits += freq[c] * lens[c];
+        std::vector<char> coded;
+        Huffman::EncodeCodes(in.data(), in.size(), lens, coded);
+        size_t n = coded.size();
+        coded.resize(n + BitReader::kPadding, 0);
+
+        for (bool multi : {false, true}) {
+            DecodeTable table;
+            ASSERT_TRUE(table.Build(lens));
+            if (multi)
+                table.BuildMulti();
+            for (CpuTier t : Tiers()) {
+                Kernels::Use(t);
+                // Whole, in short pieces, and cut short
+                std::string out(in.size(), '\0');
+                EXPECT_EQ(Huffman::DecodeCodes(coded.data(), n, table,
+                                               &out[0], out.size()),
+                          kDecodeOk);
+                EXPECT_TRUE(out == in) << Kernels::Name(t);
+                BitReader br(coded.data(), n);
+                for (size_t pos = 0; pos < in.size(); pos += 3)
+                    table.DecodeMany(br, &out[pos],
+                                     std::min<size_t>(3, in.size() - pos));
+                EXPECT_EQ(br.Position(), bits) << Kernels::Name(t);
+                EXPECT_TRUE(out == in) << Kernels::Name(t);
+                EXPECT_EQ(Huffman::DecodeCodes(coded.data(), n / 2, table,
+                                               &out[0], out.size()),
+                          kDecodeTruncated);
+            }
+        }
+    }
+    Kernels::Use(Kernels::Detected());
+}
+
+TEST(Kernels, Crc32c) {
+    std::mt19937 gen(4);
+    std::string random(10000, '\0');
+    for (char &c : random)
+        c = static_cast<char>(gen());
+    Kernels::Use(kTierScalar);
+    uint32_t expected = Kernels::Crc32c(random.data(), random.size());
+
+    for (CpuTier t : Tiers()) {
+        Kernels::Use(t);
+        EXPECT_EQ(Kernels::Crc32c("123456789", 9), 0xE3069283u)
+            << Kernels::Name(t);
+        EXPECT_EQ(Kernels::Crc32c("", 0), 0u);
+        EXPECT_EQ(Kernels::Crc32c(random.data(), random.size()), expected);
+        // In pieces of any alignment
+        uint32_t crc = 0;
+        for (size_t pos = 0, step = 1; pos < random.size(); pos += step++)
+            crc = Kernels::Crc32c(&random[pos],
+                                  std::min(step, random.size() - pos), crc);
+        EXPECT_EQ(crc, expected) << Kernels::Name(t);
+    }
+    Kernels::Use(Kernels::Detected());
+
+    // Combined from the CRCs of two pieces, either of them maybe empty
+    for (size_t split : {size_t(0), size_t(1), size_t(4321), random.size()}) {
+        uint32_t first = Kernels::Crc32c(random.data(), split);
+        uint32_t second = Kernels::Crc32c(&random[split],
+                                          random.size() - split);
+        EXPECT_EQ(Kernels::Crc32cCombine(first, second, random.size() - split),
+                  expected) << split;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,81 @@
+#include <gtest/gtest.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "order1.h"
+
+// Encode then decode from a padded copy
+static DecodeStatus RoundTrip(const std::string &input, std::string &output,
+                              size_t *coded_size = nullptr) {
+    std::vector<char> coded;
+    Order1::EncodeBlock(input.data(), input.size(), coded);
+    if (coded_size)
+        *coded_size = coded.size();
+    size_t n = coded.size();
+    coded.resize(n + BitReader::kPadding, 0);
+    output.assign(input.size(), '\0');
+    return Order1::DecodeBlock(coded.data(), n, &output[0], output.size());
+}
+
+TEST(Order1, RoundTrip) {
+    std::mt19937 gen(9);
+    std::string uniform, words;
+    for (int i = 0; i < 50000; i++)
+        uniform += static_cast<char>(gen());
+    const char *dictionary[] = {"the ", "then ", "them ", "other ", "hence "};
+    while (words.size() < 50000)
+        words += dictionary[gen() % 5];
+
+    for (std::string input : {uniform, words, std::string("a"),
+                              std::string(500, '\0'), std::string("ab")}) {
+        std::string output;
+        EXPECT_EQ(RoundTrip(input, output), kDecodeOk);
+        EXPECT_EQ(output, input);
+    }
+}
+
+TEST(Order1, BeatsOrder0OnContexts) {
+    // A random walk over 64 symbols, each byte is one step from the last
+    std::mt19937 gen(2);
+    std::string input;
+    unsigned int symbol = 0;
+    for (int i = 0; i < 100000; i++) {
+        symbol = (symbol + (gen() % 2 ? 1 : 63)) % 64;
+        input += static_cast<char>(symbol);
+    }
+
+    std::string output;
+    size_t order1_size;
+    EXPECT_EQ(RoundTrip(input, output, &order1_size), kDecodeOk);
+    EXPECT_EQ(output, input);
+    std::vector<char> huffman;
+    Huffman::EncodeBlock(input.data(), input.size(), huffman);
+    EXPECT_LT(order1_size, huffman.size() / 4);
+}
+
+TEST(Order1, Errors) {
+    std::string input("mississippi river");
+    std::vector<char> coded;
+    Order1::EncodeBlock(input.data(), input.size(), coded);
+    std::string output(input.size(), '\0');
+
+    std::vector<char> padded(coded);
+    padded.resize(coded.size() + BitReader::kPadding, 0);
+    // Missing payload bits
+    EXPECT_EQ(Order1::DecodeBlock(padded.data(), coded.size() - 2,
+                                  &output[0], output.size()), kDecodeTruncated);
+    // Cut in the tables
+    EXPECT_EQ(Order1::DecodeBlock(padded.data(), 4,
+                                  &output[0], output.size()), kDecodeTruncated);
+    // The first context, 0, has no table
+    padded[1] ^= 0x01;
+    EXPECT_EQ(Order1::DecodeBlock(padded.data(), coded.size(),
+                                  &output[0], output.size()), kDecodeCorrupt);
+}
+
+int main(int argc, char *argv[]) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,514 @@
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <thread>
+
+#include "pipeline.h"
+
+// Run a file through Pipeline::Compress and Pipeline::Decompress
+static std::string RoundTrip(const std::string &input, unsigned int workers,
+                             size_t block_size, std::string *zapped = nullptr) {
+    int fd = open("test_pipeline_input", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    EXPECT_TRUE(Pipeline::WriteAll(fd, input.data(), input.size()));
+    close(fd);
+
+    int in = open("test_pipeline_input", O_RDONLY);
+    int out = open("test_pipeline_zap", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    EXPECT_TRUE(Pipeline::Compress(in, out, workers, block_size));
+    close(in);
+    close(out);
+
+    in = open("test_pipeline_zap", O_RDONLY);
+    out = open("test_pipeline_output", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    EXPECT_TRUE(Pipeline::Decompress(in, out, workers));
+    close(in);
+    close(out);
+
+    std::string result(input.size() + 1, '\0');
+    size_t got;
+    in = open("test_pipeline_output", O_RDONLY);
+    Pipeline::ReadAll(in, &result[0], result.size(), 0, got);
+    close(in);
+    result.resize(got);
+    if (zapped) {
+        zapped->resize(2 * input.size() + 64);
+        in = open("test_pipeline_zap", O_RDONLY);
+        Pipeline::ReadAll(in, &(*zapped)[0], zapped->size(), 0, got);
+        close(in);
+        zapped->resize(got);
+    }
+
+    std::remove("test_pipeline_input");
+    std::remove("test_pipeline_zap");
+    std::remove("test_pipeline_output");
+    return result;
+}
+
+TEST(SPSCRing, PushPop) {
+    SPSCRing<int> ring(3);
+    int item;
+
+    EXPECT_FALSE(ring.TryPop(item));
+    // Capacity is rounded up to 4
+    for (int i = 0; i < 4; i++)
+        EXPECT_TRUE(ring.TryPush(i));
+    EXPECT_FALSE(ring.TryPush(4));
+    EXPECT_TRUE(ring.TryPop(item));
+    EXPECT_EQ(item, 0);
+    EXPECT_TRUE(ring.TryPush(4));
+    for (int i = 1; i <= 4; i++) {
+        EXPECT_TRUE(ring.TryPop(item));
+        EXPECT_EQ(item, i);
+    }
+    EXPECT_FALSE(ring.TryPop(item));
+}
+
+TEST(SPSCRing, TwoThreads) {
+    SPSCRing<int> ring(8);
+    const int count = 100000;
+
+    std::thread producer([&]() {
+        for (int i = 0; i < count; i++)
+            while (!ring.TryPush(i))
+                std::this_thread::yield();
+    });
+    for (int i = 0; i < count; i++) {
+        int item;
+        while (!ring.TryPop(item))
+            std::this_thread::yield();
+        ASSERT_EQ(item, i);
+    }
+    producer.join();
+}
+
+TEST(Pipeline, RoundTrip) {
+    std::mt19937 gen(42);
+    std::string text;
+    // Skewed data that compresses, then random data that doesn't
+    for (int i = 0; i < 300000; i++)
+        text += "aaaabbcdefgh"[gen() % 12];
+    for (int i = 0; i < 100000; i++)
+        text += static_cast<char>(gen());
+
+    for (unsigned int workers : {1, 2, 5}) {
+        for (size_t block_size : {1000, 1 << 16}) {
+            EXPECT_EQ(RoundTrip(text, workers, block_size), text)
+                << workers << " workers, " << block_size << " bytes blocks";
+        }
+    }
+}
+
+TEST(Pipeline, SmallInputs) {
+    for (std::string input : {std::string(""), std::string("x"),
+                              std::string(5000, 'z'), std::string("\0\xff", 2)})
+        EXPECT_EQ(RoundTrip(input, 3, 1024), input);
+}
+
+TEST(Pipeline, Framing) {
+    std::string zapped;
+    RoundTrip(std::string(10, 'q'), 1, 1024, &zapped);
+
+    // Magic, one block of a single symbol, the checksum and the end marker
+    ASSERT_EQ(zapped.size(), 4 + BlockCodec::kHeaderSize + 3 +
+                             BlockCodec::kEndSize);
+    EXPECT_TRUE(BlockCodec::HasMagic(zapped.data(), zapped.size()));
+    EXPECT_EQ(zapped[4], kBlockHuffman);
+    EXPECT_EQ(BlockCodec::GetU32(&zapped[5]), 10);
+    EXPECT_EQ(BlockCodec::GetU32(&zapped[9]), 3);
+    EXPECT_EQ(zapped[16], kBlockChecksum);
+    EXPECT_EQ(BlockCodec::GetU32(&zapped[17]), 0);
+    EXPECT_EQ(BlockCodec::GetU32(&zapped[21]), 4);
+    EXPECT_EQ(BlockCodec::GetU32(&zapped[25]),
+              Kernels::Crc32c(std::string(10, 'q').data(), 10));
+    EXPECT_EQ(static_cast<uint8_t>(zapped.back()), kBlockEnd);
+}
+
+TEST(BlockCodec, ChoosesCoder) {
+    std::mt19937 gen(1);
+    std::string skewed, dyadic;
+    for (int i = 0; i < 50000; i++)
+        skewed += gen() % 100 < 97 ? '2' : '5';
+    // Uniform over 16 symbols, Huffman codes are exact
+    for (int i = 0; i < 50000; i++)
+        dyadic += "0123456789abcdef"[gen() % 16];
+
+    for (auto &test : {std::make_pair(skewed, kBlockTans),
+                       std::make_pair(dyadic, kBlockHuffman)}) {
+        const std::string &input = test.first;
+        std::vector<char> frame;
+        BlockCodec::Encode(input.data(), input.size(), frame);
+        EXPECT_EQ(frame[0], test.second);
+
+        size_t coded = frame.size() - BlockCodec::kHeaderSize;
+        EXPECT_EQ(BlockCodec::GetU32(&frame[5]), coded);
+        frame.resize(frame.size() + BitReader::kPadding, 0);
+        std::string output(input.size(), '\0');
+        EXPECT_EQ(BlockCodec::Decode(frame[0], &frame[BlockCodec::kHeaderSize],
+                                     coded, &output[0], output.size()),
+                  kDecodeOk);
+        EXPECT_EQ(output, input);
+    }
+}
+
+TEST(BlockCodec, EstimatesStrategy) {
+    std::mt19937 gen(4);
+    std::string runs, uniform, text;
+    while (runs.size() < BlockCodec::kDefaultBlockSize)
+        runs += std::string(gen() % 300 + 1, "ab"[gen() % 2]);
+    for (size_t i = 0; i < BlockCodec::kDefaultBlockSize; i++)
+        uniform += static_cast<char>(gen());
+    const char *dictionary[] = {"the ", "then ", "them ", "other ", "hence "};
+    while (text.size() < BlockCodec::kDefaultBlockSize)
+        text += dictionary[gen() % 5];
+
+    for (auto &test : {std::make_pair(runs, kBlockRle),
+                       std::make_pair(uniform, kBlockStored),
+                       std::make_pair(text, kBlockOrder1)}) {
+        const std::string &input = test.first;
+        BlockEstimate estimate;
+        BlockCodec::Estimate(input.data(), input.size(), estimate, true);
+        // Whole segments, as many as the size of the block gives
+        EXPECT_EQ(estimate.sampled % BlockCodec::kSampleSegment, 0u);
+        EXPECT_LE(estimate.sampled, input.size() / BlockCodec::kSampleFraction);
+        EXPECT_GT(estimate.sampled, input.size() / BlockCodec::kSampleFraction -
+                                    BlockCodec::kSampleSegment);
+        EXPECT_GT(estimate.seconds, 0);
+
+        std::vector<char> frame;
+        BlockCodec::Encode(input.data(), input.size(), frame);
+        EXPECT_EQ(frame[0], test.second);
+        // Samples cut runs short, so the prediction is only rough
+        double coded = frame.size() - BlockCodec::kHeaderSize;
+        EXPECT_NEAR(estimate.bytes[test.second], coded, coded / 2);
+
+        frame.resize(frame.size() + BitReader::kPadding, 0);
+        std::string output(input.size(), '\0');
+        EXPECT_EQ(BlockCodec::Decode(frame[0], &frame[BlockCodec::kHeaderSize],
+                                     coded, &output[0], output.size()),
+                  kDecodeOk);
+        EXPECT_EQ(output, input);
+    }
+
+    // Samples of random bytes see most of them only once, but don't make
+    // them look compressible
+    BlockEstimate estimate;
+    EXPECT_EQ(BlockCodec::Estimate(uniform.data(), uniform.size(), estimate),
+              kBlockStored);
+    EXPECT_GT(estimate.bytes[kBlockTans], uniform.size());
+    EXPECT_GT(estimate.bytes[kBlockHuffman], uniform.size());
+}
+
+TEST(BlockCodec, Stream) {
+    std::string input(300000, 'x');
+    for (size_t i = 0; i < input.size(); i += 7)
+        input[i] = 'a' + i % 26;
+    std::vector<char> zapped;
+    BlockCodec::EncodeStream(input.data(), input.size(), zapped, 1 << 16);
+    EXPECT_TRUE(BlockCodec::HasMagic(zapped.data(), zapped.size()));
+    EXPECT_EQ(static_cast<uint8_t>(zapped.back()), kBlockEnd);
+    size_t n = zapped.size();
+    zapped.resize(n + BitReader::kPadding, 0);
+
+    std::vector<char> output;
+    EXPECT_EQ(BlockCodec::DecodeStream(zapped.data(), n, output), kDecodeOk);
+    EXPECT_EQ(std::string(output.begin(), output.end()), input);
+    output.clear();
+    EXPECT_EQ(BlockCodec::DecodeStream(zapped.data(), n - 1, output),
+              kDecodeTruncated);
+    EXPECT_EQ(BlockCodec::DecodeStream(zapped.data(), 2, output),
+              kDecodeTruncated);
+    zapped[0] = 'Z';
+    EXPECT_EQ(BlockCodec::DecodeStream(zapped.data(), n, output),
+              kDecodeCorrupt);
+}
+
+// Number of blocks of every type in the first member of a stream
+static std::vector<size_t> CountTypes(const std::string &zapped) {
+    std::vector<size_t> types(256);
+    for (size_t pos = sizeof(BlockCodec::kMagic);
+         static_cast<uint8_t>(zapped[pos]) != kBlockEnd;
+         pos += BlockCodec::kHeaderSize + BlockCodec::GetU32(&zapped[pos + 5]))
+        types[static_cast<uint8_t>(zapped[pos])]++;
+    return types;
+}
+
+TEST(BlockCodec, TableReuse) {
+    // Small blocks of the same skewed statistics
+    std::mt19937 gen(6);
+    std::geometric_distribution<int> geometric(0.15);
+    std::string input(1 << 18, '\0');
+    for (char &c : input)
+        c = 'a' + std::min(geometric(gen), 40);
+    const size_t block_size = 2048;
+
+    std::vector<char> zapped, alone;
+    BlockCodec::EncodeStream(input.data(), input.size(), zapped, block_size);
+    for (size_t pos = 0; pos < input.size(); pos += block_size)
+        BlockCodec::Encode(&input[pos], block_size, alone);
+    std::vector<size_t> types = CountTypes(std::string(zapped.begin(),
+                                                       zapped.end()));
+    EXPECT_GT(types[kBlockHuffmanRepeat] + types[kBlockHuffmanDelta],
+              input.size() / block_size / 2);
+    EXPECT_LT(zapped.size(), sizeof(BlockCodec::kMagic) + alone.size());
+    size_t n = zapped.size();
+    zapped.resize(n + BitReader::kPadding, 0);
+    std::vector<char> output;
+    EXPECT_EQ(BlockCodec::DecodeStream(zapped.data(), n, output), kDecodeOk);
+    EXPECT_TRUE(std::string(output.begin(), output.end()) == input);
+
+    // Through the pipeline, each worker reusing its own previous table
+    for (unsigned int workers : {1, 3}) {
+        std::string piped;
+        EXPECT_TRUE(RoundTrip(input, workers, block_size, &piped) == input);
+        types = CountTypes(piped);
+        EXPECT_GT(types[kBlockHuffmanRepeat] + types[kBlockHuffmanDelta], 0u);
+    }
+
+    // The same block again repeats the table
+    BlockTable table;
+    std::vector<char> first, second;
+    BlockCodec::Encode(input.data(), block_size, first, &table);
+    table.distance = 1;
+    BlockCodec::Encode(input.data(), block_size, second, &table);
+    EXPECT_EQ(first[0], kBlockHuffman);
+    EXPECT_EQ(second[0], kBlockHuffmanRepeat);
+
+    // But not the table of another member
+    std::string magic(BlockCodec::kMagic, sizeof(BlockCodec::kMagic));
+    std::vector<char> ends[2];
+    BlockCodec::EncodeEnd(Kernels::Crc32c(input.data(), block_size), ends[0]);
+    BlockCodec::EncodeEnd(Kernels::Crc32c(input.data(), block_size,
+                                          Kernels::Crc32c(input.data(),
+                                                          block_size)),
+                          ends[1]);
+    std::string end(ends[0].begin(), ends[0].end());
+    std::string both(ends[1].begin(), ends[1].end());
+    std::string one(first.begin(), first.end()), two(second.begin(), second.end());
+    for (auto &test : {std::make_pair(magic + one + two + both, kDecodeOk),
+                       std::make_pair(magic + one + end + magic + two + end,
+                                      kDecodeCorrupt),
+                       std::make_pair(magic + two + end, kDecodeCorrupt)}) {
+        std::string stream = test.first + std::string(BitReader::kPadding, '\0');
+        output.clear();
+        EXPECT_EQ(BlockCodec::DecodeStream(stream.data(), test.first.size(),
+                                           output), test.second);
+    }
+}
+
+TEST(Pipeline, Truncated) {
+    std::string zapped;
+    std::string text(20000, 'a');
+    text += "bcdefg";
+    RoundTrip(text, 2, 4096, &zapped);
+
+    // Drop the end marker and part of the last block
+    int fd = open("test_pipeline_zap", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    Pipeline::WriteAll(fd, zapped.data(), zapped.size() - 3);
+    close(fd);
+    int in = open("test_pipeline_zap", O_RDONLY);
+    int out = open("test_pipeline_output", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    EXPECT_FALSE(Pipeline::Decompress(in, out, 2));
+    close(in);
+    close(out);
+    std::remove("test_pipeline_zap");
+    std::remove("test_pipeline_output");
+}
+
+// Decompress `zapped` from a file, return false on failure
+static bool DecompressFile(const std::string &zapped, std::string &output) {
+    int fd = open("test_pipeline_zap", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    Pipeline::WriteAll(fd, zapped.data(), zapped.size());
+    close(fd);
+    int in = open("test_pipeline_zap", O_RDONLY);
+    int out = open("test_pipeline_output", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    bool ok = Pipeline::Decompress(in, out, 2);
+    close(in);
+    close(out);
+
+    size_t got;
+    in = open("test_pipeline_output", O_RDONLY);
+    output.assign(lseek(in, 0, SEEK_END), '\0');
+    Pipeline::ReadAll(in, &output[0], output.size(), 0, got);
+    close(in);
+    output.resize(got);
+    std::remove("test_pipeline_zap");
+    std::remove("test_pipeline_output");
+    return ok;
+}
+
+TEST(Pipeline, Members) {
+    std::string first(30000, 'x'), second("second member"), zapped, output;
+    for (auto *member : {&first, &second, &first}) {
+        std::string part;
+        RoundTrip(*member, 2, 4096, &part);
+        zapped += part;
+    }
+    // An empty member adds nothing
+    std::string empty;
+    RoundTrip("", 1, 4096, &empty);
+    zapped += empty;
+    EXPECT_TRUE(DecompressFile(zapped, output));
+    EXPECT_EQ(output, first + second + first);
+
+    // Concatenated in memory too
+    std::vector<char> padded(zapped.begin(), zapped.end());
+    padded.resize(zapped.size() + BitReader::kPadding, 0);
+    std::vector<char> stream;
+    EXPECT_EQ(BlockCodec::DecodeStream(padded.data(), zapped.size(), stream),
+              kDecodeOk);
+    EXPECT_EQ(std::string(stream.begin(), stream.end()), first + second + first);
+
+    // Anything but a member after an end is an error
+    EXPECT_FALSE(DecompressFile(zapped + "junk", output));
+    EXPECT_FALSE(DecompressFile(zapped + "\xC5Z", output));
+    padded = std::vector<char>(zapped.begin(), zapped.end());
+    padded.push_back('j');
+    padded.resize(padded.size() + 3 + BitReader::kPadding, 'k');
+    EXPECT_EQ(BlockCodec::DecodeStream(padded.data(), zapped.size() + 4, stream),
+              kDecodeCorrupt);
+}
+
+TEST(Pipeline, Dedup) {
+    // Snapshots of the same data, the later ones with an insertion
+    std::mt19937 gen(6);
+    std::string snapshot;
+    for (int i = 0; i < 6 << 15; i++)
+        snapshot += "abcdefgh"[gen() % 8];
+    std::string input = snapshot + snapshot + snapshot.substr(0, 1000) +
+                        "changed" + snapshot.substr(1000) + snapshot;
+    int fd = open("test_pipeline_input", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    Pipeline::WriteAll(fd, input.data(), input.size());
+    close(fd);
+
+    for (DedupMode mode : {kDedupFixed, kDedupContent}) {
+        int in = open("test_pipeline_input", O_RDONLY);
+        int out = open("test_pipeline_zap", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        DedupStats stats;
+        EXPECT_TRUE(Pipeline::Compress(in, out, 2, 1 << 15, mode, &stats));
+        close(in);
+        close(out);
+        EXPECT_EQ(stats.bytes, input.size());
+        EXPECT_GT(stats.duplicates, 0u);
+        EXPECT_GT(stats.index_bytes, 0u);
+        // Only content-defined blocks find the copies after the insertion
+        if (mode == kDedupContent)
+            EXPECT_GT(stats.duplicate_bytes, snapshot.size() * 5 / 2);
+        else
+            EXPECT_LT(stats.duplicate_bytes, snapshot.size() * 2);
+
+        std::string zapped(input.size(), '\0'), output;
+        size_t got;
+        in = open("test_pipeline_zap", O_RDONLY);
+        Pipeline::ReadAll(in, &zapped[0], zapped.size(), 0, got);
+        close(in);
+        zapped.resize(got);
+        EXPECT_TRUE(DecompressFile(zapped, output));
+        EXPECT_EQ(output, input);
+
+        // In memory, and as the second member of a file
+        std::string two = zapped + zapped;
+        std::vector<char> padded(two.begin(), two.end()), stream;
+        padded.resize(two.size() + BitReader::kPadding, 0);
+        EXPECT_EQ(BlockCodec::DecodeStream(padded.data(), two.size(), stream),
+                  kDecodeOk);
+        EXPECT_EQ(std::string(stream.begin(), stream.end()), input + input);
+        EXPECT_TRUE(DecompressFile(two, output));
+        EXPECT_EQ(output, input + input);
+    }
+    std::remove("test_pipeline_input");
+
+    // A reference to bytes not decoded yet
+    std::vector<char> frame(BlockCodec::kMagic,
+                            BlockCodec::kMagic + sizeof(BlockCodec::kMagic));
+    BlockCodec::Encode("abcd", 4, frame);
+    BlockCodec::EncodeRef(1, 4, frame);
+    BlockCodec::EncodeEnd(Kernels::Crc32c("abcdbcda", 8), frame);
+    std::string output;
+    EXPECT_FALSE(DecompressFile(std::string(frame.begin(), frame.end()), output));
+    size_t n = frame.size();
+    frame.resize(n + BitReader::kPadding, 0);
+    std::vector<char> stream;
+    EXPECT_EQ(BlockCodec::DecodeStream(frame.data(), n, stream), kDecodeCorrupt);
+
+    // Members of the format before checksums, alone or appended
+    std::vector<char> old(BlockCodec::kOldMagic,
+                          BlockCodec::kOldMagic + sizeof(BlockCodec::kOldMagic));
+    BlockCodec::Encode("abcd", 4, old);
+    old.push_back(char(kBlockEnd));
+    std::vector<char> appended;
+    BlockCodec::EncodeStream("abcd", 4, appended);
+    appended.insert(appended.end(), old.begin(), old.end());
+    for (std::vector<char> *test : {&old, &appended}) {
+        n = test->size();
+        test->resize(n + BitReader::kPadding, 0);
+        stream.clear();
+        EXPECT_EQ(BlockCodec::DecodeStream(test->data(), n, stream),
+                  kDecodeUnsupported);
+        EXPECT_FALSE(DecompressFile(std::string(test->data(), n), output));
+    }
+}
+
+TEST(BlockCodec, Checksum) {
+    // Random bytes are stored, so a changed byte still decodes
+    std::mt19937 gen(8);
+    std::string input(50000, '\0');
+    for (char &c : input)
+        c = static_cast<char>(gen());
+    std::vector<char> zapped;
+    BlockCodec::EncodeStream(input.data(), input.size(), zapped, 1 << 14);
+    ASSERT_EQ(zapped[4], kBlockStored);
+    std::string good(zapped.begin(), zapped.end()), output;
+    EXPECT_TRUE(DecompressFile(good, output));
+    EXPECT_EQ(output, input);
+
+    auto decode = [](std::string zapped) {
+        size_t n = zapped.size();
+        zapped.resize(n + BitReader::kPadding, '\0');
+        std::vector<char> stream;
+        return BlockCodec::DecodeStream(zapped.data(), n, stream);
+    };
+    std::string changed = good;
+    changed[4 + BlockCodec::kHeaderSize + 100] ^= 1;
+    // Without its checksum, or with blocks after it
+    size_t checksum = good.size() - BlockCodec::kEndSize;
+    std::string dropped = good.substr(0, checksum) + good.substr(good.size() - 1);
+    std::string after = good.substr(0, good.size() - 1) +
+                        good.substr(4, BlockCodec::kHeaderSize + (1 << 14)) +
+                        good.substr(good.size() - 1);
+    for (const std::string &bad : {changed, dropped, after}) {
+        EXPECT_FALSE(DecompressFile(bad, output));
+        EXPECT_EQ(decode(bad), kDecodeCorrupt);
+    }
+
+    // Each member is checked on its own, with references and several
+    // workers
+    std::string piped;
+    std::string text = input.substr(0, 1000) + input.substr(0, 1000);
+    int fd = open("test_pipeline_input", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    Pipeline::WriteAll(fd, text.data(), text.size());
+    close(fd);
+    int in = open("test_pipeline_input", O_RDONLY);
+    int out = open("test_pipeline_zap", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    EXPECT_TRUE(Pipeline::Compress(in, out, 3, 100, kDedupFixed));
+    piped.resize(lseek(out, 0, SEEK_END));
+    size_t got;
+    Pipeline::ReadAll(out, &piped[0], piped.size(), 0, got);
+    close(in);
+    close(out);
+    std::remove("test_pipeline_input");
+    EXPECT_EQ(CountTypes(piped)[kBlockRef], 10u);
+    EXPECT_TRUE(DecompressFile(good + piped + good, output));
+    EXPECT_EQ(output, input + text + input);
+    EXPECT_EQ(decode(good + piped + good), kDecodeOk);
+    EXPECT_EQ(decode(good + piped + changed), kDecodeCorrupt);
+}
+
+int main(int argc, char *argv[]) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
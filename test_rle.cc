@@ -0,0 +1,83 @@
+#include <gtest/gtest.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "rle.h"
+
+// Encode then decode from a padded copy
+static DecodeStatus RoundTrip(const std::string &input, std::string &output,
+                              size_t *coded_size = nullptr) {
+    std::vector<char> coded;
+    Rle::EncodeBlock(input.data(), input.size(), coded);
+    if (coded_size)
+        *coded_size = coded.size();
+    size_t n = coded.size();
+    coded.resize(n + BitReader::kPadding, 0);
+    output.assign(input.size(), '\0');
+    return Rle::DecodeBlock(coded.data(), n, &output[0], output.size());
+}
+
+TEST(Rle, Transform) {
+    std::string input("abbbbbbccccd");
+    std::vector<char> transformed;
+    Rle::Encode(input.data(), input.size(), transformed);
+    // Runs of 4 or more keep 4 bytes and count the rest
+    std::string expected("abbbb\x02" "cccc\x00" "d", 12);
+    EXPECT_EQ(std::string(transformed.begin(), transformed.end()), expected);
+
+    std::string output(input.size(), '\0');
+    EXPECT_TRUE(Rle::Decode(transformed.data(), transformed.size(),
+                            &output[0], output.size()));
+    EXPECT_EQ(output, input);
+}
+
+TEST(Rle, RoundTrip) {
+    std::mt19937 gen(5);
+    std::string runs, uniform;
+    while (runs.size() < 100000)
+        runs += std::string(gen() % 600 + 1, "xyz"[gen() % 3]);
+    for (int i = 0; i < 10000; i++)
+        uniform += static_cast<char>(gen());
+
+    for (std::string input : {runs, uniform, std::string("a"),
+                              std::string(Rle::kMaxRun, 'q'),
+                              std::string(Rle::kMaxRun + 1, 'q'),
+                              std::string(Rle::kMinRun, 'q')}) {
+        std::string output;
+        EXPECT_EQ(RoundTrip(input, output), kDecodeOk);
+        EXPECT_EQ(output, input);
+    }
+
+    size_t coded_size;
+    std::string output;
+    EXPECT_EQ(RoundTrip(runs, output, &coded_size), kDecodeOk);
+    EXPECT_LT(coded_size, runs.size() / 50);
+}
+
+TEST(Rle, Errors) {
+    std::string input(100, 'a');
+    input += "bcd";
+    std::vector<char> coded;
+    Rle::EncodeBlock(input.data(), input.size(), coded);
+    std::string output(input.size(), '\0');
+
+    std::vector<char> padded(coded);
+    padded.resize(coded.size() + BitReader::kPadding, 0);
+    // Missing payload bits
+    EXPECT_EQ(Rle::DecodeBlock(padded.data(), coded.size() - 1,
+                               &output[0], output.size()), kDecodeTruncated);
+    // More output than the frame says
+    EXPECT_EQ(Rle::DecodeBlock(padded.data(), coded.size(),
+                               &output[0], output.size() - 1), kDecodeCorrupt);
+    // A transformed size the output can't come from
+    padded[0] = 0x7F;
+    EXPECT_EQ(Rle::DecodeBlock(padded.data(), coded.size(),
+                               &output[0], output.size()), kDecodeCorrupt);
+}
+
+int main(int argc, char *argv[]) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,97 @@
+#include <gtest/gtest.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "tans.h"
+
+// Encode then decode from a padded copy
+static DecodeStatus RoundTrip(const std::string &input, std::string &output,
+                              size_t *coded_size = nullptr) {
+    std::vector<char> coded;
+    Tans::EncodeBlock(input.data(), input.size(), coded);
+    if (coded_size)
+        *coded_size = coded.size();
+    size_t n = coded.size();
+    coded.resize(n + BitReader::kPadding, 0);
+    output.assign(input.size(), '\0');
+    return Tans::DecodeBlock(coded.data(), n, &output[0], output.size());
+}
+
+TEST(Tans, RoundTrip) {
+    std::mt19937 gen(7);
+    std::string uniform, text;
+    for (int i = 0; i < 100000; i++)
+        uniform += static_cast<char>(gen());
+    for (int i = 0; i < 20000; i++)
+        text += "etaoin shrdlu"[gen() % 13];
+    std::string all;
+    for (int i = 0; i < 256; i++)
+        all += static_cast<char>(i);
+
+    for (std::string input : {uniform, text, all, std::string("a"),
+                              std::string(777, 'q'), std::string("ab")}) {
+        std::string output;
+        EXPECT_EQ(RoundTrip(input, output), kDecodeOk);
+        EXPECT_EQ(output, input);
+    }
+}
+
+TEST(Tans, Normalize) {
+    size_t freq[256] = {0};
+    freq['a'] = 1000000;
+    freq['b'] = 1;
+    freq['c'] = 3;
+    uint16_t norm[256];
+    size_t table_log = Tans::Normalize(freq, 1000004, norm);
+
+    EXPECT_EQ(table_log, Tans::kDefaultTableLog);
+    // Rare symbols keep a state, the rest goes to the frequent one
+    EXPECT_EQ(norm['b'], 1);
+    EXPECT_EQ(norm['c'], 1);
+    EXPECT_EQ(norm['a'], (1 << table_log) - 2);
+    EXPECT_EQ(norm['d'], 0);
+}
+
+TEST(Tans, BeatsHuffmanOnSkewedData) {
+    // A status code column, almost always the same value
+    std::mt19937 gen(3);
+    std::string input;
+    for (int i = 0; i < 100000; i++) {
+        unsigned int r = gen() % 1000;
+        input += r < 970 ? '2' : r < 990 ? '3' : r < 998 ? '4' : '5';
+    }
+
+    std::string output;
+    size_t tans_size;
+    EXPECT_EQ(RoundTrip(input, output, &tans_size), kDecodeOk);
+    EXPECT_EQ(output, input);
+    std::vector<char> huffman;
+    Huffman::EncodeBlock(input.data(), input.size(), huffman);
+    // Huffman can't go below one bit per symbol
+    EXPECT_GE(huffman.size(), input.size() / 8);
+    EXPECT_LT(tans_size, huffman.size() / 2);
+}
+
+TEST(Tans, Errors) {
+    std::string input("mississippi river");
+    std::vector<char> coded;
+    Tans::EncodeBlock(input.data(), input.size(), coded);
+    std::string output(input.size(), '\0');
+
+    std::vector<char> padded(coded);
+    padded.resize(coded.size() + BitReader::kPadding, 0);
+    // Missing payload bits
+    EXPECT_EQ(Tans::DecodeBlock(padded.data(), coded.size() - 2,
+                                &output[0], output.size()), kDecodeTruncated);
+    // Counts that don't add up to the table size
+    padded[2] ^= 0x04;
+    EXPECT_EQ(Tans::DecodeBlock(padded.data(), coded.size(),
+                                &output[0], output.size()), kDecodeCorrupt);
+}
+
+int main(int argc, char *argv[]) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
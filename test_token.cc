@@ -0,0 +1,178 @@
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "token.h"
+
+using Tokens16 = TokenCoder<uint16_t, 65536>;
+
+// Encode `in` as one block and decode it again, `coded` gets the block
+template <typename Symbol, size_t kAlphabet>
+static std::vector<Symbol> RoundTrip(TokenCoder<Symbol, kAlphabet> &coder,
+                                     const std::vector<Symbol> &in,
+                                     std::vector<char> *coded = nullptr) {
+    std::vector<char> block;
+    EXPECT_TRUE(coder.Encode(in.data(), in.size(), block));
+    if (coded)
+        *coded = block;
+    size_t n = block.size();
+    block.resize(n + BitReader::kPadding, 0);
+    std::vector<Symbol> out(in.size());
+    EXPECT_EQ(coder.Decode(block.data(), n, out.data(), out.size()),
+              kDecodeOk);
+    return out;
+}
+
+// Token ids of Zipf frequencies over a vocabulary of `vocabulary` ids
+static std::vector<uint16_t> Zipf(size_t n, size_t vocabulary,
+                                  unsigned int seed) {
+    std::vector<double> weights(vocabulary);
+    for (size_t i = 0; i < vocabulary; i++)
+        weights[i] = 1.0 / (i + 1);
+    std::mt19937 gen(seed);
+    std::discrete_distribution<int> zipf(weights.begin(), weights.end());
+    std::vector<uint16_t> tokens(n);
+    for (auto &t : tokens)
+        t = zipf(gen);
+    return tokens;
+}
+
+TEST(TokenCoder, RoundTrip) {
+    Tokens16 coder;
+    // Blocks of different alphabets through the same coder
+    for (size_t vocabulary : {2, 300, 50000}) {
+        std::vector<uint16_t> tokens = Zipf(100000, vocabulary, vocabulary);
+        EXPECT_TRUE(RoundTrip(coder, tokens) == tokens) << vocabulary;
+    }
+
+    // Ids spread over the whole alphabet
+    std::mt19937 gen(1);
+    std::vector<uint16_t> spread(20000);
+    for (auto &t : spread)
+        t = gen() % 40 * 1637;
+    EXPECT_TRUE(RoundTrip(coder, spread) == spread);
+
+    TokenCoder<uint32_t, 1 << 20> wide;
+    std::normal_distribution<> normal(0, 3e4);
+    std::vector<uint32_t> ids(50000);
+    for (auto &id : ids)
+        id = std::min<uint32_t>(std::abs(normal(gen)), (1 << 20) - 1);
+    EXPECT_TRUE(RoundTrip(wide, ids) == ids);
+
+    // Small alphabets of wide symbols
+    TokenCoder<uint16_t, 10> digits;
+    std::vector<uint16_t> numbers(5000);
+    for (auto &d : numbers)
+        d = gen() % 10;
+    EXPECT_TRUE(RoundTrip(digits, numbers) == numbers);
+}
+
+TEST(TokenCoder, Bytes) {
+    // Bytes are Huffman blocks
+    std::string text = "the quick brown fox jumps over the lazy dog";
+    std::vector<uint8_t> bytes(text.begin(), text.end());
+    std::vector<char> coded, expected;
+    TokenCoder<uint8_t, 256> coder;
+    EXPECT_TRUE(RoundTrip(coder, bytes, &coded) == bytes);
+    Huffman::EncodeBlock(text.data(), text.size(), expected);
+    EXPECT_TRUE(coded == expected);
+
+    // Even with no bytes at all
+    std::vector<uint8_t> empty;
+    EXPECT_TRUE(RoundTrip(coder, empty, &coded) == empty);
+    EXPECT_TRUE(coded.empty());
+    char stray = 0;
+    EXPECT_EQ(coder.Decode(&stray, 1, nullptr, 0), kDecodeCorrupt);
+}
+
+TEST(TokenCoder, SmallBlocks) {
+    Tokens16 coder;
+    std::vector<char> coded;
+    for (auto &tokens : {std::vector<uint16_t>{},
+                         std::vector<uint16_t>{0},
+                         std::vector<uint16_t>(1000, 65535),
+                         std::vector<uint16_t>{7, 7, 7, 8},
+                         std::vector<uint16_t>{0, 65535}}) {
+        EXPECT_TRUE(RoundTrip(coder, tokens, &coded) == tokens);
+        // A single symbol needs no codes
+        if (tokens.size() == 1000) {
+            EXPECT_EQ(coded.size(), 1 + 1 + 3 + 1);
+        }
+    }
+}
+
+TEST(TokenCoder, Headers) {
+    Tokens16 coder;
+    std::vector<char> coded;
+
+    // A few symbols far apart take a few bytes each
+    std::vector<uint16_t> sparse;
+    for (int i = 0; i < 1000; i++)
+        sparse.push_back(i % 4 * 20000);
+    EXPECT_TRUE(RoundTrip(coder, sparse, &coded) == sparse);
+    EXPECT_EQ(coded[0], Tokens16::kSparse);
+    EXPECT_LT(coded.size(), 2 + 4 * 4 + 1000 * 2 / 8 + 1);
+
+    // Most of a range takes about a bit each, lengths are much the same
+    std::vector<uint16_t> dense;
+    for (int i = 0; i < 1000; i++)
+        dense.push_back(i % 200 * 2);
+    EXPECT_TRUE(RoundTrip(coder, dense, &coded) == dense);
+    EXPECT_EQ(coded[0], Tokens16::kDense);
+    EXPECT_LT(coded.size(), 3 + Tokens16::kLengthBytes + 400 / 4 + 1000);
+}
+
+TEST(TokenCoder, LongCodes) {
+    // Fibonacci frequencies over 26 symbols would give codes of 25 bits
+    std::vector<uint16_t> tokens;
+    size_t a = 1, b = 1;
+    for (uint16_t s = 0; s < 26; s++) {
+        tokens.insert(tokens.end(), a, s * 1000);
+        b += a;
+        a = b - a;
+    }
+    Tokens16 coder;
+    EXPECT_TRUE(RoundTrip(coder, tokens) == tokens);
+}
+
+TEST(TokenCoder, Errors) {
+    TokenCoder<uint16_t, 1000> coder;
+    std::vector<uint16_t> tokens = {1, 2, 999, 1000};
+    std::vector<char> coded;
+    EXPECT_FALSE(coder.Encode(tokens.data(), tokens.size(), coded));
+
+    tokens = Zipf(10000, 999, 2);
+    std::vector<uint16_t> out(tokens.size());
+    ASSERT_TRUE(coder.Encode(tokens.data(), tokens.size(), coded));
+    size_t n = coded.size();
+    coded.resize(n + BitReader::kPadding, 0);
+    EXPECT_EQ(coder.Decode(coded.data(), n, out.data(), out.size()),
+              kDecodeOk);
+    EXPECT_EQ(coder.Decode(coded.data(), n - 10, out.data(), out.size()),
+              kDecodeTruncated);
+    EXPECT_EQ(coder.Decode(coded.data(), 3, out.data(), out.size()),
+              kDecodeTruncated);
+
+    // An unknown kind, a symbol out of the alphabet, an incomplete code,
+    // and an incomplete code of lengths
+    std::string lengths = std::string("\x01\x03\x10", 3) +
+                          std::string(Tokens16::kLengthBytes - 1, '\0');
+    for (std::string block : {std::string("\x02\x01\x00\x00", 4),
+                              std::string("\x00\x02\x01\x01\xe6\x07\x01", 7),
+                              std::string("\x00\x02\x01\x01\x01\x02", 6),
+                              lengths}) {
+        block.resize(block.size() + BitReader::kPadding, '\0');
+        EXPECT_EQ(coder.Decode(block.data(),
+                               block.size() - BitReader::kPadding,
+                               out.data(), 10),
+                  kDecodeCorrupt);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,483 @@
+#ifndef TOKEN_H_
+#define TOKEN_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#include "bstream.h"
+#include "huffman.h"
+
+// Canonical code lookup over any alphabet: kRootBits of the code index a
+// root table, longer codes go on in the subtable of their first kRootBits,
+// sized for the longest of them
+template <typename Symbol>
+class TwoLevelTable {
+  public:
+    static constexpr size_t kRootBits = 11;
+
+    // The n present symbols, by increasing symbol, and their lengths.
+    // Return false unless they form a complete prefix code of at most
+    // `max_len` bits
+    bool Build(const Symbol *symbols, const uint8_t *lens, size_t n,
+               size_t max_len);
+    // A complete code decodes any bit sequence, nothing to check here
+    Symbol Decode(BitReader& br) const;
+
+  private:
+    struct Entry {
+        // The symbol, or for a root entry with a subtable its offset in sub
+        uint32_t value;
+        // Bits the entry resolves
+        uint8_t len;
+        // Index bits of the subtable, 0 if none
+        uint8_t sub;
+    };
+    Entry root[1 << kRootBits];
+    std::vector<Entry> sub;
+    // Scratch: indices of the symbols by length, and subtable bits of
+    // every root prefix
+    std::vector<uint32_t> by_length;
+    uint8_t sub_bits[1 << kRootBits];
+};
+
+// Huffman blocks over an alphabet of kAlphabet symbols of type Symbol, such
+// as 16-bit token ids or delta-coded timestamps, each block with its own
+// table. Byte symbols go through Huffman::EncodeBlock and DecodeBlock, with
+// their kernels and multi-symbol tables. Larger alphabets get a sparse or a
+// dense table, whichever is smaller, and two-level decoding tables. An
+// empty block of bytes is coded as nothing, as a Huffman block has at
+// least one symbol.
+//
+// Block layout, but for bytes:
+//   kind       1 byte, kSparse or kDense
+//   count      varint (7 bits per byte, least significant first, high bit
+//              set on all bytes but the last): the number of symbols
+//              present for kSparse, the largest one + 1 for kDense
+//   kSparse    for each symbol present, by increasing symbol, its distance
+//              to the previous one - 1 (varint, the symbol itself for the
+//              first) and its length (1 byte)
+//   kDense     the lengths of all symbols up to the largest, 0 for absent
+//              ones, coded with a Huffman code of their own: its length
+//              for every value 0 to kMaxLength, 4 bits each (low bits
+//              first), then the codes, padded to a byte
+//   codes      canonical, as in Huffman blocks
+// The only symbol of a block has a length of 0 and no codes.
+template <typename Symbol, size_t kAlphabet>
+class TokenCoder {
+  public:
+    static_assert(std::is_unsigned<Symbol>::value,
+                  "symbols must be unsigned integers");
+    static_assert(kAlphabet >= 2 && kAlphabet - 1 <=
+                          std::numeric_limits<Symbol>::max(),
+                  "the alphabet must fit in the symbol type");
+    static_assert(kAlphabet <= size_t(1) << 24,
+                  "alphabets are at most 24 bits");
+
+    enum Kind : uint8_t {
+        kSparse = 0,
+        kDense = 1,
+    };
+    static constexpr bool kBytes = sizeof(Symbol) == 1 && kAlphabet == 256;
+    // Longer codes would only serve symbols rare enough to lose little,
+    // and keep subtables small
+    static constexpr size_t kMaxLength = kAlphabet <= (1 << 16) ? 20 : 28;
+    // The code of lengths in kDense tables
+    static constexpr size_t kMaxLengthLength = 15;
+    static constexpr size_t kLengthBytes = (kMaxLength + 2) / 2;
+
+    // Append the block of `in`, fewer than 2^40 symbols, return false if
+    // a symbol is not in the alphabet
+    bool Encode(const Symbol *in, size_t n, std::vector<char> &out);
+    // Decode the `raw` symbols of a block, `in` must be followed by
+    // BitReader::kPadding readable bytes
+    DecodeStatus Decode(const char *in, size_t n, Symbol *out, size_t raw);
+
+  private:
+    static void PutVarint(std::vector<char> &out, uint64_t value);
+    static size_t VarintSize(uint64_t value);
+    // Read a varint at `pos`, return false if it runs past `n`
+    static bool GetVarint(const char *in, size_t n, size_t &pos,
+                          uint64_t &value);
+    // Code lengths of the present symbols, none longer than kMaxLength
+    void BuildLengths();
+    // Replace the n > 1 increasing weights by code lengths of at most
+    // `max_len` bits, flattening the weights until the longest fits
+    static void LimitedLengths(std::vector<size_t> &weights,
+                               std::vector<size_t> &depths, size_t max_len);
+    // Lengths of the code of kDense tables, complete even for one value
+    static void LengthCode(const size_t counts[kMaxLength + 1],
+                           uint8_t lens[kMaxLength + 1]);
+
+    // Scratch kept from block to block. Indexed by symbol, only the
+    // entries of present symbols are set, and freq is zeroed again
+    std::vector<size_t> freq;
+    std::vector<uint8_t> lens;
+    std::vector<uint32_t> codes;
+    // Present symbols by increasing symbol, and frequency << 24 | symbol
+    // by increasing frequency
+    std::vector<Symbol> present;
+    std::vector<uint64_t> order;
+    std::vector<size_t> weights;
+    std::vector<size_t> depths;
+    // Codes of the present symbols, and their lengths, read back when
+    // decoding
+    std::vector<uint32_t> present_codes;
+    std::vector<uint8_t> present_lens;
+    // Decoding
+    TwoLevelTable<Symbol> table;
+    TwoLevelTable<uint8_t> length_table;
+};
+
+template <typename Symbol>
+bool TwoLevelTable<Symbol>::Build(const Symbol *symbols, const uint8_t *lens,
+                                  size_t n, size_t max_len) {
+    // Count codes by length, and check that they fill the code space
+    size_t count[Huffman::kMaxCodeLength + 1] = {0};
+    uint64_t kraft = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (lens[i] == 0 || lens[i] > max_len)
+            return false;
+        count[lens[i]]++;
+        kraft += uint64_t(1) << (Huffman::kMaxCodeLength - lens[i]);
+    }
+    if (kraft != uint64_t(1) << Huffman::kMaxCodeLength)
+        return false;
+
+    // Symbols by length then symbol, the order of canonical codes
+    size_t start[Huffman::kMaxCodeLength + 2] = {0};
+    for (size_t len = 1; len <= max_len; len++)
+        start[len + 1] = start[len] + count[len];
+    by_length.resize(n);
+    for (size_t i = 0; i < n; i++)
+        by_length[start[lens[i]]++] = i;
+    // start[len] now ends the symbols of length len
+
+    // Bits of every subtable, from the longest code under its prefix
+    memset(sub_bits, 0, sizeof(sub_bits));
+    uint32_t code = 0;
+    size_t prev = 0;
+    for (size_t k = 0; k < n; k++) {
+        size_t len = lens[by_length[k]];
+        code <<= len - prev;
+        prev = len;
+        if (len > kRootBits) {
+            uint8_t &bits = sub_bits[code >> (len - kRootBits)];
+            bits = std::max(bits, static_cast<uint8_t>(len - kRootBits));
+        }
+        code++;
+    }
+    size_t offset = 0;
+    for (size_t p = 0; p < (size_t(1) << kRootBits); p++) {
+        if (sub_bits[p] == 0)
+            continue;
+        root[p] = {static_cast<uint32_t>(offset), kRootBits, sub_bits[p]};
+        offset += size_t(1) << sub_bits[p];
+    }
+    sub.resize(offset);
+
+    code = 0;
+    prev = 0;
+    for (size_t k = 0; k < n; k++) {
+        size_t i = by_length[k], len = lens[i];
+        code <<= len - prev;
+        prev = len;
+        Entry e = {symbols[i], static_cast<uint8_t>(len), 0};
+        if (len <= kRootBits) {
+            size_t first = size_t(code) << (kRootBits - len);
+            size_t last = first + (size_t(1) << (kRootBits - len));
+            std::fill(root + first, root + last, e);
+        } else {
+            size_t rest = len - kRootBits;
+            const Entry &r = root[code >> rest];
+            e.len = rest;
+            size_t low = code & ((uint32_t(1) << rest) - 1);
+            size_t first = r.value + (low << (r.sub - rest));
+            size_t last = first + (size_t(1) << (r.sub - rest));
+            std::fill(sub.begin() + first, sub.begin() + last, e);
+        }
+        code++;
+    }
+    return true;
+}
+
+template <typename Symbol>
+Symbol TwoLevelTable<Symbol>::Decode(BitReader& br) const {
+    Entry e = root[br.PeekBits(kRootBits)];
+    if (e.sub == 0) {
+        br.SkipBits(e.len);
+        return e.value;
+    }
+    br.SkipBits(kRootBits);
+    Entry s = sub[e.value + br.PeekBits(e.sub)];
+    br.SkipBits(s.len);
+    return s.value;
+}
+
+template <typename Symbol, size_t kAlphabet>
+bool TokenCoder<Symbol, kAlphabet>::Encode(const Symbol *in, size_t n,
+                                           std::vector<char> &out) {
+    if constexpr (kBytes) {
+        if (n > 0)
+            Huffman::EncodeBlock(reinterpret_cast<const char *>(in), n, out);
+        return true;
+    } else {
+        if constexpr (kAlphabet - 1 < std::numeric_limits<Symbol>::max()) {
+            for (size_t i = 0; i < n; i++)
+                if (in[i] >= kAlphabet)
+                    return false;
+        }
+        freq.resize(kAlphabet);
+        lens.resize(kAlphabet);
+        codes.resize(kAlphabet);
+        present.clear();
+        for (size_t i = 0; i < n; i++)
+            if (freq[in[i]]++ == 0)
+                present.push_back(in[i]);
+        std::sort(present.begin(), present.end());
+        BuildLengths();
+
+        // The smaller table: gaps are short when few symbols are present,
+        // coded lengths when most of the range is
+        size_t sparse = 0, largest = present.empty() ? 0 : present.back();
+        for (size_t i = 0; i < present.size(); i++)
+            sparse += 1 + VarintSize(i == 0 ? present[0]
+                                            : present[i] - present[i - 1] - 1);
+        size_t length_freq[kMaxLength + 1] = {0};
+        uint8_t length_lens[kMaxLength + 1];
+        length_freq[0] = largest + 1 - present.size();
+        for (Symbol s : present)
+            length_freq[lens[s]]++;
+        LengthCode(length_freq, length_lens);
+        size_t dense_bits = 0;
+        for (size_t v = 0; v <= kMaxLength; v++)
+            dense_bits += length_freq[v] * length_lens[v];
+        bool is_dense = present.size() > 1 &&
+                        VarintSize(largest + 1) + kLengthBytes +
+                                (dense_bits + 7) / 8 <
+                                VarintSize(present.size()) + sparse;
+        if (is_dense) {
+            out.push_back(kDense);
+            PutVarint(out, largest + 1);
+            for (size_t v = 0; v <= kMaxLength; v += 2)
+                out.push_back(static_cast<char>(
+                        length_lens[v] |
+                        (v < kMaxLength ? length_lens[v + 1] : 0) << 4));
+            uint32_t length_codes[kMaxLength + 1];
+            Huffman::AssignCodes(length_lens, kMaxLength + 1, length_codes);
+            BitWriter bw(out);
+            for (size_t s = 0; s <= largest; s++) {
+                size_t v = freq[s] != 0 ? lens[s] : 0;
+                bw.PutBits(length_codes[v], length_lens[v]);
+            }
+            bw.Close();
+        } else {
+            out.push_back(kSparse);
+            PutVarint(out, present.size());
+            for (size_t i = 0; i < present.size(); i++) {
+                PutVarint(out, i == 0 ? present[0]
+                                      : present[i] - present[i - 1] - 1);
+                out.push_back(static_cast<char>(lens[present[i]]));
+            }
+        }
+
+        // Canonical codes, then the code of every symbol
+        if (present.size() > 1) {
+            present_lens.resize(present.size());
+            present_codes.resize(present.size());
+            for (size_t i = 0; i < present.size(); i++)
+                present_lens[i] = lens[present[i]];
+            Huffman::AssignCodes(present_lens.data(), present.size(),
+                                 present_codes.data());
+            for (size_t i = 0; i < present.size(); i++)
+                codes[present[i]] = present_codes[i];
+            Kernels::PackCodes(in, n, codes.data(), lens.data(), out);
+        }
+        for (Symbol s : present)
+            freq[s] = 0;
+        return true;
+    }
+}
+
+template <typename Symbol, size_t kAlphabet>
+void TokenCoder<Symbol, kAlphabet>::BuildLengths() {
+    size_t n = present.size();
+    if (n == 1)
+        lens[present[0]] = 0;
+    if (n <= 1)
+        return;
+    // Sorting plain keys saves looking frequencies up at every comparison
+    order.resize(n);
+    for (size_t i = 0; i < n; i++)
+        order[i] = uint64_t(freq[present[i]]) << 24 | present[i];
+    std::sort(order.begin(), order.end());
+    weights.resize(n);
+    for (size_t i = 0; i < n; i++)
+        weights[i] = order[i] >> 24;
+    LimitedLengths(weights, depths, kMaxLength);
+    for (size_t i = 0; i < n; i++)
+        lens[order[i] & 0xFFFFFF] = depths[i];
+}
+
+template <typename Symbol, size_t kAlphabet>
+void TokenCoder<Symbol, kAlphabet>::LimitedLengths(std::vector<size_t> &weights,
+                                                   std::vector<size_t> &depths,
+                                                   size_t max_len) {
+    // Halving keeps the order of the weights, and the least frequent
+    // symbol is the deepest
+    for (;;) {
+        depths = weights;
+        Huffman::MinimumRedundancy(depths.data(), depths.size());
+        if (depths[0] <= max_len)
+            return;
+        for (size_t &w : weights)
+            w = 1 + w / 2;
+    }
+}
+
+template <typename Symbol, size_t kAlphabet>
+void TokenCoder<Symbol, kAlphabet>::LengthCode(
+        const size_t counts[kMaxLength + 1], uint8_t lens[kMaxLength + 1]) {
+    std::vector<size_t> values, weights, depths;
+    for (size_t v = 0; v <= kMaxLength; v++) {
+        lens[v] = 0;
+        if (counts[v] != 0)
+            values.push_back(v);
+    }
+    // A single value still gets a 1-bit code, beside an unused one
+    if (values.size() == 1) {
+        lens[values[0]] = 1;
+        lens[values[0] == 0 ? 1 : 0] = 1;
+        return;
+    }
+    if (values.empty())
+        return;
+    std::sort(values.begin(), values.end(), [&](size_t a, size_t b) {
+        return counts[a] < counts[b] || (counts[a] == counts[b] && a < b);
+    });
+    for (size_t v : values)
+        weights.push_back(counts[v]);
+    LimitedLengths(weights, depths, kMaxLengthLength);
+    for (size_t i = 0; i < values.size(); i++)
+        lens[values[i]] = depths[i];
+}
+
+template <typename Symbol, size_t kAlphabet>
+DecodeStatus TokenCoder<Symbol, kAlphabet>::Decode(const char *in, size_t n,
+                                                   Symbol *out, size_t raw) {
+    if constexpr (kBytes) {
+        if (raw == 0)
+            return n == 0 ? kDecodeOk : kDecodeCorrupt;
+        return Huffman::DecodeBlock(in, n, reinterpret_cast<char *>(out), raw);
+    } else {
+        if (n < 1)
+            return kDecodeTruncated;
+        uint8_t kind = in[0];
+        size_t pos = 1;
+        uint64_t count;
+        if (kind > kDense)
+            return kDecodeCorrupt;
+        if (!GetVarint(in, n, pos, count))
+            return kDecodeTruncated;
+        if (count > kAlphabet)
+            return kDecodeCorrupt;
+
+        present.clear();
+        present_lens.clear();
+        if (kind == kDense) {
+            if (n - pos < kLengthBytes)
+                return kDecodeTruncated;
+            uint8_t values[kMaxLength + 1], value_lens[kMaxLength + 1];
+            size_t used = 0;
+            for (size_t v = 0; v <= kMaxLength; v++) {
+                uint8_t len = in[pos + v / 2] >> (v % 2 * 4) & 0xF;
+                if (len == 0)
+                    continue;
+                values[used] = v;
+                value_lens[used++] = len;
+            }
+            pos += kLengthBytes;
+            if (!length_table.Build(values, value_lens, used,
+                                    kMaxLengthLength))
+                return kDecodeCorrupt;
+            BitReader br(in + pos, n - pos);
+            for (size_t s = 0; s < count; s++) {
+                uint8_t len = length_table.Decode(br);
+                if (len == 0)
+                    continue;
+                present.push_back(s);
+                present_lens.push_back(len);
+            }
+            if (br.Overrun())
+                return kDecodeTruncated;
+            pos += (br.Position() + 7) / 8;
+        } else {
+            uint64_t symbol = 0;
+            for (size_t i = 0; i < count; i++) {
+                uint64_t gap;
+                if (!GetVarint(in, n, pos, gap) || pos == n)
+                    return kDecodeTruncated;
+                symbol = i == 0 ? gap : symbol + 1 + gap;
+                if (gap >= kAlphabet || symbol >= kAlphabet)
+                    return kDecodeCorrupt;
+                present.push_back(symbol);
+                present_lens.push_back(in[pos++]);
+            }
+        }
+
+        if (present.empty())
+            return raw == 0 ? kDecodeOk : kDecodeCorrupt;
+        if (present.size() == 1) {
+            if (present_lens[0] != 0)
+                return kDecodeCorrupt;
+            std::fill(out, out + raw, present[0]);
+            return kDecodeOk;
+        }
+        if (!table.Build(present.data(), present_lens.data(), present.size(),
+                         kMaxLength))
+            return kDecodeCorrupt;
+        BitReader br(in + pos, n - pos);
+        for (size_t i = 0; i < raw; i++)
+            out[i] = table.Decode(br);
+        return br.Overrun() ? kDecodeTruncated : kDecodeOk;
+    }
+}
+
+template <typename Symbol, size_t kAlphabet>
+void TokenCoder<Symbol, kAlphabet>::PutVarint(std::vector<char> &out,
+                                              uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+template <typename Symbol, size_t kAlphabet>
+size_t TokenCoder<Symbol, kAlphabet>::VarintSize(uint64_t value) {
+    size_t size = 1;
+    for (; value >= 0x80; value >>= 7)
+        size++;
+    return size;
+}
+
+template <typename Symbol, size_t kAlphabet>
+bool TokenCoder<Symbol, kAlphabet>::GetVarint(const char *in, size_t n,
+                                              size_t &pos, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (pos == n)
+            return false;
+        unsigned char byte = in[pos++];
+        value |= uint64_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+#endif  // TOKEN_H_
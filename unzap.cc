@@ -1,20 +1,63 @@
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <iostream>
 #include <fstream>
+#include <thread>
 #include "huffman.h"
+#include "pipeline.h"
 
 int main(int argc, char* argv[]) {
   if (argc != 3) {
     std::cerr << "Usage: " << argv[0] << " <zapfile> <outputfile>" << std::endl;
     exit(1);
   }
-  std::ifstream input_file(argv[1], std::ios::in | std::ios::binary);
-  if (!input_file.is_open()) {
+  int input_fd = open(argv[1], O_RDONLY);
+  if (input_fd < 0) {
     std::cerr << "Error: cannot open zap file " << argv[1] << std::endl;
     exit(1);
   }
-  std::ofstream output_file(argv[2], std::ios::out 
-                    | std::ios::trunc | std::ios::binary);
-  Huffman::Decompress(input_file, output_file);
+  char magic[sizeof(BlockCodec::kMagic)];
+  size_t got;
+  if (!Pipeline::ReadAll(input_fd, magic, sizeof(magic), 0, got)) {
+    std::cerr << "Error: cannot read zap file " << argv[1] << std::endl;
+    exit(1);
+  }
+
+  if (BlockCodec::HasOldMagic(magic, got)) {
+    std::cerr << "Error: zap file " << argv[1]
+              << " is in an older framed format, without checksums" << std::endl;
+    exit(1);
+  }
+
+  unsigned int num_threads = std::max(1u, std::thread::hardware_concurrency());
+  // Files without the magic are in the original single-stream format,
+  // decoded from guessed offsets as they have no block index
+  if (!BlockCodec::HasMagic(magic, got)) {
+    close(input_fd);
+    std::ifstream input_file(argv[1], std::ios::in | std::ios::binary);
+    std::ofstream output_file(argv[2], std::ios::out 
+                      | std::ios::trunc | std::ios::binary);
+    if (Huffman::DecompressParallel(input_file, output_file, num_threads) != kDecodeOk) {
+      std::cerr << "Error: corrupted zap file " << argv[1] << std::endl;
+      exit(1);
+    }
+    std::cout << "Decompressed zap file " << argv[1]
+              << " into output file " << argv[2] << std::endl;
+    return 0;
+  }
+
+  int output_fd = open(argv[2], O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (output_fd < 0) {
+    std::cerr << "Error: cannot open output file " << argv[2] << std::endl;
+    exit(1);
+  }
+  if (!Pipeline::Decompress(input_fd, output_fd, num_threads)) {
+    std::cerr << "Error: corrupted zap file " << argv[1] << std::endl;
+    exit(1);
+  }
+  close(input_fd);
+  close(output_fd);
   std::cout << "Decompressed zap file " << argv[1]
             << " into output file " << argv[2] << std::endl;
 }
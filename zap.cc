@@ -1,18 +1,237 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
 #include <iostream>
 #include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+#include "daemon.h"
 #include "huffman.h"
+#include "pipeline.h"
+
+// Predict how the blocks of a file would be coded, coding only the first
+// block of each type, to time it
+static int Estimate(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Error: cannot open input file " << filename << std::endl;
+    return 1;
+  }
+  const char *names[] = {"huffman", "stored", "tans", "rle", "order1"};
+  size_t blocks[kBlockOrder1 + 1] = {0};
+  // Seconds per byte of every coder, from the first block it codes
+  double rate[kBlockOrder1 + 1] = {0};
+  size_t total = 0, sampled = 0;
+  double bytes = 0, seconds = 0, spent = 0;
+  std::vector<char> data(BlockCodec::kDefaultBlockSize);
+  for (off_t offset = 0; ; ) {
+    size_t got;
+    if (!Pipeline::ReadAll(fd, data.data(), data.size(), offset, got)) {
+      std::cerr << "Error: failed to read " << filename << std::endl;
+      return 1;
+    }
+    if (got == 0)
+      break;
+    offset += got;
+    auto start = std::chrono::steady_clock::now();
+    BlockEstimate estimate;
+    BlockType type = BlockCodec::Estimate(data.data(), got, estimate);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    // Coding goes through the same estimate first
+    seconds += elapsed.count();
+    if (blocks[type]++ == 0) {
+      BlockEstimate timed;
+      BlockCodec::Estimate(data.data(), got, timed, true);
+      rate[type] = timed.seconds / got;
+    }
+    elapsed = std::chrono::steady_clock::now() - start;
+    spent += elapsed.count();
+    bytes += BlockCodec::kHeaderSize + estimate.bytes[type];
+    seconds += rate[type] * got;
+    total += got;
+    sampled += estimate.sampled;
+  }
+  close(fd);
+  bytes += sizeof(BlockCodec::kMagic) + BlockCodec::kEndSize;
+
+  std::cout << "Input " << total << " bytes, sampled " << sampled << std::endl;
+  for (int type = 0; type <= kBlockOrder1; type++)
+    if (blocks[type] > 0)
+      std::cout << "  " << names[type] << ": " << blocks[type] << " blocks" << std::endl;
+  std::cout << "Predicted size " << size_t(bytes) << " bytes, ratio "
+            << (total > 0 ? bytes / total : 0) << std::endl;
+  std::cout << "Predicted single-thread compression time " << seconds << " s" << std::endl;
+  std::cout << "Estimation time " << spent << " s" << std::endl;
+  return 0;
+}
+
+// Send a whole file to zapd and write its answer, return false if it
+// can't take it
+static bool CompressWithDaemon(const std::string &socket, const char *input,
+                               int output_fd) {
+  std::ifstream input_file(input, std::ios::in | std::ios::binary);
+  std::vector<char> data((std::istreambuf_iterator<char>(input_file)),
+                         std::istreambuf_iterator<char>());
+  ZapClient client;
+  if (!input_file.is_open() || data.size() > ZapServer::kMaxRequest ||
+      !client.Connect(socket))
+    return false;
+  uint8_t status;
+  std::vector<char> zapped;
+  if (!client.Call(kDaemonCompress, data.data(), data.size(), status, zapped) ||
+      status != kDecodeOk)
+    return false;
+  return Pipeline::WriteAll(output_fd, zapped.data(), zapped.size());
+}
+
+// Open the zap file for a new member after the existing ones, return -1
+// unless it is empty or framed
+static int OpenForAppend(const char *filename, off_t &size) {
+  int fd = open(filename, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return -1;
+  size = lseek(fd, 0, SEEK_END);
+  char magic[sizeof(BlockCodec::kMagic)];
+  size_t got;
+  if (size < 0 || (size > 0 &&
+      (!Pipeline::ReadAll(fd, magic, sizeof(magic), 0, got) ||
+       !BlockCodec::HasMagic(magic, got)))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
 
 int main(int argc, char* argv[]) {
-  if (argc != 3) {
-    std::cerr << "Usage: " << argv[0] << " <inputfile> <zapfile>" << std::endl;
+  unsigned int num_threads = 0;
+  bool single_stream = false;
+  bool estimate = false;
+  bool append = false;
+  DedupMode dedup = kDedupNone;
+  std::string daemon_socket;
+  int arg = 1;
+  // Options come before the file names
+  while (arg < argc && std::string(argv[arg]).rfind("--", 0) == 0) {
+    std::string option(argv[arg]);
+    if (option == "--threads" && arg + 1 < argc) {
+      num_threads = std::stoul(argv[arg + 1]);
+      arg += 2;
+    } else if (option == "--single-stream") {
+      single_stream = true;
+      arg++;
+    } else if (option == "--daemon-socket" && arg + 1 < argc) {
+      daemon_socket = argv[arg + 1];
+      arg += 2;
+    } else if (option == "--dedup" && arg + 1 < argc &&
+               (std::string(argv[arg + 1]) == "fixed" ||
+                std::string(argv[arg + 1]) == "content")) {
+      dedup = std::string(argv[arg + 1]) == "fixed" ? kDedupFixed : kDedupContent;
+      arg += 2;
+    } else if (option == "--append") {
+      append = true;
+      arg++;
+    } else if (option == "--estimate") {
+      estimate = true;
+      arg++;
+    } else {
+      break;
+    }
+  }
+  if (estimate && argc - arg == 1)
+    return Estimate(argv[arg]);
+  // Single-stream files can't be added to, their header holds the count
+  if (estimate || (append && single_stream) || argc - arg != 2) {
+    std::cerr << "Usage: " << argv[0] << " [--threads <n>] [--single-stream]"
+              << " [--append] [--dedup fixed|content] [--daemon-socket <path>]"
+              << " <inputfile> <zapfile>" << std::endl;
+    std::cerr << "       " << argv[0] << " --estimate <inputfile>" << std::endl;
     exit(1);
   }
-  std::ifstream input_file(argv[1], std::ios::in | std::ios::binary);
-  if (!input_file.is_open()) {
-    std::cerr << "Error: cannot open input file " << argv[1] << std::endl;
+  // zapd requests carry no options, it would code without references
+  if (dedup != kDedupNone && !daemon_socket.empty()) {
+    std::cerr << "Error: --dedup can't be used with --daemon-socket" << std::endl;
     exit(1);
   }
-  std::ofstream output_file(argv[2], std::ios::out | std::ios::trunc | std::ios::binary);
-  Huffman::Compress(input_file, output_file);
-  std::cout << "Compressed input file " << argv[1] << " into zap file " << argv[2] << std::endl;
+
+  // One table for the whole file, in the original format
+  if (single_stream) {
+    std::ifstream input_file(argv[arg], std::ios::in | std::ios::binary);
+    if (!input_file.is_open()) {
+      std::cerr << "Error: cannot open input file " << argv[arg] << std::endl;
+      exit(1);
+    }
+    std::ofstream output_file(argv[arg + 1], std::ios::out | std::ios::trunc | std::ios::binary);
+    if (num_threads > 0)
+      Huffman::CompressParallel(input_file, output_file, num_threads);
+    else
+      Huffman::Compress(input_file, output_file);
+    std::cout << "Compressed input file " << argv[arg] << " into zap file " << argv[arg + 1] << std::endl;
+    return 0;
+  }
+
+  // Check the input before the zap file is truncated or created
+  int input_fd = open(argv[arg], O_RDONLY);
+  if (input_fd < 0) {
+    std::cerr << "Error: cannot open input file " << argv[arg] << std::endl;
+    exit(1);
+  }
+  int output_fd;
+  off_t append_at = 0;
+  if (append) {
+    output_fd = OpenForAppend(argv[arg + 1], append_at);
+    if (output_fd < 0) {
+      std::cerr << "Error: cannot append to zap file " << argv[arg + 1] << std::endl;
+      exit(1);
+    }
+  } else {
+    output_fd = open(argv[arg + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
+      std::cerr << "Error: cannot open zap file " << argv[arg + 1] << std::endl;
+      exit(1);
+    }
+  }
+
+  // Let a running zapd do the work, or do it here if it can't
+  if (!daemon_socket.empty()) {
+    if (CompressWithDaemon(daemon_socket, argv[arg], output_fd)) {
+      close(input_fd);
+      close(output_fd);
+      std::cout << "Compressed input file " << argv[arg] << " into zap file " << argv[arg + 1] << std::endl;
+      return 0;
+    }
+    std::cerr << "Warning: zapd on " << daemon_socket
+              << " did not compress the file, compressing locally" << std::endl;
+    // Drop whatever was written before it failed
+    if (ftruncate(output_fd, append_at) < 0 ||
+        lseek(output_fd, append_at, SEEK_SET) < 0) {
+      std::cerr << "Error: cannot restore zap file " << argv[arg + 1] << std::endl;
+      exit(1);
+    }
+  }
+
+  if (num_threads == 0)
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  DedupStats stats;
+  if (!Pipeline::Compress(input_fd, output_fd, num_threads,
+                          BlockCodec::kDefaultBlockSize, dedup, &stats)) {
+    // Leave an appended file as it was
+    if (append && ftruncate(output_fd, append_at) < 0)
+      std::cerr << "Error: cannot restore zap file " << argv[arg + 1] << std::endl;
+    std::cerr << "Error: failed to compress " << argv[arg] << std::endl;
+    exit(1);
+  }
+  close(input_fd);
+  close(output_fd);
+  std::cout << "Compressed input file " << argv[arg] << " into zap file " << argv[arg + 1] << std::endl;
+  if (dedup != kDedupNone) {
+    uint64_t unique = stats.bytes - stats.duplicate_bytes;
+    std::cout << "Dedup: " << stats.duplicates << " of " << stats.blocks
+              << " blocks repeated, ratio " << (unique > 0 ? double(stats.bytes) / unique : 1)
+              << ", hashing " << stats.bytes / std::max(stats.hash_seconds, 1e-9) / (1 << 20)
+              << " MiB/s, index " << stats.index_bytes << " bytes" << std::endl;
+  }
 }
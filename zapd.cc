@@ -0,0 +1,39 @@
+#include <signal.h>
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include "daemon.h"
+
+int main(int argc, char* argv[]) {
+  unsigned int num_threads = 0;
+  int arg = 1;
+  if (arg + 1 < argc && std::string(argv[arg]) == "--threads") {
+    num_threads = std::stoul(argv[arg + 1]);
+    arg += 2;
+  }
+  if (argc - arg != 1) {
+    std::cerr << "Usage: " << argv[0] << " [--threads <n>] <socket>" << std::endl;
+    exit(1);
+  }
+  if (num_threads == 0)
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+  // Block the signals before the threads start, so only sigwait sees them
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  ZapServer server(argv[arg], num_threads);
+  if (!server.Start()) {
+    std::cerr << "Error: cannot listen on " << argv[arg] << std::endl;
+    exit(1);
+  }
+  std::cout << "Listening on " << argv[arg] << " with " << num_threads
+            << " workers" << std::endl;
+  int signal;
+  sigwait(&signals, &signal);
+  server.Stop();
+}